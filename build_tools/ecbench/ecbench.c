@@ -0,0 +1,536 @@
+/*
+ * ecbench - Run the DAHDI software echo cancellers in userspace.
+ *
+ * The echo canceller modules are built against a small shim of the kernel
+ * API (include/ecbench-shim.h) and register their factories as the program
+ * starts.  Each canceller is then fed a far end reference and a near end
+ * signal with a synthetic echo of the reference added to it, one chunk at a
+ * time like the DAHDI core does, and ecbench reports:
+ *
+ *   - ERLE, from the echo that was added and what is left of it in the
+ *     output, over time (-v) and at the end of the run,
+ *   - convergence time, the first time ERLE got within 3 dB of its final
+ *     value,
+ *   - the time spent in echocan_process, in ns per sample, and how many
+ *     channels one core could keep up with at that rate.
+ *
+ * With -E, -C or -T, a run that does worse than the given limit is marked
+ * FAIL and ecbench exits with status 2, so that it can be used as a check
+ * ("make ecbench-check").
+ *
+ * The reference and the near end speech are synthetic unless raw 16 bit
+ * signed host endian 8 kHz files are given with -f and -n.
+ *
+ * Build with "make ecbench" from the top of the tree.
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <ecbench-shim.h>
+#include <math.h>
+#include <unistd.h>
+
+#define RATE		8000
+/* ERLE is measured over windows of this many samples */
+#define WINDOW		(RATE / 4)
+#define MAX_FACTORIES	16
+#define MAX_TAPS	8
+#define MAX_PARAMS	8
+
+struct module ecbench_module = { .name = "ecbench" };
+int ecbench_verbose;
+
+static const struct dahdi_echocan_factory *factories[MAX_FACTORIES];
+static int nfactories;
+
+int dahdi_register_echocan_factory(const struct dahdi_echocan_factory *ec)
+{
+	if (nfactories == MAX_FACTORIES)
+		return -ENOMEM;
+	factories[nfactories++] = ec;
+	return 0;
+}
+
+void dahdi_unregister_echocan_factory(const struct dahdi_echocan_factory *ec)
+{
+}
+
+struct config {
+	const char *name;		/* Only this canceller, or all */
+	int taps[MAX_TAPS];
+	int ntaps;
+	int secs;
+	int delay_ms;			/* Echo path bulk delay */
+	int path_ms;			/* Echo path dispersion */
+	double erl;			/* dB */
+	double far_level;		/* dBm0 */
+	double noise_level;		/* dBm0 */
+	int white;			/* White noise instead of speech */
+	int doubletalk;			/* Near end speech in the middle */
+	const char *far_file;
+	const char *near_file;
+	struct dahdi_echocanparam params[MAX_PARAMS];
+	int nparams;
+	int verbose;
+	double min_erle;		/* dB, 0 for no limit */
+	double max_converged;		/* Seconds, 0 for no limit */
+	double max_ns;			/* Per sample, 0 for no limit */
+};
+
+struct signals {
+	int len;
+	short *far;			/* Reference */
+	short *near;			/* Near end, without echo */
+	short *echo;			/* Echo of the reference */
+};
+
+struct result {
+	double erle;
+	double converged;		/* Seconds, < 0 if never */
+	double ns_per_sample;
+	u32 dtd;
+	u32 adapt;
+	u32 adapt_skipped;
+};
+
+/* Full scale sine is +3.14 dBm0 */
+static double dbm0_to_rms(double dbm0)
+{
+	return 32767.0 / sqrt(2.0) * pow(10.0, (dbm0 - 3.14) / 20.0);
+}
+
+static double gauss(u32 *seed)
+{
+	double u1, u2;
+
+	*seed = *seed * 1103515245 + 12345;
+	u1 = ((*seed >> 8) + 1.0) / 16777217.0;
+	*seed = *seed * 1103515245 + 12345;
+	u2 = (*seed >> 8) / 16777216.0;
+	return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+static short clip(double v)
+{
+	if (v > 32767.0)
+		return 32767;
+	if (v < -32768.0)
+		return -32768;
+	return (short)lrint(v);
+}
+
+/*
+ * Noise shaped roughly like speech (low passed, with a formant-ish
+ * resonance), in talk spurts of on_ms every period_ms.
+ */
+static void make_speech(short *out, int len, double level, int on_ms,
+			int period_ms, int white, u32 seed)
+{
+	const double rms = dbm0_to_rms(level);
+	double y1 = 0, y2 = 0, gain;
+	double *tmp;
+	double pow = 0;
+	int i;
+
+	tmp = malloc(sizeof(*tmp) * len);
+	for (i = 0; i < len; i++) {
+		double x = gauss(&seed);
+
+		if (!white) {
+			x = x + 1.3 * y1 - 0.6 * y2;
+			y2 = y1;
+			y1 = x;
+		}
+		tmp[i] = x;
+		pow += x * x;
+	}
+	gain = rms / sqrt(pow / len + 1e-9);
+	for (i = 0; i < len; i++) {
+		const int ms = i / DAHDI_MS_TO_SAMPLES(1);
+
+		out[i] = ((ms % period_ms) < on_ms) ? clip(tmp[i] * gain) : 0;
+	}
+	free(tmp);
+}
+
+static int read_pcm(const char *file, short *out, int len)
+{
+	FILE *f = fopen(file, "rb");
+	size_t got, i;
+
+	if (!f) {
+		perror(file);
+		return -1;
+	}
+	got = fread(out, sizeof(short), len, f);
+	fclose(f);
+	/* Loop short recordings */
+	if (!got)
+		return -1;
+	for (i = got; i < (size_t)len; i++)
+		out[i] = out[i % got];
+	return 0;
+}
+
+/* A decaying random impulse response with the configured ERL */
+static double *make_path(const struct config *cfg, int *len)
+{
+	const int delay = DAHDI_MS_TO_SAMPLES(cfg->delay_ms);
+	const int disp = max(DAHDI_MS_TO_SAMPLES(cfg->path_ms), 1);
+	double *h, energy = 0, gain;
+	u32 seed = 4711;
+	int i;
+
+	*len = delay + disp;
+	h = calloc(*len, sizeof(*h));
+	for (i = 0; i < disp; i++) {
+		h[delay + i] = gauss(&seed) * exp(-4.0 * i / disp);
+		energy += h[delay + i] * h[delay + i];
+	}
+	gain = pow(10.0, -cfg->erl / 20.0) / sqrt(energy);
+	for (i = 0; i < disp; i++)
+		h[delay + i] *= gain;
+	return h;
+}
+
+static int make_signals(const struct config *cfg, struct signals *sig)
+{
+	const int len = cfg->secs * RATE;
+	double *h;
+	u32 seed = 99;
+	int hlen, i, k;
+
+	sig->len = len;
+	sig->far = calloc(len, sizeof(short));
+	sig->near = calloc(len, sizeof(short));
+	sig->echo = calloc(len, sizeof(short));
+
+	if (cfg->far_file) {
+		if (read_pcm(cfg->far_file, sig->far, len))
+			return -1;
+	} else {
+		make_speech(sig->far, len, cfg->far_level, 1500, 2000,
+			    cfg->white, 1);
+	}
+
+	if (cfg->near_file) {
+		if (read_pcm(cfg->near_file, sig->near, len))
+			return -1;
+	} else if (cfg->doubletalk) {
+		/* Near end talks over the middle fifth of the run */
+		make_speech(sig->near, len, cfg->far_level, 1000, 1000, 0, 2);
+		for (i = 0; i < len; i++) {
+			if (i < len * 2 / 5 || i >= len * 3 / 5)
+				sig->near[i] = 0;
+		}
+	}
+	for (i = 0; i < len; i++) {
+		sig->near[i] = clip(sig->near[i] +
+				    gauss(&seed) * dbm0_to_rms(cfg->noise_level));
+	}
+
+	h = make_path(cfg, &hlen);
+	for (i = 0; i < len; i++) {
+		double acc = 0;
+
+		for (k = 0; k < hlen && k <= i; k++)
+			acc += h[k] * sig->far[i - k];
+		sig->echo[i] = clip(acc);
+	}
+	free(h);
+	return 0;
+}
+
+static void free_signals(struct signals *sig)
+{
+	free(sig->far);
+	free(sig->near);
+	free(sig->echo);
+}
+
+static int run(const struct config *cfg, const struct signals *sig,
+	       const struct dahdi_echocan_factory *f, int taps,
+	       struct result *res)
+{
+	struct dahdi_echocanparams ecp = {
+		.tap_length = taps,
+		.param_count = cfg->nparams,
+	};
+	struct dahdi_echocanparam params[MAX_PARAMS];
+	struct dahdi_echocan_state *ec;
+	const int windows = sig->len / WINDOW;
+	double *erle;
+	double echo_pow = 0, res_pow = 0, final = 0;
+	s64 ns = 0;
+	int i, j, w, nfinal = 0;
+
+	memcpy(params, cfg->params, sizeof(params));
+	if (f->echocan_create(NULL, &ecp, params, &ec))
+		return -1;
+	ec->status.mode = ECHO_MODE_ACTIVE;
+	ec->status.tap_length = taps;
+
+	erle = calloc(windows, sizeof(*erle));
+	for (i = 0; i + DAHDI_CHUNKSIZE <= sig->len; i += DAHDI_CHUNKSIZE) {
+		short isig[DAHDI_CHUNKSIZE], iref[DAHDI_CHUNKSIZE];
+		ktime_t start;
+
+		for (j = 0; j < DAHDI_CHUNKSIZE; j++) {
+			iref[j] = sig->far[i + j];
+			isig[j] = clip(sig->near[i + j] + sig->echo[i + j]);
+		}
+		start = ktime_get();
+		ec->ops->echocan_process(ec, isig, iref, DAHDI_CHUNKSIZE);
+		ns += ktime_sub(ktime_get(), start);
+
+		for (j = 0; j < DAHDI_CHUNKSIZE; j++) {
+			const double e = sig->echo[i + j];
+			const double r = isig[j] - sig->near[i + j];
+
+			echo_pow += e * e;
+			res_pow += r * r;
+		}
+
+		if ((i + DAHDI_CHUNKSIZE) % WINDOW)
+			continue;
+		w = i / WINDOW;
+		/* Only where there was some echo to cancel */
+		if (echo_pow / WINDOW > 100.0)
+			erle[w] = 10.0 * log10(echo_pow / (res_pow + 1.0));
+		else
+			erle[w] = NAN;
+		echo_pow = res_pow = 0;
+	}
+
+	/* The last quarter of the run is taken as converged */
+	for (w = windows - windows / 4; w < windows; w++) {
+		if (!isnan(erle[w])) {
+			final += erle[w];
+			nfinal++;
+		}
+	}
+	res->erle = nfinal ? final / nfinal : NAN;
+	res->converged = -1;
+	for (w = 0; w < windows && nfinal; w++) {
+		if (!isnan(erle[w]) && erle[w] >= res->erle - 3.0) {
+			res->converged = (double)(w + 1) * WINDOW / RATE;
+			break;
+		}
+	}
+	res->ns_per_sample = (double)ns / sig->len;
+	res->dtd = ec->stats.dtd;
+	res->adapt = ec->stats.adapt;
+	res->adapt_skipped = ec->stats.adapt_skipped;
+
+	if (cfg->verbose) {
+		printf("%s, %d taps, ERLE per %d ms:\n", f->get_name(NULL),
+		       taps, WINDOW * 1000 / RATE);
+		for (w = 0; w < windows; w++) {
+			if (isnan(erle[w]))
+				printf("  %6.2fs      -\n",
+				       (double)w * WINDOW / RATE);
+			else
+				printf("  %6.2fs %6.1f dB\n",
+				       (double)w * WINDOW / RATE, erle[w]);
+		}
+	}
+
+	free(erle);
+	ec->ops->echocan_free(NULL, ec);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -e name      only run this echo canceller (default: all)\n"
+		"  -t taps,...  tail lengths (default: 128,256,512,1024)\n"
+		"  -s secs      length of the run (default: 20)\n"
+		"  -d ms        echo path delay (default: 4)\n"
+		"  -l ms        echo path dispersion (default: 8)\n"
+		"  -g dB        echo return loss (default: 12)\n"
+		"  -L dBm0      far end level (default: -20)\n"
+		"  -N dBm0      near end noise level (default: -70)\n"
+		"  -w           white noise reference instead of speech like\n"
+		"  -D           near end speech over the middle of the run\n"
+		"  -f file      reference from raw 16 bit 8 kHz PCM\n"
+		"  -n file      near end from raw 16 bit 8 kHz PCM\n"
+		"  -p name=val  echo canceller parameter (may be repeated)\n"
+		"  -E dB        fail below this final ERLE\n"
+		"  -C secs      fail if not converged within this time\n"
+		"  -T ns        fail above this time per sample\n"
+		"  -v           print ERLE over time and module messages\n",
+		prog);
+}
+
+/* True if the run is within the limits that were set. */
+static bool check(const struct config *cfg, const struct result *res)
+{
+	if (cfg->min_erle && !(res->erle >= cfg->min_erle))
+		return false;
+	if (cfg->max_converged &&
+	    (res->converged < 0 || res->converged > cfg->max_converged))
+		return false;
+	if (cfg->max_ns && res->ns_per_sample > cfg->max_ns)
+		return false;
+	return true;
+}
+
+static int parse_taps(struct config *cfg, char *arg)
+{
+	char *tok;
+
+	cfg->ntaps = 0;
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (cfg->ntaps == MAX_TAPS)
+			return -1;
+		cfg->taps[cfg->ntaps++] = atoi(tok);
+	}
+	return cfg->ntaps ? 0 : -1;
+}
+
+static int parse_param(struct config *cfg, const char *arg)
+{
+	const char *eq = strchr(arg, '=');
+	struct dahdi_echocanparam *p;
+
+	if (!eq || cfg->nparams == MAX_PARAMS ||
+	    eq - arg >= (int)sizeof(p->name))
+		return -1;
+	p = &cfg->params[cfg->nparams++];
+	memcpy(p->name, arg, eq - arg);
+	p->value = atoi(eq + 1);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct config cfg = {
+		.taps = { 128, 256, 512, 1024 },
+		.ntaps = 4,
+		.secs = 20,
+		.delay_ms = 4,
+		.path_ms = 8,
+		.erl = 12,
+		.far_level = -20,
+		.noise_level = -70,
+	};
+	struct signals sig;
+	struct result res;
+	int c, i, t, ran = 0, failed = 0;
+
+	while ((c = getopt(argc, argv, "e:t:s:d:l:g:L:N:wDf:n:p:E:C:T:vh")) != -1) {
+		switch (c) {
+		case 'e':
+			cfg.name = optarg;
+			break;
+		case 't':
+			if (parse_taps(&cfg, optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 's':
+			cfg.secs = max(atoi(optarg), 1);
+			break;
+		case 'd':
+			cfg.delay_ms = atoi(optarg);
+			break;
+		case 'l':
+			cfg.path_ms = atoi(optarg);
+			break;
+		case 'g':
+			cfg.erl = atof(optarg);
+			break;
+		case 'L':
+			cfg.far_level = atof(optarg);
+			break;
+		case 'N':
+			cfg.noise_level = atof(optarg);
+			break;
+		case 'w':
+			cfg.white = 1;
+			break;
+		case 'D':
+			cfg.doubletalk = 1;
+			break;
+		case 'f':
+			cfg.far_file = optarg;
+			break;
+		case 'n':
+			cfg.near_file = optarg;
+			break;
+		case 'p':
+			if (parse_param(&cfg, optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'E':
+			cfg.min_erle = atof(optarg);
+			break;
+		case 'C':
+			cfg.max_converged = atof(optarg);
+			break;
+		case 'T':
+			cfg.max_ns = atof(optarg);
+			break;
+		case 'v':
+			cfg.verbose = 1;
+			ecbench_verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return c != 'h';
+		}
+	}
+
+	if (make_signals(&cfg, &sig))
+		return 1;
+
+	printf("%-6s %5s %9s %10s %9s %9s %8s %8s %8s\n", "echocan", "taps",
+	       "ERLE dB", "converged", "ns/smpl", "chans", "dtd", "adapt",
+	       "skipped");
+	for (i = 0; i < nfactories; i++) {
+		const char *name = factories[i]->get_name(NULL);
+
+		if (cfg.name && strcasecmp(cfg.name, name))
+			continue;
+		for (t = 0; t < cfg.ntaps; t++) {
+			ran++;
+			if (run(&cfg, &sig, factories[i], cfg.taps[t], &res)) {
+				printf("%-6s %5d   could not be created\n", name,
+				       cfg.taps[t]);
+				failed++;
+				continue;
+			}
+			printf("%-6s %5d %9.1f ", name, cfg.taps[t], res.erle);
+			if (res.converged < 0)
+				printf("%10s ", "never");
+			else
+				printf("%9.2fs ", res.converged);
+			printf("%9.1f %9.0f %8u %8u %8u",
+			       res.ns_per_sample,
+			       1e9 / (res.ns_per_sample * RATE + 1e-9),
+			       res.dtd, res.adapt, res.adapt_skipped);
+			if (!check(&cfg, &res)) {
+				printf(" FAIL");
+				failed++;
+			}
+			printf("\n");
+		}
+	}
+
+	free_signals(&sig);
+	if (!ran) {
+		fprintf(stderr, "No echo canceller '%s'\n", cfg.name);
+		return 1;
+	}
+	return failed ? 2 : 0;
+}
@@ -0,0 +1,254 @@
+/*
+ * ecbench-shim.h - Just enough of the kernel and DAHDI APIs to build the
+ * software echo canceller modules as part of a userspace program.
+ *
+ * The echo canceller structures mirror include/dahdi/kernel.h and must be
+ * kept in step with it.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#ifndef _ECBENCH_SHIM_H
+#define _ECBENCH_SHIM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+typedef uint8_t u8;
+typedef int16_t s16;
+typedef uint16_t u16;
+typedef int32_t s32;
+typedef uint32_t u32;
+typedef long long s64;
+typedef unsigned long long u64;
+typedef int32_t __s32;
+typedef uint32_t __u32;
+
+#define LINUX_VERSION_CODE		KERNEL_VERSION(5, 0, 0)
+#define KERNEL_VERSION(a, b, c)		(((a) << 16) + ((b) << 8) + (c))
+
+#if defined(__x86_64__)
+#define CONFIG_X86_64
+#endif
+
+#define KERN_ERR	""
+#define KERN_WARNING	""
+#define KERN_NOTICE	""
+#define KERN_INFO	""
+#define KERN_DEBUG	""
+/* Module messages are only shown with -v */
+extern int ecbench_verbose;
+#define printk(fmt, ...) \
+	(ecbench_verbose ? fprintf(stderr, fmt, ##__VA_ARGS__) : 0)
+
+struct module {
+	const char *name;
+};
+extern struct module ecbench_module;
+#define THIS_MODULE	(&ecbench_module)
+
+#define __init
+#define __exit
+#define __maybe_unused	__attribute__((unused))
+#define EXPORT_SYMBOL(sym)
+#define MODULE_AUTHOR(a)
+#define MODULE_DESCRIPTION(a)
+#define MODULE_LICENSE(a)
+#define MODULE_PARM_DESC(a, b)
+/* Parameters keep their defaults, and modules are never unloaded */
+#define module_param(name, type, perm) \
+	static void *const __maybe_unused ecbench_param_##name = &name
+#define S_IRUGO		0444
+#define S_IWUSR		0200
+
+/* Modules register their factory as the program starts */
+#define module_init(fn)							\
+	static void __attribute__((constructor)) ecbench_init_##fn(void)\
+	{								\
+		fn();							\
+	}
+#define module_exit(fn) \
+	static void (*const __maybe_unused ecbench_exit_##fn)(void) = fn
+
+#define GFP_KERNEL	0
+#define kmalloc(size, gfp)		malloc(size)
+#define kzalloc(size, gfp)		calloc(1, size)
+#define kcalloc(n, size, gfp)		calloc(n, size)
+#define kfree(p)			free(p)
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define max(a, b)		((a) > (b) ? (a) : (b))
+#define min_t(t, a, b)		min((t)(a), (t)(b))
+#define max_t(t, a, b)		max((t)(a), (t)(b))
+#define swap(a, b) \
+	do { typeof(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define is_power_of_2(n)	((n) && !((n) & ((n) - 1)))
+#define ilog2(n)		(31 - __builtin_clz(n))
+
+static inline u64 div_u64(u64 a, u32 b) { return a / b; }
+static inline u64 div64_u64(u64 a, u64 b) { return a / b; }
+static inline s64 div64_s64(s64 a, s64 b) { return a / b; }
+
+#define NSEC_PER_SEC	1000000000LL
+typedef s64 ktime_t;
+static inline ktime_t ktime_get(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+#define ktime_sub(a, b)		((a) - (b))
+#define ktime_to_ns(a)		(a)
+
+/* The vector unit is always usable in userspace */
+#define irq_fpu_usable()	1
+#define kernel_fpu_begin()	do { } while (0)
+#define kernel_fpu_end()	do { } while (0)
+#define X86_FEATURE_AVX		"avx"
+#define X86_FEATURE_AVX2	"avx2"
+#define boot_cpu_has(feature)	__builtin_cpu_supports(feature)
+
+/* From include/dahdi/kernel.h */
+
+#define DAHDI_CHUNKSIZE		8
+#define DAHDI_MS_TO_SAMPLES(ms)	((ms) * 8)
+
+#define module_printk(level, fmt, args...) \
+	printk(level "%s: " fmt, THIS_MODULE->name, ## args)
+
+struct dahdi_chan;
+
+struct dahdi_echocanparam {
+	char name[16];
+	__s32 value;
+};
+
+struct dahdi_echocanparams {
+	__u32 tap_length;
+	__u32 param_count;
+	__u32 reserved;
+};
+
+typedef struct {
+	int dummy;
+} echo_can_disable_detector_state_t;
+
+struct dahdi_echocan_features {
+	u32 CED_tx_detect:1;
+	u32 CED_rx_detect:1;
+	u32 CNG_tx_detect:1;
+	u32 CNG_rx_detect:1;
+	u32 NLP_toggle:1;
+	u32 NLP_automatic:1;
+};
+
+struct dahdi_echocan_state;
+
+struct dahdi_echocan_chunk {
+	struct dahdi_echocan_state *ec;
+	short isig[DAHDI_CHUNKSIZE];
+	short iref[DAHDI_CHUNKSIZE];
+};
+
+struct dahdi_echocan_ops {
+	void (*echocan_free)(struct dahdi_chan *chan,
+			     struct dahdi_echocan_state *ec);
+	void (*echocan_process)(struct dahdi_echocan_state *ec, short *isig,
+				const short *iref, u32 size);
+	void (*echocan_process_batch)(struct dahdi_echocan_chunk *chunks,
+				      unsigned int count);
+	void (*echocan_events)(struct dahdi_echocan_state *ec);
+	int (*echocan_traintap)(struct dahdi_echocan_state *ec, int pos,
+				short val);
+	void (*echocan_NLP_toggle)(struct dahdi_echocan_state *ec,
+				   unsigned int enable);
+};
+
+struct dahdi_echocan_factory {
+	const char *(*get_name)(const struct dahdi_chan *chan);
+	struct module *owner;
+	int (*echocan_create)(struct dahdi_chan *chan,
+			      struct dahdi_echocanparams *ecp,
+			      struct dahdi_echocanparam *p,
+			      struct dahdi_echocan_state **ec);
+};
+
+enum dahdi_echocan_mode {
+	__ECHO_MODE_MUTE = 1 << 8,
+	ECHO_MODE_IDLE = 0,
+	ECHO_MODE_PRETRAINING = 1 | __ECHO_MODE_MUTE,
+	ECHO_MODE_STARTTRAINING = 2 | __ECHO_MODE_MUTE,
+	ECHO_MODE_AWAITINGECHO = 3 | __ECHO_MODE_MUTE,
+	ECHO_MODE_TRAINING = 4 | __ECHO_MODE_MUTE,
+	ECHO_MODE_ACTIVE = 5,
+	ECHO_MODE_FAX = 6,
+};
+
+struct dahdi_echocan_state {
+	const struct dahdi_echocan_ops *ops;
+	echo_can_disable_detector_state_t txecdis;
+	echo_can_disable_detector_state_t rxecdis;
+	struct dahdi_echocan_features features;
+	struct {
+		enum dahdi_echocan_mode mode;
+		u32 last_train_tap;
+		u32 pretrain_timer;
+		u32 tap_length;
+		u32 silent;
+	} status;
+	union dahdi_echocan_events {
+		u32 all;
+		struct {
+			u32 CED_tx_detected:1;
+			u32 CED_rx_detected:1;
+			u32 CNG_tx_detected:1;
+			u32 CNG_rx_detected:1;
+			u32 NLP_auto_disabled:1;
+			u32 NLP_auto_enabled:1;
+		} bit;
+	} events;
+	struct {
+		u32 dtd;
+		u32 adapt;
+		u32 adapt_skipped;
+		u32 ref_pow;
+		u32 in_pow;
+		u32 out_pow;
+		u32 gated;
+		u32 chunks;
+		u32 max_ns;
+		u64 total_ns;
+	} stats;
+};
+
+int dahdi_register_echocan_factory(const struct dahdi_echocan_factory *ec);
+void dahdi_unregister_echocan_factory(const struct dahdi_echocan_factory *ec);
+
+static inline void *dahdi_echocan_state_alloc(const struct dahdi_chan *chan,
+					      size_t size)
+{
+	return calloc(1, size);
+}
+
+static inline void dahdi_echocan_state_free(void *state)
+{
+	free(state);
+}
+
+#endif /* _ECBENCH_SHIM_H */
@@ -0,0 +1 @@
+#include <ecbench-shim.h>
@@ -0,0 +1,539 @@
+/*
+ * hdlcbench - Check and time the fasthdlc block encoder and decoder.
+ *
+ * fasthdlc_tx_encode() and fasthdlc_rx_decode() take whole buffers and
+ * move 16 bits at a time where no bit stuffing is involved.  This runs
+ * them against the byte at a time fasthdlc_tx_load()/fasthdlc_tx_run()
+ * and fasthdlc_rx_load()/fasthdlc_rx_run() engine:
+ *
+ *   - with -z, on random frames, random line errors and aborts, random
+ *     chunk and output sizes, failing on the first difference in output,
+ *     events or state,
+ *   - otherwise, on a stream of frames sent and received in chunks of
+ *     DAHDI_CHUNKSIZE bytes like the DAHDI core does, reporting the time
+ *     per byte of each.
+ *
+ * Build with "make hdlcbench" from the top of the tree.
+ */
+
+/*
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FAST_HDLC_NEED_TABLES
+#include <dahdi/fasthdlc.h>
+
+#define CHUNKSIZE	8
+#define MAX_FRAME	1600
+/* Received data bytes, or one of the RETURN_*_FLAG events */
+#define MAX_EVENTS	(1 << 20)
+/* Timed runs of each engine, the best one is reported */
+#define RUNS		5
+
+enum payload {
+	PAYLOAD_RANDOM,		/* Random bytes, stuffing is rare */
+	PAYLOAD_TEXT,		/* ASCII text, no stuffing at all */
+	PAYLOAD_ONES,		/* 0xff, stuffing all the time */
+	PAYLOAD_MIXED,		/* A bit of everything, for -z */
+};
+
+struct config {
+	enum fasthdlc_mode mode;
+	enum payload payload;
+	int frames;
+	int frame_len;
+	int fuzz;
+	unsigned int seed;
+	int verbose;
+};
+
+static const char *mode_name(enum fasthdlc_mode mode)
+{
+	switch (mode) {
+	case FASTHDLC_MODE_56:
+		return "56k";
+	case FASTHDLC_MODE_16:
+		return "16k";
+	default:
+		return "64k";
+	}
+}
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void fill_frame(unsigned char *buf, int len, enum payload payload)
+{
+	static const char text[] =
+		"GET /index.html HTTP/1.1\r\nHost: example.com\r\n\r\n";
+	int i;
+
+	if (payload == PAYLOAD_MIXED)
+		payload = rand() % PAYLOAD_MIXED;
+	for (i = 0; i < len; i++) {
+		switch (payload) {
+		case PAYLOAD_TEXT:
+			buf[i] = text[i % (sizeof(text) - 1)];
+			break;
+		case PAYLOAD_ONES:
+			buf[i] = (rand() % 16) ? 0xff : 0x7e;
+			break;
+		default:
+			buf[i] = rand();
+			break;
+		}
+	}
+}
+
+/* The core's transmit loop, one byte at a time */
+static int ref_tx(struct fasthdlc_state *h, const unsigned char **in,
+		  int *len, unsigned char *out, int room)
+{
+	int n;
+
+	for (n = 0; n < room; n++) {
+		if (fasthdlc_tx_need_data(h)) {
+			if (!*len)
+				break;
+			fasthdlc_tx_load_nocheck(h, *(*in)++);
+			(*len)--;
+		}
+		out[n] = fasthdlc_tx_run_nocheck(h);
+	}
+	return n;
+}
+
+/*
+ * Record a received byte or event.  Like the core, events are only
+ * interesting after some data; idle flags and line noise between frames
+ * are dropped so the two decoders can be compared even where one of them
+ * has decoded further ahead.
+ */
+static int record(int *events, int n, int res)
+{
+	if ((res & ~0xff) && (!n || (events[n - 1] & ~0xff)))
+		return n;
+	events[n++] = res;
+	return n;
+}
+
+/* The core's receive loop, one byte at a time */
+static int ref_rx(struct fasthdlc_state *h, const unsigned char *in,
+		  int len, int *events)
+{
+	int n = 0;
+	int res;
+
+	while (len--) {
+		fasthdlc_rx_load_nocheck(h, *in++);
+		res = fasthdlc_rx_run(h);
+		if (!(res & RETURN_EMPTY_FLAG))
+			n = record(events, n, res);
+	}
+	return n;
+}
+
+static int block_rx(struct fasthdlc_state *h, const unsigned char *in,
+		    int len, int *events, int random_room)
+{
+	unsigned char out[MAX_FRAME];
+	int room, res, i;
+	int n = 0;
+
+	while (len || (h->bits >= minbits[h->state])) {
+		room = random_room ? 1 + rand() % 40 : (int)sizeof(out);
+		res = fasthdlc_rx_decode(h, &in, &len, out, room);
+		for (i = 0; i < (res & RETURN_LEN_MASK); i++)
+			n = record(events, n, out[i]);
+		if (res & (RETURN_COMPLETE_FLAG | RETURN_DISCARD_FLAG))
+			n = record(events, n, res & ~RETURN_LEN_MASK);
+		else if (!(res & RETURN_LEN_MASK))
+			break;
+	}
+	return n;
+}
+
+static int same_state(const struct fasthdlc_state *a,
+		      const struct fasthdlc_state *b)
+{
+	return a->state == b->state && a->data == b->data &&
+	       a->bits == b->bits && a->ones == b->ones;
+}
+
+/*
+ * Encode a run of frames with both encoders, in random sized pieces,
+ * and compare every byte of line data.  Returns the line data length,
+ * or -1 on a difference.
+ */
+static int fuzz_tx(enum fasthdlc_mode mode, unsigned char *line, int max)
+{
+	struct fasthdlc_state a, b;
+	unsigned char frame[MAX_FRAME];
+	unsigned char out[64];
+	const unsigned char *pa, *pb;
+	int la, lb, na, nb, room;
+	int total = 0;
+
+	fasthdlc_init(&a, mode);
+	fasthdlc_init(&b, mode);
+	/* Idle with flags first so the receiver can sync */
+	while (total < 4) {
+		fasthdlc_tx_frame_nocheck(&a);
+		fasthdlc_tx_frame_nocheck(&b);
+		line[total++] = fasthdlc_tx_run_nocheck(&a);
+		fasthdlc_tx_run_nocheck(&b);
+	}
+
+	while (total + 8 * MAX_FRAME < max) {
+		la = lb = rand() % 8 ? rand() % 300 : rand() % MAX_FRAME;
+		fill_frame(frame, la, PAYLOAD_MIXED);
+		pa = pb = frame;
+		for (;;) {
+			/*
+			 * The block encoder may be a byte further into the
+			 * input, but the line data has to be the same, and
+			 * both have to run out of input at the same point.
+			 */
+			room = 1 + rand() % (int)sizeof(out);
+			na = ref_tx(&a, &pa, &la, out, room);
+			nb = fasthdlc_tx_encode(&b, &pb, &lb, line + total,
+						room);
+			if (na != nb || memcmp(out, line + total, na) ||
+			    ((na < room) && (la || lb || !same_state(&a, &b)))) {
+				fprintf(stderr, "%s encode differs at line "
+					"byte %d\n", mode_name(mode), total);
+				return -1;
+			}
+			total += nb;
+			if (na < room) {
+				/* Close the frame, occasionally abort it */
+				if (rand() % 32) {
+					fasthdlc_tx_frame_nocheck(&a);
+					fasthdlc_tx_frame_nocheck(&b);
+				} else {
+					a.data |= 0xfe000000 >> a.bits;
+					a.bits += 8;
+					b.data |= 0xfe000000 >> b.bits;
+					b.bits += 8;
+				}
+				while (!fasthdlc_tx_need_data(&a)) {
+					line[total++] = fasthdlc_tx_run_nocheck(&a);
+					fasthdlc_tx_run_nocheck(&b);
+				}
+				break;
+			}
+		}
+	}
+	/* Flags at the end so all of it is decoded */
+	while (total < max && (total % 16 || !fasthdlc_tx_need_data(&a))) {
+		if (fasthdlc_tx_need_data(&a))
+			fasthdlc_tx_frame_nocheck(&a);
+		line[total++] = fasthdlc_tx_run_nocheck(&a);
+	}
+	return total;
+}
+
+static int fuzz(const struct config *cfg)
+{
+	static const enum fasthdlc_mode modes[] = {
+		FASTHDLC_MODE_64, FASTHDLC_MODE_56, FASTHDLC_MODE_16,
+	};
+	const int max = 256 * 1024;
+	unsigned char *line = malloc(max);
+	int *ref = malloc(MAX_EVENTS * sizeof(*ref));
+	int *blk = malloc(MAX_EVENTS * sizeof(*blk));
+	struct fasthdlc_state a, b;
+	long long events = 0, frames = 0;
+	int iter, len, nref, nblk, i, m;
+
+	if (!line || !ref || !blk)
+		return 1;
+
+	for (iter = 0; iter < cfg->fuzz; iter++) {
+		m = iter % 3;
+		len = fuzz_tx(modes[m], line, max);
+		if (len < 0)
+			return 1;
+		/* Line errors */
+		for (i = rand() % 8; i > 0; i--)
+			line[rand() % len] ^= 1 << (rand() % 8);
+
+		fasthdlc_init(&a, modes[m]);
+		fasthdlc_init(&b, modes[m]);
+		nref = ref_rx(&a, line, len, ref);
+		nblk = block_rx(&b, line, len, blk, iter & 1);
+		for (i = 0; i < nref && i < nblk; i++) {
+			if (ref[i] != blk[i])
+				break;
+			frames += !!(ref[i] & RETURN_COMPLETE_FLAG);
+		}
+		if (i < nref || i < nblk) {
+			fprintf(stderr, "%s decode differs at event %d of "
+				"%d/%d: %04x vs %04x\n", mode_name(modes[m]),
+				i, nref, nblk, i < nref ? ref[i] : -1,
+				i < nblk ? blk[i] : -1);
+			return 1;
+		}
+		events += nref;
+		if (cfg->verbose)
+			printf("%6d %s %7d line bytes, %7d events\n", iter,
+			       mode_name(modes[m]), len, nref);
+	}
+	printf("%d runs, %lld events, %lld frames: no differences\n",
+	       cfg->fuzz, events, frames);
+	free(line);
+	free(ref);
+	free(blk);
+	return 0;
+}
+
+struct timing {
+	long long tx_ns;
+	long long rx_ns;
+	long long bytes;	/* Frame data */
+	long long line;		/* Line data */
+	int frames;
+};
+
+/* Send the frames through chunk by chunk, like __dahdi_getbuf_chunk() */
+static void bench_tx(const struct config *cfg, const unsigned char *data,
+		     unsigned char *line, int block, struct timing *t)
+{
+	struct fasthdlc_state h;
+	const unsigned char *p = data;
+	int left = cfg->frame_len;
+	int frames = cfg->frames;
+	long long start, total = 0;
+	int tail = 1;
+	int x;
+
+	fasthdlc_init(&h, cfg->mode);
+	start = now_ns();
+	/* Open the first frame, and idle a chunk after the last one */
+	fasthdlc_tx_frame_nocheck(&h);
+	while (frames || tail-- > 0) {
+		unsigned char *txb = line + total;
+
+		x = 0;
+		while (x < CHUNKSIZE && frames) {
+			if (block)
+				x += fasthdlc_tx_encode(&h, &p, &left,
+							txb + x,
+							CHUNKSIZE - x);
+			else
+				x += ref_tx(&h, &p, &left, txb + x,
+					    CHUNKSIZE - x);
+			if (!left) {
+				fasthdlc_tx_frame_nocheck(&h);
+				p = data + (cfg->frames - frames + 1) %
+					4 * MAX_FRAME;
+				left = cfg->frame_len;
+				frames--;
+			}
+		}
+		for (; x < CHUNKSIZE; x++) {
+			if (fasthdlc_tx_need_data(&h))
+				fasthdlc_tx_frame_nocheck(&h);
+			txb[x] = fasthdlc_tx_run_nocheck(&h);
+		}
+		total += CHUNKSIZE;
+	}
+	t->tx_ns = now_ns() - start;
+	t->line = total;
+}
+
+/* And back, like __putbuf_chunk() */
+static void bench_rx(const struct config *cfg, const unsigned char *line,
+		     int block, struct timing *t)
+{
+	struct fasthdlc_state h;
+	unsigned char buf[MAX_FRAME + 8];
+	const unsigned char *rxb;
+	long long start, i;
+	int idx = 0, frames = 0, bytes = 0;
+	int res, x, left;
+
+	fasthdlc_init(&h, cfg->mode);
+	start = now_ns();
+	for (i = 0; i < t->line; i += CHUNKSIZE) {
+		rxb = line + i;
+		left = CHUNKSIZE;
+		if (block) {
+			do {
+				res = fasthdlc_rx_decode(&h, &rxb, &left,
+							 buf + idx,
+							 sizeof(buf) - idx);
+				idx += res & RETURN_LEN_MASK;
+				if (res & RETURN_COMPLETE_FLAG) {
+					frames += !!idx;
+					bytes += idx;
+					idx = 0;
+				} else if (res & RETURN_DISCARD_FLAG) {
+					idx = 0;
+				}
+			} while (res & (RETURN_COMPLETE_FLAG |
+					RETURN_DISCARD_FLAG));
+			continue;
+		}
+		for (x = 0; x < CHUNKSIZE; x++) {
+			fasthdlc_rx_load_nocheck(&h, rxb[x]);
+			res = fasthdlc_rx_run(&h);
+			if (res & RETURN_EMPTY_FLAG)
+				continue;
+			if (res & RETURN_COMPLETE_FLAG) {
+				frames += !!idx;
+				bytes += idx;
+				idx = 0;
+			} else if (res & RETURN_DISCARD_FLAG) {
+				idx = 0;
+			} else if (idx < (int)sizeof(buf)) {
+				buf[idx++] = res;
+			}
+		}
+	}
+	t->rx_ns = now_ns() - start;
+	t->frames = frames;
+	t->bytes = bytes;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -m mode      64, 56 or 16 kbit/s channel (default: 64)\n"
+		"  -p payload   random, text or ones (default: random)\n"
+		"  -n frames    frames to send (default: 100000)\n"
+		"  -l bytes     frame length (default: 256)\n"
+		"  -z runs      compare against the byte engine instead\n"
+		"  -s seed      random seed (default: 1)\n"
+		"  -v           print each fuzz run\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *payloads[] = { "random", "text", "ones" };
+	struct config cfg = {
+		.mode = FASTHDLC_MODE_64,
+		.payload = PAYLOAD_RANDOM,
+		.frames = 100000,
+		.frame_len = 256,
+		.seed = 1,
+	};
+	struct timing t[2], cur;
+	unsigned char *data, *line;
+	int c, i, r;
+
+	while ((c = getopt(argc, argv, "m:p:n:l:z:s:vh")) != -1) {
+		switch (c) {
+		case 'm':
+			if (!strcmp(optarg, "64")) {
+				cfg.mode = FASTHDLC_MODE_64;
+			} else if (!strcmp(optarg, "56")) {
+				cfg.mode = FASTHDLC_MODE_56;
+			} else if (!strcmp(optarg, "16")) {
+				cfg.mode = FASTHDLC_MODE_16;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'p':
+			for (i = 0; i < 3; i++) {
+				if (!strcmp(optarg, payloads[i]))
+					break;
+			}
+			if (i == 3) {
+				usage(argv[0]);
+				return 1;
+			}
+			cfg.payload = i;
+			break;
+		case 'n':
+			cfg.frames = atoi(optarg);
+			break;
+		case 'l':
+			cfg.frame_len = atoi(optarg);
+			break;
+		case 'z':
+			cfg.fuzz = atoi(optarg);
+			break;
+		case 's':
+			cfg.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'v':
+			cfg.verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return c != 'h';
+		}
+	}
+	if (cfg.frames < 1 || cfg.frame_len < 1 || cfg.frame_len > MAX_FRAME) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	srand(cfg.seed);
+	fasthdlc_precalc();
+	if (cfg.fuzz)
+		return fuzz(&cfg);
+
+	data = malloc(4 * MAX_FRAME);
+	/* Stuffing adds at most a fifth, and 16k spreads each byte over 4 */
+	line = malloc((cfg.frame_len * 2 + 2 * CHUNKSIZE) *
+		      (cfg.mode == FASTHDLC_MODE_16 ? 4L : 1L) *
+		      (cfg.frames + 1));
+	if (!data || !line)
+		return 1;
+	for (i = 0; i < 4; i++)
+		fill_frame(data + i * MAX_FRAME, MAX_FRAME, cfg.payload);
+
+	printf("%s, %s payload, %d frames of %d bytes\n",
+	       mode_name(cfg.mode), payloads[cfg.payload], cfg.frames,
+	       cfg.frame_len);
+	printf("%-6s %12s %12s %8s\n", "engine", "tx ns/byte", "rx ns/byte",
+	       "frames");
+	/* Best of a few runs, interleaved, to keep the noise down */
+	memset(t, 0, sizeof(t));
+	for (r = 0; r < RUNS; r++) {
+		for (i = 0; i < 2; i++) {
+			bench_tx(&cfg, data, line, i, &cur);
+			bench_rx(&cfg, line, i, &cur);
+			if (!r || cur.tx_ns < t[i].tx_ns)
+				t[i].tx_ns = cur.tx_ns;
+			if (!r || cur.rx_ns < t[i].rx_ns)
+				t[i].rx_ns = cur.rx_ns;
+			t[i].line = cur.line;
+			t[i].bytes = cur.bytes;
+			t[i].frames = cur.frames;
+		}
+	}
+	for (i = 0; i < 2; i++) {
+		printf("%-6s %12.2f %12.2f %8d\n", i ? "block" : "byte",
+		       (double)t[i].tx_ns / t[i].line,
+		       (double)t[i].rx_ns / t[i].line, t[i].frames);
+	}
+	if (t[0].bytes != t[1].bytes || t[1].frames != cfg.frames ||
+	    t[0].frames != cfg.frames) {
+		fprintf(stderr, "The engines disagree\n");
+		return 1;
+	}
+	free(data);
+	free(line);
+	return 0;
+}
@@ -374,5 +374,190 @@ static inline short MAX16(const short *y, int len, int *pos)
 	return max;
 }
 
+static inline void TAPS2SHORT(short *taps_short, const int *taps, int ntaps)
+{
+	int i;
+	for (i = 0; i < ntaps; i++)
+		taps_short[i] = taps[i] >> 16;
+}
+
+/*
+ * SIMD variants of CONVOLVE2() and TAPS2SHORT() for 64-bit kernels, where
+ * the MMX code above cannot be used.  They return exactly what the plain C
+ * versions do for any len (sums wrap the same way), so a caller may pick
+ * one at runtime.  They must only be used between kernel_fpu_begin() and
+ * kernel_fpu_end() (kernel_neon_begin()/kernel_neon_end() on arm64).
+ */
+#if defined(CONFIG_X86_64)
+#define DAHDI_ARITH_X86_SIMD
+
+/*
+ * The vector registers the asm below uses.  The kernel is built with
+ * -mno-sse, so the compiler never keeps anything in them there and refuses
+ * them as clobbers.  Userspace builds of this file (ecbench) do use them.
+ * An xmm clobber covers the whole ymm register.
+ */
+#ifdef __SSE2__
+#define DAHDI_XMM_CLOBBERS(...)	, __VA_ARGS__
+#else
+#define DAHDI_XMM_CLOBBERS(...)
+#endif
+
+static inline int CONVOLVE2_SSE2(const short *coeffs, const short *hist, int len)
+{
+	long n = len >> 3;
+	int sum = 0;
+	int x;
+
+	if (n) {
+		__asm__ (
+			"pxor %%xmm0, %%xmm0;\n"
+			"1:"
+				"movdqu (%1), %%xmm1;\n"
+				"movdqu (%2), %%xmm2;\n"
+				"pmaddwd %%xmm2, %%xmm1;\n"
+				"paddd %%xmm1, %%xmm0;\n"
+				"add $16, %1;\n"
+				"add $16, %2;\n"
+				"dec %3;\n"
+			"jnz 1b;\n"
+			"pshufd $0x4e, %%xmm0, %%xmm1;\n"
+			"paddd %%xmm1, %%xmm0;\n"
+			"pshufd $0xb1, %%xmm0, %%xmm1;\n"
+			"paddd %%xmm1, %%xmm0;\n"
+			"movd %%xmm0, %0;\n"
+			: "=r" (sum), "+r" (coeffs), "+r" (hist), "+r" (n)
+			:
+			: "cc", "memory"
+			  DAHDI_XMM_CLOBBERS("xmm0", "xmm1", "xmm2")
+		);
+	}
+	for (x = 0; x < (len & 7); x++)
+		sum += coeffs[x] * hist[x];
+	return sum;
+}
+
+static inline int CONVOLVE2_AVX2(const short *coeffs, const short *hist, int len)
+{
+	long n = len >> 4;
+	int sum = 0;
+	int x;
+
+	if (n) {
+		__asm__ (
+			"vpxor %%ymm0, %%ymm0, %%ymm0;\n"
+			"1:"
+				"vmovdqu (%1), %%ymm1;\n"
+				"vmovdqu (%2), %%ymm2;\n"
+				"vpmaddwd %%ymm2, %%ymm1, %%ymm1;\n"
+				"vpaddd %%ymm1, %%ymm0, %%ymm0;\n"
+				"add $32, %1;\n"
+				"add $32, %2;\n"
+				"dec %3;\n"
+			"jnz 1b;\n"
+			"vextracti128 $1, %%ymm0, %%xmm1;\n"
+			"vpaddd %%xmm1, %%xmm0, %%xmm0;\n"
+			"vpshufd $0x4e, %%xmm0, %%xmm1;\n"
+			"vpaddd %%xmm1, %%xmm0, %%xmm0;\n"
+			"vpshufd $0xb1, %%xmm0, %%xmm1;\n"
+			"vpaddd %%xmm1, %%xmm0, %%xmm0;\n"
+			"vmovd %%xmm0, %0;\n"
+			"vzeroupper;\n"
+			: "=r" (sum), "+r" (coeffs), "+r" (hist), "+r" (n)
+			:
+			: "cc", "memory"
+			  DAHDI_XMM_CLOBBERS("xmm0", "xmm1", "xmm2")
+		);
+	}
+	for (x = 0; x < (len & 15); x++)
+		sum += coeffs[x] * hist[x];
+	return sum;
+}
+
+static inline void TAPS2SHORT_SSE2(short *taps_short, const int *taps, int ntaps)
+{
+	long n = ntaps >> 3;
+	int i;
+
+	if (n) {
+		__asm__ (
+			"1:"
+				"movdqu 0(%1), %%xmm0;\n"
+				"movdqu 16(%1), %%xmm1;\n"
+				"psrad $16, %%xmm0;\n"
+				"psrad $16, %%xmm1;\n"
+				"packssdw %%xmm1, %%xmm0;\n"
+				"movdqu %%xmm0, (%0);\n"
+				"add $32, %1;\n"
+				"add $16, %0;\n"
+				"dec %2;\n"
+			"jnz 1b;\n"
+			: "+r" (taps_short), "+r" (taps), "+r" (n)
+			:
+			: "cc", "memory"
+			  DAHDI_XMM_CLOBBERS("xmm0", "xmm1")
+		);
+	}
+	for (i = 0; i < (ntaps & 7); i++)
+		taps_short[i] = taps[i] >> 16;
+}
+
+#elif defined(CONFIG_ARM64) && defined(CONFIG_KERNEL_MODE_NEON)
+#define DAHDI_ARITH_NEON
+
+static inline int CONVOLVE2_NEON(const short *coeffs, const short *hist, int len)
+{
+	long n = len >> 3;
+	int sum = 0;
+	int x;
+
+	if (n) {
+		__asm__ (
+			"movi v0.4s, #0;\n"
+			"movi v1.4s, #0;\n"
+			"1:"
+				"ld1 {v2.8h}, [%1], #16;\n"
+				"ld1 {v3.8h}, [%2], #16;\n"
+				"smlal v0.4s, v2.4h, v3.4h;\n"
+				"smlal2 v1.4s, v2.8h, v3.8h;\n"
+				"subs %3, %3, #1;\n"
+			"b.ne 1b;\n"
+			"add v0.4s, v0.4s, v1.4s;\n"
+			"addv s0, v0.4s;\n"
+			"fmov %w0, s0;\n"
+			: "=r" (sum), "+r" (coeffs), "+r" (hist), "+r" (n)
+			:
+			: "cc", "memory", "v0", "v1", "v2", "v3"
+		);
+	}
+	for (x = 0; x < (len & 7); x++)
+		sum += coeffs[x] * hist[x];
+	return sum;
+}
+
+static inline void TAPS2SHORT_NEON(short *taps_short, const int *taps, int ntaps)
+{
+	long n = ntaps >> 3;
+	int i;
+
+	if (n) {
+		__asm__ (
+			"1:"
+				"ld1 {v0.4s, v1.4s}, [%1], #32;\n"
+				"shrn v2.4h, v0.4s, #16;\n"
+				"shrn2 v2.8h, v1.4s, #16;\n"
+				"st1 {v2.8h}, [%0], #16;\n"
+				"subs %2, %2, #1;\n"
+			"b.ne 1b;\n"
+			: "+r" (taps_short), "+r" (taps), "+r" (n)
+			:
+			: "cc", "memory", "v0", "v1", "v2"
+		);
+	}
+	for (i = 0; i < (ntaps & 7); i++)
+		taps_short[i] = taps[i] >> 16;
+}
+#endif
+
 #endif	/* MMX */
 #endif	/* _DAHDI_ARITH_H */
@@ -52,6 +52,9 @@
 #include <linux/mutex.h>
 #include <linux/ktime.h>
 #include <linux/slab.h>
+#include <linux/rcupdate.h>
+#include <linux/log2.h>
+#include <linux/topology.h>
 
 #include <linux/ppp_defs.h>
 
@@ -65,7 +68,9 @@
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
 #include <linux/sched/signal.h>
+#include <linux/sched/types.h>
 #endif /* 4.11.0 */
+#include <linux/kthread.h>
 
 #include "ecdis.h"
 #include "dahdi.h"
@@ -141,6 +146,22 @@ int debug;
 
 static int hwec_overrides_swec = 1;
 
+/* Skip software echo cancellation while the reference is silent */
+static int ec_gate = 1;
+
+/* Measure echo levels and time software echo cancellation, per chunk */
+static int ec_stats;
+
+/* Run software echo cancellation of newly assigned spans on a worker */
+static int ec_defer;
+static struct workqueue_struct *dahdi_ec_wq;
+
+/* Run HDLC framing of newly assigned spans on a kernel thread */
+static int hdlc_defer;
+
+/* Let drivers point card interrupts at the card's NUMA node */
+static int numa_irq_hint;
+
 /*!
  * \brief states for transmit signalling
  */
@@ -179,6 +200,10 @@ static sumtype *conf_sums_prev;
 static struct dahdi_span *master_span;
 struct file_operations *dahdi_transcode_fops = NULL;
 
+/* Number of times the master span has been processed. Used to timestamp
+ * channel events. Only written from _process_masterspan. */
+static u32 dahdi_ticks;
+
 
 #ifdef CONFIG_DAHDI_CONFLINK
 static struct {
@@ -242,6 +267,9 @@ static struct dahdi_dialparams global_dialparams = {
 static DEFINE_MUTEX(global_dialparamslock);
 
 static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long data);
+#ifdef CONFIG_DAHDI_PPP
+static void dahdi_ppp_detach(struct dahdi_chan *chan, struct ppp_channel *ppp);
+#endif
 
 #if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
 #if (defined(CONFIG_X86) && !defined(CONFIG_X86_64)) || defined(CONFIG_I386)
@@ -637,6 +665,97 @@ static inline bool is_chan_dacsed(const struct dahdi_chan *const chan)
 	return (NULL != chan->dacs_chan);
 }
 
+/**
+ * dahdi_chan_framed() - True if the channel moves its data in whole frames.
+ *
+ * Framed channels keep one frame per block in readbuf[] / writebuf[].  All
+ * the others stream bytes through rxring / txring.
+ */
+static inline bool dahdi_chan_framed(const struct dahdi_chan *chan)
+{
+	return (chan->flags & (DAHDI_FLAG_HDLC | DAHDI_FLAG_FCS |
+			       DAHDI_FLAG_MTP2 | DAHDI_FLAG_PPP |
+			       DAHDI_FLAG_NOSTDTXRX)) ||
+		dahdi_have_netdev(chan);
+}
+
+/* True if a read() would not block. */
+static bool dahdi_chan_readable(const struct dahdi_chan *chan)
+{
+	if (dahdi_chan_framed(chan))
+		return chan->outreadbuf > -1;
+	return chan->rxring.buf &&
+		(dahdi_ring_used(&chan->rxring) >= chan->blocksize);
+}
+
+/* True if a write() would not block. */
+static bool dahdi_chan_writable(const struct dahdi_chan *chan)
+{
+	const struct dahdi_ring *const ring = &chan->txring;
+
+	if (dahdi_chan_framed(chan))
+		return chan->inwritebuf > -1;
+	return ring->buf &&
+		(ring->depth - dahdi_ring_used(ring) >= chan->blocksize);
+}
+
+/* True if there is written data the transmitter has not sent yet. */
+static bool dahdi_chan_txpending(const struct dahdi_chan *chan)
+{
+	if (dahdi_chan_framed(chan))
+		return chan->outwritebuf > -1;
+	return dahdi_ring_used(&chan->txring) != 0;
+}
+
+/**
+ * __dahdi_chan_idle() - True if the channel only needs silence transmitted.
+ *
+ * An idle channel is a closed, plain audio channel with nothing feeding it:
+ * not conferenced, mirrored, monitored, dialing, looped, echo cancelled or
+ * carrying data.  _dahdi_receive() and _dahdi_transmit() skip these and just
+ * fill their writechunk with silence.  DACSed channels count as idle too,
+ * since their writechunk is filled from the span's cross-connect table.
+ *
+ * Called with chan->lock held.
+ */
+static bool __dahdi_chan_idle(const struct dahdi_chan *chan)
+{
+	if (is_chan_dacsed(chan))
+		return true;
+	if (chan->flags & (DAHDI_FLAG_OPEN | DAHDI_FLAG_HDLC |
+			   DAHDI_FLAG_CLEAR | DAHDI_FLAG_PPP |
+			   DAHDI_FLAG_LOOPED | DAHDI_FLAG_MONITORED))
+		return false;
+	if (dahdi_have_netdev(chan) || (chan->master != chan) ||
+	    chan->nextslave)
+		return false;
+	if (chan->confmode || chan->ec_state || dahdi_chan_txpending(chan))
+		return false;
+	if (chan->curtone || chan->dialing || chan->pdialcount ||
+	    chan->afterdialingtimer)
+		return false;
+	/* Single frequency signalling needs the audio path */
+	if (chan->rxp1 || chan->txtone)
+		return false;
+#ifdef CONFIG_DAHDI_MIRROR
+	if (chan->rxmirror || chan->txmirror || chan->srcmirror)
+		return false;
+#endif
+	return true;
+}
+
+/**
+ * mark_chan_active() - Have the next tick process chan in full again.
+ *
+ * Must be called *after* changing whatever made the channel interesting, so
+ * that a concurrent tick cannot see the old state and mark it idle again.
+ */
+static inline void mark_chan_active(struct dahdi_chan *chan)
+{
+	if (chan && chan->span)
+		set_bit(chan->chanpos - 1, chan->span->active);
+}
+
 /**
  * can_dacs_chans() - Returns true if it may be possible to dacs two channels.
  *
@@ -677,6 +796,82 @@ static void dahdi_disable_dacs(struct dahdi_chan *chan)
 	dahdi_chan_dacs(chan, NULL);
 }
 
+/**
+ * struct dahdi_tsi - Software time slot interchange for one span.
+ * @count:	Number of valid entries in @xc.
+ * @xc:		Destination channel on the span and the channel it is
+ *		sourcing its data from.
+ *
+ * Built from the dacs_chan members of the span's channels by
+ * dahdi_update_tsi() so that _dahdi_transmit() can perform all of the span's
+ * cross-connects in one pass without taking any channel locks.
+ */
+struct dahdi_tsi {
+	struct rcu_head rcu;
+	unsigned int count;
+	struct {
+		struct dahdi_chan *dst;
+		const struct dahdi_chan *src;
+	} xc[];
+};
+
+static DEFINE_SPINLOCK(tsi_lock);
+
+static void dahdi_free_tsi(struct rcu_head *head)
+{
+	kfree(container_of(head, struct dahdi_tsi, rcu));
+}
+
+/**
+ * dahdi_update_tsi() - Rebuild the cross-connect table for a span.
+ * @span:	Span whose channels had their dacs_chan changed.
+ *
+ * Must be called after changing dacs_chan on any channel of the span.  May be
+ * called in atomic context.
+ */
+static void dahdi_update_tsi(struct dahdi_span *span)
+{
+	struct dahdi_tsi *tsi = NULL;
+	struct dahdi_tsi *old;
+	unsigned long flags;
+	int x;
+	int count = 0;
+
+	if (!span)
+		return;
+
+	spin_lock_irqsave(&tsi_lock, flags);
+	for (x = 0; x < span->channels; x++) {
+		if (is_chan_dacsed(span->chans[x]))
+			++count;
+	}
+	if (count) {
+		tsi = kzalloc_node(struct_size(tsi, xc, count),
+				   GFP_ATOMIC, dahdi_span_node(span));
+		if (!tsi) {
+			module_printk(KERN_ERR, "Unable to allocate DACS table "
+				      "for span %s\n", span->name);
+		}
+	}
+	for (x = 0; tsi && x < span->channels && tsi->count < count; x++) {
+		struct dahdi_chan *const chan = span->chans[x];
+		const struct dahdi_chan *const src = chan->dacs_chan;
+
+		if (!src || (chan->master != chan) ||
+		    (chan->flags & DAHDI_FLAG_NOSTDTXRX))
+			continue;
+		tsi->xc[tsi->count].dst = chan;
+		tsi->xc[tsi->count].src = src;
+		++tsi->count;
+	}
+	old = span->tsi;
+	rcu_assign_pointer(span->tsi, tsi);
+	spin_unlock_irqrestore(&tsi_lock, flags);
+
+	if (old)
+		call_rcu(&old->rcu, dahdi_free_tsi);
+}
+
 /*!
  * \return quiescent (idle) signalling states, for the various signalling types
  */
@@ -1158,20 +1353,22 @@ static void dahdi_check_conf(int x)
 /* enqueue an event on a channel */
 static void __qevent(struct dahdi_chan *chan, int event)
 {
-	/* if full, ignore */
-	if ((chan->eventoutidx == 0) && (chan->eventinidx == (DAHDI_MAX_EVENTSIZE - 1)))
-		return;
+	int next = chan->eventinidx + 1;
 
-	/* if full, ignore */
-	if (chan->eventinidx == (chan->eventoutidx - 1))
-		return;
+	/* wrap the index, if necessary */
+	if (next >= DAHDI_MAX_EVENTSIZE)
+		next = 0;
 
-	/* save the event */
-	chan->eventbuf[chan->eventinidx++] = event;
+	/* if full, count it and ignore */
+	if (next == chan->eventoutidx) {
+		++chan->eventoverflows;
+		return;
+	}
 
-	/* wrap the index, if necessary */
-	if (chan->eventinidx >= DAHDI_MAX_EVENTSIZE)
-		chan->eventinidx = 0;
+	/* save the event and when it happened */
+	chan->eventbuf[chan->eventinidx] = event;
+	chan->eventticks[chan->eventinidx] = dahdi_ticks;
+	chan->eventinidx = next;
 
 	/* wake em all up */
 	wake_up_interruptible(&chan->waitq);
@@ -1192,10 +1389,28 @@ void dahdi_qevent_lock(struct dahdi_chan *chan, int event)
 	spin_unlock_irqrestore(&chan->lock, flags);
 }
 
+static inline void __reset_events(struct dahdi_chan *chan)
+{
+	chan->eventinidx = chan->eventoutidx = 0;
+	chan->eventoverflows = 0;
+}
+
+/**
+ * __inband_event_pending() - Should read() / write() return -ELAST?
+ *
+ * Unless the channel has asked for out of band event delivery, a pending
+ * event interrupts the audio path so that the application notices it.
+ */
+static inline bool __inband_event_pending(const struct dahdi_chan *chan)
+{
+	if (chan->flags & DAHDI_FLAG_OOBEVENTS)
+		return false;
+	return chan->eventinidx != chan->eventoutidx;
+}
+
 static inline void calc_fcs(struct dahdi_chan *ss, int inwritebuf)
 {
-	int x;
-	unsigned int fcs = PPP_INITFCS;
+	unsigned int fcs;
 	unsigned char *data = ss->writebuf[inwritebuf];
 	int len = ss->writen[inwritebuf];
 
@@ -1203,15 +1418,140 @@ static inline void calc_fcs(struct dahdi_chan *ss, int inwritebuf)
 	if (len < 2)
 		return;
 
-	for (x = 0; x < len - 2; x++)
-		fcs = PPP_FCS(fcs, data[x]);
-
+	fcs = dahdi_fcs16(PPP_INITFCS, data, len - 2);
 	fcs ^= 0xffff;
 	/* Send out the FCS */
 	data[len - 2] = (fcs & 0xff);
 	data[len - 1] = (fcs >> 8) & 0xff;
 }
 
+/* Hand len bytes at the tail back to the producer. */
+static inline void dahdi_ring_consume(struct dahdi_ring *ring, unsigned int len)
+{
+	/* Finish reading the data before the producer may reuse it */
+	smp_mb();
+	WRITE_ONCE(ring->tail, ring->tail + len);
+}
+
+/* Make len bytes written at the head visible to the consumer. */
+static inline void dahdi_ring_produce(struct dahdi_ring *ring, unsigned int len)
+{
+	smp_wmb();
+	WRITE_ONCE(ring->head, ring->head + len);
+}
+
+static void dahdi_ring_get(const struct dahdi_ring *ring, u_char *data,
+			   unsigned int len)
+{
+	const unsigned int off = ring->tail & ring->mask;
+	const unsigned int first = min(len, ring->mask + 1 - off);
+
+	memcpy(data, ring->buf + off, first);
+	memcpy(data + first, ring->buf, len - first);
+}
+
+static void dahdi_ring_put(struct dahdi_ring *ring, const u_char *data,
+			   unsigned int len)
+{
+	const unsigned int off = ring->head & ring->mask;
+	const unsigned int first = min(len, ring->mask + 1 - off);
+
+	memcpy(ring->buf + off, data, first);
+	memcpy(ring->buf, data + first, len - first);
+}
+
+static int dahdi_ring_to_user(const struct dahdi_ring *ring,
+			      char __user *data, unsigned int len)
+{
+	const unsigned int off = ring->tail & ring->mask;
+	const unsigned int first = min(len, ring->mask + 1 - off);
+
+	if (copy_to_user(data, ring->buf + off, first) ||
+	    copy_to_user(data + first, ring->buf, len - first))
+		return -EFAULT;
+	return 0;
+}
+
+static int dahdi_ring_from_user(struct dahdi_ring *ring,
+				const char __user *data, unsigned int len)
+{
+	const unsigned int off = ring->head & ring->mask;
+	const unsigned int first = min(len, ring->mask + 1 - off);
+
+	if (copy_from_user(ring->buf + off, data, first) ||
+	    copy_from_user(ring->buf, data + first, len - first))
+		return -EFAULT;
+	return 0;
+}
+
+static void dahdi_ring_init(struct dahdi_ring *ring, u_char *buf,
+			    unsigned int size, unsigned int depth)
+{
+	ring->buf = buf;
+	ring->mask = (buf) ? size - 1 : 0;
+	ring->depth = (buf) ? depth : 0;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+/*
+ * Only the tick, under chan->lock, and the one reader or writer, without it,
+ * move a ring's indices.  Anything else that wants a ring emptied holds
+ * chan->lock to keep the tick out and calls __dahdi_ring_reset(), which
+ * leaves the work to the reader or writer if it is using the ring.
+ */
+static void __dahdi_ring_reset_now(struct dahdi_ring *ring)
+{
+	WRITE_ONCE(ring->tail, ring->head);
+	/* Empty before the request is seen to be gone */
+	smp_mb__before_atomic();
+	clear_bit(DAHDI_RING_RESET, &ring->state);
+}
+
+/* Drop everything queued on the ring.  Called with chan->lock held. */
+static void __dahdi_ring_reset(struct dahdi_ring *ring)
+{
+	set_bit(DAHDI_RING_RESET, &ring->state);
+	smp_mb__after_atomic();
+	if (!test_bit(DAHDI_RING_BUSY, &ring->state))
+		__dahdi_ring_reset_now(ring);
+}
+
+static void dahdi_ring_sync(struct dahdi_chan *chan, struct dahdi_ring *ring)
+{
+	unsigned long flags;
+
+	if (!test_bit(DAHDI_RING_RESET, &ring->state))
+		return;
+	spin_lock_irqsave(&chan->lock, flags);
+	if (test_bit(DAHDI_RING_RESET, &ring->state))
+		__dahdi_ring_reset_now(ring);
+	spin_unlock_irqrestore(&chan->lock, flags);
+}
+
+/* Bracket the lockless use of the ring by read() or write(). */
+static void dahdi_ring_enter(struct dahdi_chan *chan, struct dahdi_ring *ring)
+{
+	set_bit(DAHDI_RING_BUSY, &ring->state);
+	smp_mb__after_atomic();
+	dahdi_ring_sync(chan, ring);
+}
+
+static void dahdi_ring_leave(struct dahdi_chan *chan, struct dahdi_ring *ring)
+{
+	clear_bit_unlock(DAHDI_RING_BUSY, &ring->state);
+	smp_mb__after_atomic();
+	dahdi_ring_sync(chan, ring);
+}
+
+/* How many blocks read() / write() may queue on the channel. */
+static int dahdi_chan_numbufs(const struct dahdi_chan *chan)
+{
+	if (dahdi_chan_framed(chan) || !chan->blocksize)
+		return chan->numbufs;
+	return chan->rxring.depth / chan->blocksize;
+}
+
 static int dahdi_reallocbufs(struct dahdi_chan *ss, int blocksize, int numbufs)
 {
 	unsigned char *newtxbuf = NULL;
@@ -1219,21 +1559,34 @@ static int dahdi_reallocbufs(struct dahdi_chan *ss, int blocksize, int numbufs)
 	unsigned char *oldtxbuf = NULL;
 	unsigned char *oldrxbuf = NULL;
 	unsigned long flags;
+	unsigned int size = 0;
+	unsigned int depth = 0;
 	int x;
 
+	if (blocksize < 0 || blocksize > DAHDI_MAX_BLOCKSIZE)
+		return -EINVAL;
+
 	/* Check numbufs */
 	if (numbufs < 2)
 		numbufs = 2;
 
-	if (numbufs > DAHDI_MAX_NUM_BUFS)
-		numbufs = DAHDI_MAX_NUM_BUFS;
+	/* Only unframed channels can use more than DAHDI_MAX_NUM_BUFS
+	 * buffers, and only as many as fit in DAHDI_MAX_BUF_SPACE.  Compare
+	 * by division so that a huge numbufs cannot wrap the product. */
+	if (blocksize && (numbufs > DAHDI_MAX_NUM_BUFS) &&
+	    (numbufs > DAHDI_MAX_BUF_SPACE / blocksize))
+		numbufs = max(DAHDI_MAX_NUM_BUFS, DAHDI_MAX_BUF_SPACE / blocksize);
 
 	/* We need to allocate our buffers now */
 	if (blocksize) {
-		newtxbuf = kzalloc(blocksize * numbufs, GFP_KERNEL);
+		const int nid = dahdi_chan_node(ss);
+
+		depth = blocksize * numbufs;
+		size = roundup_pow_of_two(depth);
+		newtxbuf = kzalloc_node(size, GFP_KERNEL, nid);
 		if (NULL == newtxbuf)
 			return -ENOMEM;
-		newrxbuf = kzalloc(blocksize * numbufs, GFP_KERNEL);
+		newrxbuf = kzalloc_node(size, GFP_KERNEL, nid);
 		if (NULL == newrxbuf) {
 			kfree(newtxbuf);
 			return -ENOMEM;
@@ -1245,11 +1598,36 @@ static int dahdi_reallocbufs(struct dahdi_chan *ss, int blocksize, int numbufs)
 
 	spin_lock_irqsave(&ss->lock, flags);
 
+	/* The old buffers are about to go.  A pending reset sends read() and
+	 * write() to chan->lock, so hold one on both rings and wait for any
+	 * caller already using them to leave. */
+	for (;;) {
+		set_bit(DAHDI_RING_RESET, &ss->rxring.state);
+		set_bit(DAHDI_RING_RESET, &ss->txring.state);
+		smp_mb__after_atomic();
+		if (!test_bit(DAHDI_RING_BUSY, &ss->rxring.state) &&
+		    !test_bit(DAHDI_RING_BUSY, &ss->txring.state))
+			break;
+		spin_unlock_irqrestore(&ss->lock, flags);
+		cond_resched();
+		spin_lock_irqsave(&ss->lock, flags);
+	}
+
 	ss->blocksize = blocksize; /* set the blocksize */
 	oldrxbuf = ss->readbuf[0]; /* Keep track of the old buffer */
 	oldtxbuf = ss->writebuf[0];
 	ss->readbuf[0] = NULL;
 
+	dahdi_ring_init(&ss->rxring, newrxbuf, size, depth);
+	dahdi_ring_init(&ss->txring, newtxbuf, size, depth);
+	smp_mb__before_atomic();
+	clear_bit(DAHDI_RING_RESET, &ss->rxring.state);
+	clear_bit(DAHDI_RING_RESET, &ss->txring.state);
+
+	/* The framed channels keep using fixed blocks */
+	if (numbufs > DAHDI_MAX_NUM_BUFS)
+		numbufs = DAHDI_MAX_NUM_BUFS;
+
 	if (newrxbuf) {
 		BUG_ON(NULL == newtxbuf);
 		for (x = 0; x < numbufs; x++) {
@@ -1299,6 +1677,33 @@ static int dahdi_reallocbufs(struct dahdi_chan *ss, int blocksize, int numbufs)
 }
 
 static int dahdi_hangup(struct dahdi_chan *chan);
+
+/* Mark all buffers as empty.  Called with chan->lock held. */
+static void __dahdi_reset_bufs(struct dahdi_chan *chan)
+{
+	int x;
+
+	for (x = 0; x < chan->numbufs; x++) {
+		chan->writen[x] =
+		chan->writeidx[x]=
+		chan->readn[x]=
+		chan->readidx[x] = 0;
+	}
+
+	if (chan->readbuf[0]) {
+		chan->inreadbuf = 0;
+		chan->inwritebuf = 0;
+	} else {
+		chan->inreadbuf = -1;
+		chan->inwritebuf = -1;
+	}
+	chan->outreadbuf = -1;
+	chan->outwritebuf = -1;
+	/* Framed and unframed modes share the storage, so a switch between
+	 * them must not leave stale data behind in the rings either */
+	__dahdi_ring_reset(&chan->rxring);
+	__dahdi_ring_reset(&chan->txring);
+}
 static void dahdi_set_law(struct dahdi_chan *chan, int law);
 
 /* Pull a DAHDI_CHUNKSIZE piece off the queue.  Returns
@@ -1456,6 +1861,52 @@ static void release_echocan(const struct dahdi_echocan_factory *ec)
 		module_put(ec->owner);
 }
 
+/**
+ * dahdi_ec_quiesce() - Wait for an echocan to leave its batch.
+ *
+ * Sleeps, so the echocan must already be detached from its channel.
+ */
+static void dahdi_ec_quiesce(struct dahdi_echocan_state *ec)
+{
+	wait_var_event(&ec->in_batch, !smp_load_acquire(&ec->in_batch));
+}
+
+/*
+ * Switch the NLP of the channel's echocan.  If it is in a batch, the batch
+ * does it once done, as the echocan may not be changed meanwhile.  Called
+ * with chan->lock held.
+ */
+static void __dahdi_ec_nlp_toggle(struct dahdi_chan *chan, unsigned int enable)
+{
+	struct dahdi_echocan_state *const ec = chan->ec_state;
+
+	if (ec->in_batch)
+		ec->nlp_pending = true;
+	else
+		ec->ops->echocan_NLP_toggle(ec, enable);
+}
+
+/**
+ * free_echocan() - Free an echocan that was detached from its channel.
+ * @chan:	The channel the echocan was on.
+ * @ec_state:	The former chan->ec_state, may be NULL.
+ * @ec_current:	The former chan->ec_current.
+ *
+ * dahdi_ec_span() may still be running the echocan in a batch without
+ * holding chan->lock, so wait for it to finish first.  May sleep.
+ */
+static void free_echocan(struct dahdi_chan *chan,
+			 struct dahdi_echocan_state *ec_state,
+			 const struct dahdi_echocan_factory *ec_current)
+{
+	if (!ec_state)
+		return;
+
+	dahdi_ec_quiesce(ec_state);
+	ec_state->ops->echocan_free(chan, ec_state);
+	release_echocan(ec_current);
+}
+
 /**
  * is_gain_allocated() - True if gain tables were dynamically allocated.
  * @chan:  The channel to check.
@@ -1542,6 +1993,8 @@ static void dahdi_disable_hw_preechocan(struct dahdi_chan *chan)
  * function nor it's callers should depend on the channel being findable
  * via those methods.
  */
+static void dahdi_check_monitored(struct dahdi_chan *chan);
+
 static void close_channel(struct dahdi_chan *chan)
 {
 	unsigned long flags;
@@ -1549,7 +2002,9 @@ static void close_channel(struct dahdi_chan *chan)
 	struct dahdi_echocan_state *ec_state;
 	const struct dahdi_echocan_factory *ec_current;
 	int oldconf;
+	bool was_dacsed;
 	short *readchunkpreec;
+	struct dahdi_chan *monitored = NULL;
 #ifdef CONFIG_DAHDI_PPP
 	struct ppp_channel *ppp;
 #endif
@@ -1608,10 +2063,13 @@ static void close_channel(struct dahdi_chan *chan)
 	chan->iomask = 0;
 	/* save old conf number, if any */
 	oldconf = chan->confna;
+	if (chan->confmode)
+		monitored = chan->conf_chan;
 	  /* initialize conference variables */
 	chan->_confn = 0;
 	chan->confna = 0;
 	chan->confmode = 0;
+	was_dacsed = is_chan_dacsed(chan);
 	if ((chan->sig & __DAHDI_SIG_DACS) != __DAHDI_SIG_DACS)
 		chan->dacs_chan = NULL;
 
@@ -1625,8 +2083,12 @@ static void close_channel(struct dahdi_chan *chan)
 
 	chan->rxgain = defgain;
 	chan->txgain = defgain;
-	chan->eventinidx = chan->eventoutidx = 0;
-	chan->flags &= ~(DAHDI_FLAG_LOOPED | DAHDI_FLAG_LINEAR | DAHDI_FLAG_PPP | DAHDI_FLAG_SIGFREEZE);
+	__reset_events(chan);
+	chan->flags &= ~(DAHDI_FLAG_LOOPED | DAHDI_FLAG_LINEAR | DAHDI_FLAG_PPP |
+			 DAHDI_FLAG_SIGFREEZE | DAHDI_FLAG_OOBEVENTS |
+			 DAHDI_FLAG_MTP2RX);
+	chan->mtp2_rxlen = 0;
+	memset(&chan->txrepeat, 0, sizeof(chan->txrepeat));
 
 	dahdi_set_law(chan, DAHDI_LAW_DEFAULT);
 
@@ -1639,15 +2101,19 @@ static void close_channel(struct dahdi_chan *chan)
 
 	spin_unlock_irqrestore(&chan->lock, flags);
 
-	if (ec_state) {
-		ec_state->ops->echocan_free(chan, ec_state);
-		release_echocan(ec_current);
-	}
+	if (was_dacsed)
+		dahdi_update_tsi(chan->span);
+
+	free_echocan(chan, ec_state, ec_current);
 
 	/* release conference resource, if any to release */
 	if (oldconf)
 		dahdi_check_conf(oldconf);
 
+	if (monitored)
+		dahdi_check_monitored(monitored);
+	dahdi_check_monitored(chan);
+
 	if (rxgain)
 		kfree(rxgain);
 
@@ -1657,12 +2123,8 @@ static void close_channel(struct dahdi_chan *chan)
 	}
 
 #ifdef CONFIG_DAHDI_PPP
-	if (ppp) {
-		tasklet_kill(&chan->ppp_calls);
-		skb_queue_purge(&chan->ppp_rq);
-		ppp_unregister_channel(ppp);
-		kfree(ppp);
-	}
+	if (ppp)
+		dahdi_ppp_detach(chan, ppp);
 #endif
 
 }
@@ -1912,6 +2374,9 @@ static void __dahdi_init_chan(struct dahdi_chan *chan)
 	spin_lock_init(&chan->lock);
 	mutex_init(&chan->mutex);
 	init_waitqueue_head(&chan->waitq);
+#ifdef CONFIG_DAHDI_PPP
+	INIT_LIST_HEAD(&chan->ppp_node);
+#endif
 	if (!chan->master)
 		chan->master = chan;
 	if (!chan->readchunk)
@@ -1923,42 +2388,334 @@ static void __dahdi_init_chan(struct dahdi_chan *chan)
 	close_channel(chan);
 }
 
-/**
- * dahdi_chan_reg - Mark the channel registered.
- *
- * This must be called after close channel during registration, normally
- * covered by the call to __dahdi_init_chan, to avoid "HDLC hangage"
+/*
+ * Give the channel its HDLC counters, if it has none yet.  They then stay
+ * until the channel is unregistered, so that switching modes back and forth
+ * does not lose them.
  */
-static inline void dahdi_chan_reg(struct dahdi_chan *chan)
+static int dahdi_chan_hdlc_counters_alloc(struct dahdi_chan *chan)
 {
-	set_bit(DAHDI_FLAGBIT_REGISTERED, &chan->flags);
-}
+	struct dahdi_hdlc_counters __percpu *counters;
+	unsigned long flags;
+	int cpu;
 
-/**
- * dahdi_lboname() - Convert line build out number to string.
- *
- */
-const char *dahdi_lboname(int lbo)
-{
-	/* names of tx level settings */
-	static const char *const dahdi_txlevelnames[] = {
-		"0 db (CSU)/0-133 feet (DSX-1)",
-		"133-266 feet (DSX-1)",
-		"266-399 feet (DSX-1)",
-		"399-533 feet (DSX-1)",
-		"533-655 feet (DSX-1)",
-		"-7.5db (CSU)",
-		"-15db (CSU)",
-		"-22.5db (CSU)"
-	};
+	might_sleep();
 
-	if ((lbo < 0) || (lbo > 7))
-		return "Unknown";
-	return dahdi_txlevelnames[lbo];
+	if (READ_ONCE(chan->hdlc_counters))
+		return 0;
+	counters = alloc_percpu(struct dahdi_hdlc_counters);
+	if (!counters)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu)
+		u64_stats_init(&per_cpu_ptr(counters, cpu)->syncp);
+
+	spin_lock_irqsave(&chan->lock, flags);
+	if (!chan->hdlc_counters) {
+		rcu_assign_pointer(chan->hdlc_counters, counters);
+		counters = NULL;
+	}
+	spin_unlock_irqrestore(&chan->lock, flags);
+	free_percpu(counters);
+	return 0;
 }
-EXPORT_SYMBOL(dahdi_lboname);
 
-#if defined(CONFIG_DAHDI_NET) || defined(CONFIG_DAHDI_PPP)
+static void dahdi_chan_hdlc_counters_free(struct dahdi_chan *chan)
+{
+	struct dahdi_hdlc_counters __percpu *counters;
+	unsigned long flags;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	counters = chan->hdlc_counters;
+	RCU_INIT_POINTER(chan->hdlc_counters, NULL);
+	spin_unlock_irqrestore(&chan->lock, flags);
+	if (!counters)
+		return;
+	/* Let dahdi_chan_hdlc_sum() finish with them */
+	synchronize_rcu();
+	free_percpu(counters);
+}
+
+/* Called with ms->lock held, which keeps other writers off this CPU's copy */
+static inline void
+__dahdi_hdlc_count(struct dahdi_chan *ms, enum dahdi_hdlc_counter c,
+		   unsigned int n)
+{
+	struct dahdi_hdlc_counters *p;
+
+	if (!ms->hdlc_counters)
+		return;
+	p = this_cpu_ptr(ms->hdlc_counters);
+	u64_stats_update_begin(&p->syncp);
+	p->cnt[c] += n;
+	u64_stats_update_end(&p->syncp);
+}
+
+/* Called with ms->lock held, @frames is DAHDI_HDLC_RX_FRAMES or _TX_FRAMES */
+static inline void
+__dahdi_hdlc_count_frame(struct dahdi_chan *ms, enum dahdi_hdlc_counter frames,
+			 unsigned int len)
+{
+	struct dahdi_hdlc_counters *p;
+
+	if (!ms->hdlc_counters)
+		return;
+	p = this_cpu_ptr(ms->hdlc_counters);
+	u64_stats_update_begin(&p->syncp);
+	p->cnt[frames]++;
+	p->cnt[frames + 1] += len;
+	u64_stats_update_end(&p->syncp);
+}
+
+/*
+ * All of the read buffers are full.  Run what is left of the chunk through
+ * the deframer anyway, so that rx_nobuf counts the octets lost rather than
+ * line bytes, and idle flags do not count at all.
+ *
+ * Called with ms->lock held.
+ */
+static void __dahdi_hdlc_rx_nobuf(struct dahdi_chan *ms,
+				  const unsigned char *rxb, int bytes)
+{
+	unsigned char discard[64];
+	int res;
+
+	while (bytes) {
+		res = fasthdlc_rx_decode(&ms->rxhdlc, &rxb, &bytes,
+					 discard, sizeof(discard));
+		__dahdi_hdlc_count(ms, DAHDI_HDLC_RX_NOBUF,
+				   res & RETURN_LEN_MASK);
+	}
+}
+
+/* Called with ms->lock held, for the DAHDI_EVENT_* a frame was aborted with */
+static void __dahdi_hdlc_count_abort(struct dahdi_chan *ms, int event)
+{
+	switch (event) {
+	case DAHDI_EVENT_BADFCS:
+		__dahdi_hdlc_count(ms, DAHDI_HDLC_RX_BADFCS, 1);
+		break;
+	case DAHDI_EVENT_OVERRUN:
+		__dahdi_hdlc_count(ms, DAHDI_HDLC_RX_OVERRUNS, 1);
+		break;
+	default:
+		__dahdi_hdlc_count(ms, DAHDI_HDLC_RX_ABORTS, 1);
+		break;
+	}
+}
+
+/*
+ * An idle MTP2 link sends the same FISU, or LSSU while aligning, over and
+ * over.  Returns true if the frame in @buf is one of those and the same as
+ * the last one passed on, so the reader does not need to see it again.
+ *
+ * Called with ms->lock held.
+ */
+static bool __dahdi_mtp2_rx_repeat(struct dahdi_chan *ms, const u8 *buf,
+				   int len)
+{
+	/* The length indicator is the low six bits of the third octet: 0 for
+	 * an FISU, 1 or 2 for an LSSU, and more for an MSU. */
+	if (len < DAHDI_MTP2_FISU_LEN || len > DAHDI_MTP2_LSSU_MAX ||
+	    (buf[2] & 0x3f) > 2) {
+		/* Deliver the next status unit after anything else, even if it
+		 * did not change. */
+		ms->mtp2_rxlen = 0;
+		return false;
+	}
+	if (len == ms->mtp2_rxlen && !memcmp(buf, ms->mtp2_rxlast, len))
+		return true;
+	memcpy(ms->mtp2_rxlast, buf, len);
+	ms->mtp2_rxlen = len;
+	return false;
+}
+
+/*
+ * Between frames, switch over to a repeat frame that was set meanwhile.
+ * Returns true if there is a repeat frame to send.
+ *
+ * Called with ms->lock held.
+ */
+static inline bool __dahdi_txrepeat_ready(struct dahdi_chan *ms)
+{
+	struct dahdi_txrepeat *const r = &ms->txrepeat;
+
+	if (r->pending) {
+		r->cur ^= 1;
+		r->pending = false;
+	}
+	return r->len[r->cur];
+}
+
+/*
+ * Encode (more of) the repeat frame into @txb and close it with a flag once
+ * all of it is loaded.  Returns how many octets of @txb were filled.
+ *
+ * Called with ms->lock held.
+ */
+static int __dahdi_hdlc_repeat(struct dahdi_chan *ms, unsigned char *txb,
+			       int bytes)
+{
+	struct dahdi_txrepeat *const r = &ms->txrepeat;
+	const unsigned char *data = r->frame[r->cur] + r->idx;
+	int len = r->len[r->cur] - r->idx;
+	int x;
+
+	x = fasthdlc_tx_encode(&ms->txhdlc, &data, &len, txb, bytes);
+	r->idx = r->len[r->cur] - len;
+	if (!len) {
+		fasthdlc_tx_frame_nocheck(&ms->txhdlc);
+		r->idx = 0;
+		__dahdi_hdlc_count(ms, DAHDI_HDLC_TX_REPEATED, 1);
+	}
+	return x;
+}
+
+/*
+ * Adds the channel's counters to @sum.  Returns false if it has none.
+ * Takes no channel lock, so it never holds up the tick.
+ */
+static bool dahdi_chan_hdlc_sum(struct dahdi_chan *chan, u64 *sum)
+{
+	struct dahdi_hdlc_counters __percpu *counters;
+	const struct dahdi_hdlc_counters *c;
+	u64 cnt[DAHDI_HDLC_NR_COUNTERS];
+	unsigned int start;
+	int cpu;
+	int i;
+
+	rcu_read_lock();
+	counters = rcu_dereference(chan->hdlc_counters);
+	if (!counters) {
+		rcu_read_unlock();
+		return false;
+	}
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(counters, cpu);
+		do {
+			start = u64_stats_fetch_begin(&c->syncp);
+			memcpy(cnt, c->cnt, sizeof(cnt));
+		} while (u64_stats_fetch_retry(&c->syncp, start));
+		for (i = 0; i < DAHDI_HDLC_NR_COUNTERS; i++)
+			sum[i] += cnt[i];
+	}
+	rcu_read_unlock();
+	return true;
+}
+
+static void dahdi_hdlc_stats_fill(struct dahdi_hdlc_stats *stats,
+				  const u64 *sum)
+{
+	stats->rx_frames = sum[DAHDI_HDLC_RX_FRAMES];
+	stats->rx_bytes = sum[DAHDI_HDLC_RX_BYTES];
+	stats->rx_aborts = sum[DAHDI_HDLC_RX_ABORTS];
+	stats->rx_badfcs = sum[DAHDI_HDLC_RX_BADFCS];
+	stats->rx_overruns = sum[DAHDI_HDLC_RX_OVERRUNS];
+	stats->rx_dropped = sum[DAHDI_HDLC_RX_DROPPED];
+	stats->rx_nobuf = sum[DAHDI_HDLC_RX_NOBUF];
+	stats->tx_frames = sum[DAHDI_HDLC_TX_FRAMES];
+	stats->tx_bytes = sum[DAHDI_HDLC_TX_BYTES];
+	stats->rx_suppressed = sum[DAHDI_HDLC_RX_SUPPRESSED];
+	stats->tx_repeated = sum[DAHDI_HDLC_TX_REPEATED];
+}
+
+/**
+ * dahdi_chan_hdlc_stats() - Get the HDLC frame counters of a channel.
+ * @chan:	The channel.
+ * @stats:	Filled in.
+ *
+ * Returns -EINVAL if the channel was never configured for HDLC.
+ */
+int dahdi_chan_hdlc_stats(struct dahdi_chan *chan,
+			  struct dahdi_hdlc_stats *stats)
+{
+	u64 sum[DAHDI_HDLC_NR_COUNTERS] = {0};
+
+	memset(stats, 0, sizeof(*stats));
+	if (!dahdi_chan_hdlc_sum(chan, sum))
+		return -EINVAL;
+	dahdi_hdlc_stats_fill(stats, sum);
+	return 0;
+}
+
+/**
+ * dahdi_span_hdlc_stats() - Get the HDLC frame counters of a whole span.
+ * @span:	The span.
+ * @stats:	Filled in with the sum over all of its HDLC channels.
+ *
+ * Returns how many of the channels have HDLC counters.
+ */
+int dahdi_span_hdlc_stats(struct dahdi_span *span,
+			  struct dahdi_hdlc_stats *stats)
+{
+	u64 sum[DAHDI_HDLC_NR_COUNTERS] = {0};
+	int count = 0;
+	int x;
+
+	for (x = 0; x < span->channels; x++) {
+		if (dahdi_chan_hdlc_sum(span->chans[x], sum))
+			count++;
+	}
+	dahdi_hdlc_stats_fill(stats, sum);
+	return count;
+}
+
+/* Formats @stats for sysfs. */
+int dahdi_hdlc_stats_show(const struct dahdi_hdlc_stats *stats, char *buf)
+{
+	return sprintf(buf,
+		       "rx_frames: %llu\n"
+		       "rx_bytes: %llu\n"
+		       "rx_aborts: %llu\n"
+		       "rx_badfcs: %llu\n"
+		       "rx_overruns: %llu\n"
+		       "rx_dropped: %llu\n"
+		       "rx_nobuf: %llu\n"
+		       "tx_frames: %llu\n"
+		       "tx_bytes: %llu\n"
+		       "rx_suppressed: %llu\n"
+		       "tx_repeated: %llu\n",
+		       stats->rx_frames, stats->rx_bytes, stats->rx_aborts,
+		       stats->rx_badfcs, stats->rx_overruns, stats->rx_dropped,
+		       stats->rx_nobuf, stats->tx_frames, stats->tx_bytes,
+		       stats->rx_suppressed, stats->tx_repeated);
+}
+
+/**
+ * dahdi_chan_reg - Mark the channel registered.
+ *
+ * This must be called after close channel during registration, normally
+ * covered by the call to __dahdi_init_chan, to avoid "HDLC hangage"
+ */
+static inline void dahdi_chan_reg(struct dahdi_chan *chan)
+{
+	set_bit(DAHDI_FLAGBIT_REGISTERED, &chan->flags);
+}
+
+/**
+ * dahdi_lboname() - Convert line build out number to string.
+ *
+ */
+const char *dahdi_lboname(int lbo)
+{
+	/* names of tx level settings */
+	static const char *const dahdi_txlevelnames[] = {
+		"0 db (CSU)/0-133 feet (DSX-1)",
+		"133-266 feet (DSX-1)",
+		"266-399 feet (DSX-1)",
+		"399-533 feet (DSX-1)",
+		"533-655 feet (DSX-1)",
+		"-7.5db (CSU)",
+		"-15db (CSU)",
+		"-22.5db (CSU)"
+	};
+
+	if ((lbo < 0) || (lbo > 7))
+		return "Unknown";
+	return dahdi_txlevelnames[lbo];
+}
+EXPORT_SYMBOL(dahdi_lboname);
+
+#if defined(CONFIG_DAHDI_NET) || defined(CONFIG_DAHDI_PPP)
 static inline void print_debug_writebuf(struct dahdi_chan* ss, struct sk_buff *skb, int oldbuf)
 {
 #ifdef CONFIG_DAHDI_DEBUG
@@ -2008,8 +2765,8 @@ static int dahdi_net_open(struct net_device *dev)
 
 	fasthdlc_init(&ms->rxhdlc, (ms->flags & DAHDI_FLAG_HDLC56) ? FASTHDLC_MODE_56 : FASTHDLC_MODE_64);
 	fasthdlc_init(&ms->txhdlc, (ms->flags & DAHDI_FLAG_HDLC56) ? FASTHDLC_MODE_56 : FASTHDLC_MODE_64);
-	ms->infcs = PPP_INITFCS;
 
+	napi_enable(&ms->hdlcnetdev->napi);
 	netif_start_queue(chan_to_netdev(ms));
 
 #ifdef CONFIG_DAHDI_DEBUG
@@ -2032,6 +2789,31 @@ static int dahdi_register_hdlc_device(struct net_device *dev, const char *dev_na
 	return 0;
 }
 
+/*
+ * Drop whatever dahdi_xmit() and __dahdi_net_putbuf() still hold, once the
+ * buffers are gone and the tick no longer adds to it.
+ */
+static void dahdi_net_flush(struct dahdi_chan *ms)
+{
+	struct dahdi_hdlc *const hdlc = ms->hdlcnetdev;
+	struct sk_buff_head txq;
+	struct sk_buff *txskb, *rxskb;
+	unsigned long flags;
+
+	__skb_queue_head_init(&txq);
+	spin_lock_irqsave(&ms->lock, flags);
+	skb_queue_splice_init(&hdlc->txq, &txq);
+	txskb = hdlc->txskb;
+	rxskb = hdlc->rxskb;
+	hdlc->txskb = hdlc->rxskb = NULL;
+	spin_unlock_irqrestore(&ms->lock, flags);
+
+	__skb_queue_purge(&txq);
+	kfree_skb(txskb);
+	kfree_skb(rxskb);
+	skb_queue_purge(&hdlc->rxq);
+}
+
 static int dahdi_net_stop(struct net_device *dev)
 {
 	hdlc_device *h = dev_to_hdlc(dev);
@@ -2048,7 +2830,9 @@ static int dahdi_net_stop(struct net_device *dev)
 	}
 	/* Not much to do here.  Just deallocate the buffers */
 	netif_stop_queue(chan_to_netdev(ms));
+	napi_disable(&hdlc->napi);
 	dahdi_reallocbufs(ms, 0, 0);
+	dahdi_net_flush(ms);
 	hdlc_close(dev);
 	return 0;
 }
@@ -2083,69 +2867,280 @@ static int dahdi_net_attach(struct net_device *dev, unsigned short encoding,
 
 static struct dahdi_hdlc *dahdi_hdlc_alloc(void)
 {
-	return kzalloc(sizeof(struct dahdi_hdlc), GFP_KERNEL);
+	struct dahdi_hdlc *hdlc;
+
+	hdlc = kzalloc(sizeof(struct dahdi_hdlc), GFP_KERNEL);
+	if (hdlc) {
+		skb_queue_head_init(&hdlc->txq);
+		skb_queue_head_init(&hdlc->rxq);
+	}
+	return hdlc;
 }
 
+/* Frames queued on the channel before dahdi_xmit() stops the queue */
+#define DAHDI_NET_TXQ_LEN	8
+
+/* Received frames waiting for dahdi_net_poll() before they are dropped */
+#define DAHDI_NET_RXQ_LEN	256
+
+/* The inverted FCS of a queued frame, sent LSB first after its data */
+#define DAHDI_NET_FCS(skb)	(*(u16 *)(skb)->cb)
+
 static int dahdi_xmit(struct sk_buff *skb, struct net_device *dev)
 {
-	/* FIXME: this construction seems to be not very optimal for me but I
-	 * could find nothing better at the moment (Friday, 10PM :( )  --byg
-	 * */
 	struct dahdi_chan *ss = netdev_to_chan(dev);
+	struct dahdi_hdlc *hdlc = ss->hdlcnetdev;
 	struct net_device_stats *stats = hdlc_stats(dev);
-
-	int retval = 1;
-	int x,oldbuf;
-	unsigned int fcs;
-	unsigned char *data;
 	unsigned long flags;
-	/* See if we have any buffers */
-	spin_lock_irqsave(&ss->lock, flags);
+
 	if (skb->len > ss->blocksize - 2) {
 		module_printk(KERN_ERR, "dahdi_xmit(%s): skb is too large (%d > %d)\n", dev->name, skb->len, ss->blocksize -2);
 		stats->tx_dropped++;
-		retval = 0;
-	} else if (ss->inwritebuf >= 0) {
-		/* We have a place to put this packet */
-		/* XXX We should keep the SKB and avoid the memcpy XXX */
-		data = ss->writebuf[ss->inwritebuf];
-		memcpy(data, skb->data, skb->len);
-		ss->writen[ss->inwritebuf] = skb->len;
-		ss->writeidx[ss->inwritebuf] = 0;
-		/* Calculate the FCS */
-		fcs = PPP_INITFCS;
-		for (x=0;x<skb->len;x++)
-			fcs = PPP_FCS(fcs, data[x]);
-		/* Invert it */
-		fcs ^= 0xffff;
-		/* Send it out LSB first */
-		data[ss->writen[ss->inwritebuf]++] = (fcs & 0xff);
-		data[ss->writen[ss->inwritebuf]++] = (fcs >> 8) & 0xff;
-		/* Advance to next window */
-		oldbuf = ss->inwritebuf;
-		ss->inwritebuf = (ss->inwritebuf + 1) % ss->numbufs;
+		dev_kfree_skb_any(skb);
+		return 0;
+	}
+	if (skb_linearize(skb)) {
+		stats->tx_dropped++;
+		dev_kfree_skb_any(skb);
+		return 0;
+	}
 
-		if (ss->inwritebuf == ss->outwritebuf) {
-			/* Whoops, no more space.  */
-		    ss->inwritebuf = -1;
+	/* The skb is kept and sent from by __dahdi_net_getbuf() */
+	DAHDI_NET_FCS(skb) = dahdi_fcs16(PPP_INITFCS, skb->data, skb->len) ^
+			     0xffff;
+
+	spin_lock_irqsave(&ss->lock, flags);
+	__skb_queue_tail(&hdlc->txq, skb);
+	if (skb_queue_len(&hdlc->txq) >= DAHDI_NET_TXQ_LEN)
+		netif_stop_queue(dev);
+	dev->trans_start = jiffies;
+	spin_unlock_irqrestore(&ss->lock, flags);
+	return 0;
+}
 
-		    netif_stop_queue(chan_to_netdev(ss));
+/*
+ * Send HDLC straight from the frames queued by dahdi_xmit().  Returns how
+ * much of txb was filled, which is less than bytes only if the queue ran
+ * empty.  Called with ms->lock held.
+ */
+static int __dahdi_net_getbuf(struct dahdi_chan *ms, unsigned char *txb,
+			      int bytes)
+{
+	struct dahdi_hdlc *const hdlc = ms->hdlcnetdev;
+	struct net_device *const dev = chan_to_netdev(ms);
+	struct sk_buff *skb = hdlc->txskb;
+	const unsigned char *data;
+	int len;
+	int x = 0;
+
+	while (x < bytes) {
+		if (skb && (hdlc->txidx < skb->len)) {
+			data = skb->data + hdlc->txidx;
+			len = skb->len - hdlc->txidx;
+			x += fasthdlc_tx_encode(&ms->txhdlc, &data, &len,
+						txb + x, bytes - x);
+			hdlc->txidx = skb->len - len;
+			continue;
 		}
-		if (ss->outwritebuf < 0) {
-			/* Let the interrupt handler know there's
-			   some space for us */
-			ss->outwritebuf = oldbuf;
+		if (fasthdlc_tx_need_data(&ms->txhdlc)) {
+			if (skb && (hdlc->txidx == skb->len + 2)) {
+				/* All sent, close the frame with a flag */
+				hdlc_stats(dev)->tx_packets++;
+				hdlc_stats(dev)->tx_bytes += skb->len + 2;
+				__dahdi_hdlc_count_frame(ms, DAHDI_HDLC_TX_FRAMES,
+							 skb->len + 2);
+				dev_kfree_skb_any(skb);
+				skb = NULL;
+				fasthdlc_tx_frame_nocheck(&ms->txhdlc);
+				if (skb_queue_len(&hdlc->txq) < DAHDI_NET_TXQ_LEN)
+					netif_wake_queue(dev);
+			} else {
+				if (!skb) {
+					skb = __skb_dequeue(&hdlc->txq);
+					if (!skb)
+						break;
+					hdlc->txidx = 0;
+				}
+				if (hdlc->txidx < skb->len)
+					continue;
+				fasthdlc_tx_load_nocheck(&ms->txhdlc,
+					DAHDI_NET_FCS(skb) >> (8 * (hdlc->txidx - skb->len)));
+				hdlc->txidx++;
+			}
 		}
-		dev->trans_start = jiffies;
-		stats->tx_packets++;
-		stats->tx_bytes += ss->writen[oldbuf];
-		print_debug_writebuf(ss, skb, oldbuf);
-		retval = 0;
-		/* Free the SKB */
+		txb[x++] = fasthdlc_tx_run_nocheck(&ms->txhdlc);
+	}
+
+	hdlc->txskb = skb;
+	return x;
+}
+
+static inline bool dahdi_net_tx_pending(const struct dahdi_chan *ms)
+{
+	return ms->hdlcnetdev->txskb || !skb_queue_empty(&ms->hdlcnetdev->txq);
+}
+
+/*
+ * Queue a received frame for dahdi_net_poll().  This runs from the tick,
+ * usually in the card's interrupt, so the stack only gets to see the frames
+ * later in softirq, a batch at a time.
+ */
+static void dahdi_net_rx(struct dahdi_chan *ms, struct sk_buff *skb)
+{
+	struct dahdi_hdlc *const hdlc = ms->hdlcnetdev;
+
+	if (skb_queue_len(&hdlc->rxq) >= DAHDI_NET_RXQ_LEN) {
+		hdlc_stats(chan_to_netdev(ms))->rx_dropped++;
 		dev_kfree_skb_any(skb);
+		return;
 	}
-	spin_unlock_irqrestore(&ss->lock, flags);
-	return retval;
+	skb_reset_mac_header(skb);
+	skb->dev = chan_to_netdev(ms);
+#ifdef DAHDI_HDLC_TYPE_TRANS
+	skb->protocol = hdlc_type_trans(skb, chan_to_netdev(ms));
+#else
+	skb->protocol = htons(ETH_P_HDLC);
+#endif
+	skb_queue_tail(&hdlc->rxq, skb);
+	napi_schedule(&hdlc->napi);
+}
+
+static int dahdi_net_poll(struct napi_struct *napi, int budget)
+{
+	struct dahdi_hdlc *const hdlc = container_of(napi, struct dahdi_hdlc,
+						     napi);
+	struct sk_buff_head batch;
+	struct sk_buff *skb;
+	unsigned long flags;
+	int done = 0;
+
+	__skb_queue_head_init(&batch);
+	spin_lock_irqsave(&hdlc->rxq.lock, flags);
+	while ((done < budget) && (skb = __skb_dequeue(&hdlc->rxq))) {
+		__skb_queue_tail(&batch, skb);
+		done++;
+	}
+	spin_unlock_irqrestore(&hdlc->rxq.lock, flags);
+
+	while ((skb = __skb_dequeue(&batch)))
+		napi_gro_receive(napi, skb);
+
+	if (done < budget) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+		napi_complete_done(napi, done);
+#else
+		napi_complete(napi);
+#endif
+		/* A frame queued just now could not schedule us again */
+		if (!skb_queue_empty(&hdlc->rxq))
+			napi_schedule(napi);
+	}
+	return done;
+}
+
+static void dahdi_net_napi_add(struct dahdi_hdlc *hdlc)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+	netif_napi_add(hdlc->netdev, &hdlc->napi, dahdi_net_poll);
+#else
+	netif_napi_add(hdlc->netdev, &hdlc->napi, dahdi_net_poll, 64);
+#endif
+}
+
+static void dahdi_net_rx_reset(struct dahdi_hdlc *hdlc)
+{
+	struct sk_buff *const skb = hdlc->rxskb;
+
+	skb->data = skb->head + hdlc->rxheadroom;
+	skb_reset_tail_pointer(skb);
+	skb->len = 0;
+}
+
+/*
+ * Decode HDLC straight into an skb, instead of into the read buffer and
+ * copying it from there.  Returns how many bytes of rxb were used; the rest
+ * (if an skb could not be allocated) goes through the read buffer.  Called
+ * with ms->lock held.
+ */
+static int __dahdi_net_putbuf(struct dahdi_chan *ms, const unsigned char *rxb,
+			      int bytes)
+{
+	struct dahdi_hdlc *const hdlc = ms->hdlcnetdev;
+	struct net_device_stats *stats = hdlc_stats(chan_to_netdev(ms));
+	struct sk_buff *skb = hdlc->rxskb;
+	int left = bytes;
+	u8 first;
+	int res;
+
+	/* Switch over from the read buffer only between frames */
+	if (!skb && (ms->inreadbuf < 0 || ms->readidx[ms->inreadbuf]))
+		return 0;
+
+	while (left) {
+		if (!skb) {
+			skb = dev_alloc_skb(ms->blocksize + 2);
+			if (!skb)
+				break;
+			hdlc->rxskb = skb;
+			hdlc->rxheadroom = skb_headroom(skb);
+		}
+
+		if (!skb->len) {
+			/* Align the payload, unless it has a Cisco header */
+			res = fasthdlc_rx_decode(&ms->rxhdlc, &rxb, &left,
+						 &first, 1);
+			if (res == 1) {
+				if (first != 0x0f && first != 0x8f)
+					skb_reserve(skb, 2);
+				*(u8 *)__skb_put(skb, 1) = first;
+			}
+		} else {
+			res = fasthdlc_rx_decode(&ms->rxhdlc, &rxb, &left,
+						 skb_tail_pointer(skb),
+						 ms->blocksize - skb->len);
+			__skb_put(skb, res & RETURN_LEN_MASK);
+		}
+
+		if (res & RETURN_COMPLETE_FLAG) {
+			if (!skb->len)
+				continue;
+			if (((ms->flags & DAHDI_FLAG_FCS) &&
+			     (dahdi_fcs16(PPP_INITFCS, skb->data, skb->len) !=
+			      PPP_GOODFCS)) || (skb->len <= 2)) {
+				stats->rx_errors++;
+				stats->rx_crc_errors++;
+				__dahdi_hdlc_count_abort(ms, DAHDI_EVENT_BADFCS);
+				dahdi_net_rx_reset(hdlc);
+				continue;
+			}
+			__dahdi_hdlc_count_frame(ms, DAHDI_HDLC_RX_FRAMES, skb->len);
+			/* Drop the FCS */
+			skb_trim(skb, skb->len - 2);
+			stats->rx_packets++;
+			stats->rx_bytes += skb->len;
+			dahdi_net_rx(ms, skb);
+			skb = hdlc->rxskb = NULL;
+		} else if (res & RETURN_DISCARD_FLAG) {
+			/* This could be someone idling with "idle" instead of
+			 * "flag" */
+			if (!skb->len)
+				continue;
+			stats->rx_errors++;
+			stats->rx_frame_errors++;
+			__dahdi_hdlc_count_abort(ms, DAHDI_EVENT_ABORT);
+			dahdi_net_rx_reset(hdlc);
+		} else if (skb->len >= ms->blocksize) {
+			stats->rx_errors++;
+			stats->rx_over_errors++;
+			__dahdi_hdlc_count_abort(ms, DAHDI_EVENT_OVERRUN);
+			/* Force the HDLC state back to frame-search mode */
+			ms->rxhdlc.state = 0;
+			ms->rxhdlc.bits = 0;
+			dahdi_net_rx_reset(hdlc);
+		}
+	}
+
+	return bytes - left;
 }
 
 static int dahdi_net_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
@@ -2166,7 +3161,7 @@ static int dahdi_ppp_xmit(struct ppp_channel *ppp, struct sk_buff *skb)
 	 * 1 and never if we return 0
          */
 	struct dahdi_chan *ss = ppp->private;
-	int x,oldbuf;
+	int oldbuf;
 	unsigned int fcs;
 	unsigned char *data;
 	unsigned long flags;
@@ -2199,9 +3194,7 @@ static int dahdi_ppp_xmit(struct ppp_channel *ppp, struct sk_buff *skb)
 		ss->writeidx[ss->inwritebuf] = 0;
 
 		/* Calculate the FCS */
-		fcs = PPP_INITFCS;
-		for (x=0;x<skb->len + 2;x++)
-			fcs = PPP_FCS(fcs, data[x]);
+		fcs = dahdi_fcs16(PPP_INITFCS, data, skb->len + 2);
 		/* Invert it */
 		fcs ^= 0xffff;
 
@@ -2273,12 +3266,39 @@ static bool is_monitor_mode(int confmode)
 	}
 }
 
-static unsigned long _chan_cleanup(struct dahdi_chan *pos, unsigned long data)
+static unsigned long _chan_monitors(struct dahdi_chan *pos, unsigned long data)
 {
-	unsigned long flags;
-	struct dahdi_chan *const chan = (struct dahdi_chan *)data;
-	/* Remove anyone pointing to us as master
-	   and make them their own thing */
+	const int confmode = pos->confmode & DAHDI_CONF_MODE_MASK;
+
+	return (pos->conf_chan == (struct dahdi_chan *)data) &&
+	       ((DAHDI_CONF_DIGITALMON == confmode) || is_monitor_mode(confmode));
+}
+
+/**
+ * dahdi_check_monitored() - Recompute DAHDI_FLAG_MONITORED for a channel.
+ * @chan:	Channel that may have gained or lost its last monitor.
+ *
+ * Call after a channel stops monitoring @chan, or when @chan is closed, so
+ * that a channel nobody monitors can go back to the idle fast path.
+ */
+static void dahdi_check_monitored(struct dahdi_chan *chan)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&chan_lock, flags);
+	if (__for_each_channel(_chan_monitors, (unsigned long)chan))
+		set_bit(DAHDI_FLAGBIT_MONITORED, &chan->flags);
+	else
+		clear_bit(DAHDI_FLAGBIT_MONITORED, &chan->flags);
+	spin_unlock_irqrestore(&chan_lock, flags);
+}
+
+static unsigned long _chan_cleanup(struct dahdi_chan *pos, unsigned long data)
+{
+	unsigned long flags;
+	struct dahdi_chan *const chan = (struct dahdi_chan *)data;
+	/* Remove anyone pointing to us as master
+	   and make them their own thing */
 	if (pos->master == chan)
 		pos->master = pos;
 
@@ -2299,6 +3319,7 @@ static unsigned long _chan_cleanup(struct dahdi_chan *pos, unsigned long data)
 		pos->conf_chan = NULL;
 		pos->dacs_chan = NULL;
 		spin_unlock_irqrestore(&pos->lock, flags);
+		dahdi_update_tsi(pos->span);
 	}
 
 	return 0;
@@ -2340,6 +3361,7 @@ static void dahdi_chan_unreg(struct dahdi_chan *chan)
 		chan->hdlcnetdev = NULL;
 	}
 #endif
+	dahdi_chan_hdlc_counters_free(chan);
 	clear_bit(DAHDI_FLAGBIT_REGISTERED, &chan->flags);
 
 #ifdef CONFIG_DAHDI_PPP
@@ -2388,6 +3410,56 @@ static void dahdi_chan_unreg(struct dahdi_chan *chan)
 	}
 }
 
+/**
+ * dahdi_chan_read_ring() - Copy up to a block of received stream data.
+ *
+ * Unlike the framed channels, whatever the caller did not ask for stays in
+ * the ring for the next read.
+ */
+static ssize_t dahdi_chan_read_ring(struct dahdi_chan *chan,
+				    char __user *usrbuf, size_t count)
+{
+	struct dahdi_ring *const ring = &chan->rxring;
+	const unsigned int tail = ring->tail;
+	unsigned int amnt;
+	unsigned int pos;
+	unsigned int pass;
+	int x;
+
+	amnt = dahdi_ring_used(ring);
+	/* Read the head before the data it covers */
+	smp_rmb();
+	if (amnt > chan->blocksize)
+		amnt = chan->blocksize;
+
+	if (!(chan->flags & DAHDI_FLAG_LINEAR)) {
+		if (amnt > count)
+			amnt = count;
+		if (dahdi_ring_to_user(ring, usrbuf, amnt))
+			return -EFAULT;
+		dahdi_ring_consume(ring, amnt);
+		return amnt;
+	}
+
+	if (amnt > (count >> 1))
+		amnt = count >> 1;
+	for (pos = 0; pos < amnt; pos += pass) {
+		/* There seems to be a max stack size, so we have
+		   to do this in smaller pieces */
+		short lindata[128];
+
+		pass = min_t(unsigned int, amnt - pos, ARRAY_SIZE(lindata));
+		for (x = 0; x < pass; x++) {
+			lindata[x] = DAHDI_XLAW(
+				ring->buf[(tail + pos + x) & ring->mask], chan);
+		}
+		if (copy_to_user(usrbuf + (pos << 1), lindata, pass << 1))
+			return -EFAULT;
+	}
+	dahdi_ring_consume(ring, amnt);
+	return amnt << 1;
+}
+
 static ssize_t dahdi_chan_read(struct file *file, char __user *usrbuf,
 			       size_t count, loff_t *ppos)
 {
@@ -2395,6 +3467,7 @@ static ssize_t dahdi_chan_read(struct file *file, char __user *usrbuf,
 	int amnt;
 	int res, rv;
 	int oldbuf,x;
+	bool ready;
 	unsigned long flags;
 
 	/* Make sure count never exceeds 65k, and make sure it's unsigned */
@@ -2418,13 +3491,14 @@ static ssize_t dahdi_chan_read(struct file *file, char __user *usrbuf,
 
 	for (;;) {
 		spin_lock_irqsave(&chan->lock, flags);
-		if (chan->eventinidx != chan->eventoutidx) {
+		if (__inband_event_pending(chan)) {
 			spin_unlock_irqrestore(&chan->lock, flags);
 			return -ELAST /* - chan->eventbuf[chan->eventoutidx]*/;
 		}
 		res = chan->outreadbuf;
+		ready = dahdi_chan_readable(chan);
 		spin_unlock_irqrestore(&chan->lock, flags);
-		if (res >= 0)
+		if (ready)
 			break;
 		if (file->f_flags & O_NONBLOCK)
 			return -EAGAIN;
@@ -2432,12 +3506,20 @@ static ssize_t dahdi_chan_read(struct file *file, char __user *usrbuf,
 		/* Wake up when data is available or when the board driver
 		 * unregistered the channel. */
 		rv = wait_event_interruptible(chan->waitq,
-			(!chan->file->private_data || chan->outreadbuf > -1));
+			(!chan->file->private_data ||
+			 dahdi_chan_readable(chan)));
 		if (rv)
 			return rv;
 		if (unlikely(!chan->file->private_data))
 			return -ENODEV;
 	}
+	if (!dahdi_chan_framed(chan)) {
+		dahdi_ring_enter(chan, &chan->rxring);
+		rv = dahdi_chan_read_ring(chan, usrbuf, count);
+		dahdi_ring_leave(chan, &chan->rxring);
+		return rv;
+	}
+
 	amnt = count;
 	if (chan->flags & DAHDI_FLAG_LINEAR) {
 		if (amnt > (chan->readn[res] << 1))
@@ -2487,6 +3569,18 @@ static ssize_t dahdi_chan_read(struct file *file, char __user *usrbuf,
 	return amnt;
 }
 
+static int num_filled_readbufs(struct dahdi_chan *chan)
+{
+	if (chan->inreadbuf < 0)
+		return chan->numbufs;
+
+	if (chan->outreadbuf < 0)
+		return 0;
+
+	return (chan->inreadbuf - chan->outreadbuf + chan->numbufs) %
+		chan->numbufs;
+}
+
 static int num_filled_bufs(struct dahdi_chan *chan)
 {
 	int range1, range2;
@@ -2510,12 +3604,92 @@ static int num_filled_bufs(struct dahdi_chan *chan)
 	return range1 + range2;
 }
 
+/**
+ * dahdi_chan_write_ring() - Queue up to a block of stream data to transmit.
+ *
+ * The caller has already made sure there is room for a whole block.
+ */
+static ssize_t dahdi_chan_write_ring(struct dahdi_chan *chan,
+				     const char __user *usrbuf, size_t count)
+{
+	struct dahdi_ring *const ring = &chan->txring;
+	const unsigned int head = ring->head;
+	unsigned long flags;
+	unsigned int amnt;
+	unsigned int used;
+	unsigned int pos;
+	unsigned int pass;
+	int x;
+
+	amnt = ring->depth - dahdi_ring_used(ring);
+	/* Do not overwrite anything before the transmitter is done with it */
+	smp_mb();
+	if (amnt > chan->blocksize)
+		amnt = chan->blocksize;
+
+	if (chan->flags & DAHDI_FLAG_LINEAR) {
+		if (amnt > (count >> 1))
+			amnt = count >> 1;
+		for (pos = 0; pos < amnt; pos += pass) {
+			/* There seems to be a max stack size, so we have
+			   to do this in smaller pieces */
+			short lindata[128];
+
+			pass = min_t(unsigned int, amnt - pos,
+				     ARRAY_SIZE(lindata));
+			if (copy_from_user(lindata, usrbuf + (pos << 1),
+					   pass << 1))
+				return -EFAULT;
+			for (x = 0; x < pass; x++) {
+				ring->buf[(head + pos + x) & ring->mask] =
+					DAHDI_LIN2X(lindata[x], chan);
+			}
+		}
+	} else {
+		if (amnt > count)
+			amnt = count;
+		if (dahdi_ring_from_user(ring, usrbuf, amnt))
+			return -EFAULT;
+	}
+
+#ifdef CONFIG_DAHDI_ECHOCAN_PROCESS_TX
+	if ((chan->ec_state) &&
+	    (ECHO_MODE_ACTIVE == chan->ec_state->status.mode) &&
+	    (chan->ec_state->ops->echocan_process_tx)) {
+		struct dahdi_echocan_state *const ec = chan->ec_state;
+		for (x = 0; x < amnt; ++x) {
+			u_char *const c = &ring->buf[(head + x) & ring->mask];
+			short tx;
+			tx = DAHDI_XLAW(*c, chan);
+			ec->ops->echocan_process_tx(ec, &tx, 1);
+			*c = DAHDI_LIN2X((int) tx, chan);
+		}
+	}
+#endif
+	dahdi_ring_produce(ring, amnt);
+
+	if (chan->txdisable) {
+		used = dahdi_ring_used(ring);
+		spin_lock_irqsave(&chan->lock, flags);
+		/* Start transmitting once full, or half full if that is the
+		 * policy. */
+		if ((ring->depth - used < chan->blocksize) ||
+		    ((chan->txbufpolicy == DAHDI_POLICY_HALF_FULL) &&
+		     (used >= (ring->depth >> 1))))
+			chan->txdisable = 0;
+		spin_unlock_irqrestore(&chan->lock, flags);
+	}
+
+	return (chan->flags & DAHDI_FLAG_LINEAR) ? amnt << 1 : amnt;
+}
+
 static ssize_t dahdi_chan_write(struct file *file, const char __user *usrbuf,
 				size_t count, loff_t *ppos)
 {
 	unsigned long flags;
 	struct dahdi_chan *chan = file->private_data;
 	int res, amnt, oldbuf, rv, x;
+	bool ready;
 
 	/* Make sure count never exceeds 65k, and make sure it's unsigned */
 	count &= 0xffff;
@@ -2545,13 +3719,14 @@ static ssize_t dahdi_chan_write(struct file *file, const char __user *usrbuf,
 			chan->txdialbuf[0] = '\0';
 			chan->pdialcount = 0;
 		}
-		if (chan->eventinidx != chan->eventoutidx) {
+		if (__inband_event_pending(chan)) {
 			spin_unlock_irqrestore(&chan->lock, flags);
 			return -ELAST;
 		}
 		res = chan->inwritebuf;
+		ready = dahdi_chan_writable(chan);
 		spin_unlock_irqrestore(&chan->lock, flags);
-		if (res >= 0)
+		if (ready)
 			break;
 		if (file->f_flags & O_NONBLOCK) {
 #ifdef BUFFER_DEBUG
@@ -2563,12 +3738,19 @@ static ssize_t dahdi_chan_write(struct file *file, const char __user *usrbuf,
 		/* Wake up when room in the write queue is available or when
 		 * the board driver unregistered the channel. */
 		rv = wait_event_interruptible(chan->waitq,
-			(!chan->file->private_data || chan->inwritebuf > -1));
+			(!chan->file->private_data ||
+			 dahdi_chan_writable(chan)));
 		if (rv)
 			return rv;
 		if (unlikely(!chan->file->private_data))
 			return -ENODEV;
 	}
+	if (!dahdi_chan_framed(chan)) {
+		dahdi_ring_enter(chan, &chan->txring);
+		rv = dahdi_chan_write_ring(chan, usrbuf, count);
+		dahdi_ring_leave(chan, &chan->txring);
+		return rv;
+	}
 
 	amnt = count;
 	if (chan->flags & DAHDI_FLAG_LINEAR) {
@@ -2708,6 +3890,28 @@ static void set_txtone(struct dahdi_chan *ss, int fac, int init_v2, int init_v3)
 	return;
 }
 
+/*
+ * The hook state timers (itimer, ringdebtimer, ringtrailer and pulsetimer on
+ * the receive side, otimer on the transmit side) are idle on nearly every
+ * channel nearly all of the time.  Rather than look at each of them on every
+ * tick, the span keeps a bitmap of the channels that may have one running.
+ * Anything that starts a timer marks the channel, and the tick clears the
+ * mark again once the channel's timers have all run down.
+ *
+ * Called with chan->lock held.
+ */
+static inline void __arm_rx_timers(struct dahdi_chan *chan)
+{
+	if (chan->span)
+		set_bit(chan->chanpos - 1, chan->span->rxtimers);
+}
+
+static inline void __arm_tx_timer(struct dahdi_chan *chan)
+{
+	if (chan->span)
+		set_bit(chan->chanpos - 1, chan->span->txtimers);
+}
+
 static void dahdi_rbs_sethook(struct dahdi_chan *chan, int txsig, int txstate,
 		int timeout)
 {
@@ -2795,6 +3999,7 @@ static void dahdi_rbs_sethook(struct dahdi_chan *chan, int txsig, int txstate,
 	if (chan->sig == DAHDI_SIG_DACS_RBS)
 		return;
 	chan->txstate = txstate;
+	__arm_tx_timer(chan);
 
 	/* if tone signalling */
 	if (chan->sig == DAHDI_SIG_SF) {
@@ -2851,7 +4056,7 @@ static int dahdi_cas_setbits(struct dahdi_chan *chan, int bits)
 
 static int dahdi_hangup(struct dahdi_chan *chan)
 {
-	int x, res = 0;
+	int res = 0;
 
 	/* Can't hangup pseudo channels */
 	if (!chan->span)
@@ -2866,6 +4071,7 @@ static int dahdi_hangup(struct dahdi_chan *chan)
 	if ((chan->sig == DAHDI_SIG_FXSLS) || (chan->sig == DAHDI_SIG_FXSKS) ||
 			(chan->sig == DAHDI_SIG_FXSGS)) {
 		chan->ringdebtimer = RING_DEBOUNCE_TIME;
+		__arm_rx_timers(chan);
 	}
 
 	if (chan->span->flags & DAHDI_FLAG_RBS) {
@@ -2893,23 +4099,7 @@ static int dahdi_hangup(struct dahdi_chan *chan)
 	if (!test_bit(DAHDI_FLAGBIT_REGISTERED, &chan->flags))
 		return res;
 
-	/* Mark all buffers as empty */
-	for (x = 0; x < chan->numbufs; x++) {
-		chan->writen[x] =
-		chan->writeidx[x]=
-		chan->readn[x]=
-		chan->readidx[x] = 0;
-	}
-
-	if (chan->readbuf[0]) {
-		chan->inreadbuf = 0;
-		chan->inwritebuf = 0;
-	} else {
-		chan->inreadbuf = -1;
-		chan->inwritebuf = -1;
-	}
-	chan->outreadbuf = -1;
-	chan->outwritebuf = -1;
+	__dahdi_reset_bufs(chan);
 	chan->dialing = 0;
 	chan->afterdialingtimer = 0;
 	chan->curtone = NULL;
@@ -2952,7 +4142,6 @@ static int initialize_channel(struct dahdi_chan *chan)
 	/* HDLC & FCS stuff */
 	fasthdlc_init(&chan->rxhdlc, (chan->flags & DAHDI_FLAG_HDLC56) ? FASTHDLC_MODE_56 : FASTHDLC_MODE_64);
 	fasthdlc_init(&chan->txhdlc, (chan->flags & DAHDI_FLAG_HDLC56) ? FASTHDLC_MODE_56 : FASTHDLC_MODE_64);
-	chan->infcs = PPP_INITFCS;
 
 	/* Timings for RBS */
 	chan->prewinktime = DAHDI_DEFAULT_PREWINKTIME;
@@ -3004,7 +4193,7 @@ static int initialize_channel(struct dahdi_chan *chan)
 		rxgain = chan->rxgain;
 	chan->rxgain = defgain;
 	chan->txgain = defgain;
-	chan->eventinidx = chan->eventoutidx = 0;
+	__reset_events(chan);
 	dahdi_set_law(chan, DAHDI_LAW_DEFAULT);
 	dahdi_hangup(chan);
 
@@ -3026,13 +4215,10 @@ static int initialize_channel(struct dahdi_chan *chan)
 		chan->ringcadence[1] = DAHDI_RINGOFFTIME;
 	}
 
-	if (ec_state) {
-		ec_state->ops->echocan_free(chan, ec_state);
-		release_echocan(ec_current);
-	}
-
 	spin_unlock_irqrestore(&chan->lock, flags);
 
+	free_echocan(chan, ec_state, ec_current);
+
 	set_tone_zone(chan, DEFAULT_TONE_ZONE);
 
 	if (rxgain)
@@ -3140,6 +4326,7 @@ static int dahdi_specchan_open(struct file *file)
 					  &chan->flags);
 			}
 		}
+		mark_chan_active(chan);
 	} else {
 		res = -EBUSY;
 	}
@@ -4222,6 +5409,9 @@ static int dahdi_ioctl_chandiag(struct file *file, unsigned long data)
 		      temp->span, temp->sig, temp->sigcap);
 	module_printk(KERN_INFO, "inreadbuf: %d, outreadbuf: %d, inwritebuf: %d, outwritebuf: %d\n",
 		      temp->inreadbuf, temp->outreadbuf, temp->inwritebuf, temp->outwritebuf);
+	module_printk(KERN_INFO, "rxring: %u/%u, txring: %u/%u\n",
+		      dahdi_ring_used(&temp->rxring), temp->rxring.depth,
+		      dahdi_ring_used(&temp->txring), temp->txring.depth);
 	module_printk(KERN_INFO, "blocksize: %d, numbufs: %d, txbufpolicy: %d, txbufpolicy: %d\n",
 		      temp->blocksize, temp->numbufs, temp->txbufpolicy,
 		      DAHDI_POLICY_IMMEDIATE);
@@ -4783,46 +5973,48 @@ static const struct net_device_ops dahdi_netdev_ops = {
 };
 #endif
 
-static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
+static int dahdi_chanconfig(struct file *file, struct dahdi_chanconfig *ch)
 {
 	int res = 0;
 	int y;
-	struct dahdi_chanconfig ch;
 	struct dahdi_chan *newmaster;
 	struct dahdi_chan *chan;
 	struct dahdi_chan *dacs_chan = NULL;
 	unsigned long flags;
 	int sigcap;
 
-	if (copy_from_user(&ch, (void __user *)data, sizeof(ch)))
-		return -EFAULT;
-
-	chan = chan_from_num(ch.chan);
+	chan = chan_from_num(ch->chan);
 	if (!chan) {
 		printk(KERN_NOTICE "%s: No channel for number %d\n",
-				__func__, ch.chan);
+				__func__, ch->chan);
 		return -EINVAL;
 	}
 
-	if (ch.sigtype == DAHDI_SIG_SLAVE) {
-		newmaster = chan_from_num(ch.master);
+	if (ch->sigtype == DAHDI_SIG_SLAVE) {
+		newmaster = chan_from_num(ch->master);
 		if (!newmaster) {
 			chan_notice(chan, "%s: slave channel without master.\n",
 					__func__);
 			return -EINVAL;
 		}
-		ch.sigtype = newmaster->sig;
-	} else if ((ch.sigtype & __DAHDI_SIG_DACS) == __DAHDI_SIG_DACS) {
+		ch->sigtype = newmaster->sig;
+	} else if ((ch->sigtype & __DAHDI_SIG_DACS) == __DAHDI_SIG_DACS) {
 		newmaster = chan;
-		dacs_chan = chan_from_num(ch.idlebits);
+		dacs_chan = chan_from_num(ch->idlebits);
 		if (!dacs_chan) {
 			chan_notice(chan, "%s: dacs channel not found: %d.\n",
-					__func__, ch.idlebits);
+					__func__, ch->idlebits);
 			return -EINVAL;
 		}
 	} else {
 		newmaster = chan;
 	}
+	if (((ch->sigtype & DAHDI_SIG_HDLCRAW) == DAHDI_SIG_HDLCRAW) ||
+	    ((ch->sigtype & DAHDI_SIG_HARDHDLC) == DAHDI_SIG_HARDHDLC)) {
+		res = dahdi_chan_hdlc_counters_alloc(chan);
+		if (res)
+			return res;
+	}
 	spin_lock_irqsave(&chan->lock, flags);
 #ifdef CONFIG_DAHDI_NET
 	if (dahdi_have_netdev(chan)) {
@@ -4840,7 +6032,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 		clear_bit(DAHDI_FLAGBIT_NETDEV, &chan->flags);
 	}
 #else
-	if (ch.sigtype == DAHDI_SIG_HDLCNET) {
+	if (ch->sigtype == DAHDI_SIG_HDLCNET) {
 		spin_unlock_irqrestore(&chan->lock, flags);
 		module_printk(KERN_WARNING, "DAHDI networking not supported by this build.\n");
 		return -ENOSYS;
@@ -4852,10 +6044,10 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 	if (sigcap & DAHDI_SIG_CLEAR)
 		sigcap |= (DAHDI_SIG_HDLCRAW | DAHDI_SIG_HDLCFCS | DAHDI_SIG_HDLCNET | DAHDI_SIG_DACS);
 
-	if ((sigcap & ch.sigtype) != ch.sigtype) {
+	if ((sigcap & ch->sigtype) != ch->sigtype) {
 		if (debug) {
 			chan_notice(chan, "%s: bad sigtype. sigcap: %x, sigtype: %x.\n",
-					__func__, sigcap, ch.sigtype);
+					__func__, sigcap, ch->sigtype);
 		}
 		res = -EINVAL;
 	}
@@ -4871,12 +6063,12 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 	}
 
 	if (!res) {
-		chan->sig = ch.sigtype;
+		chan->sig = ch->sigtype;
 		if (chan->sig == DAHDI_SIG_CAS)
-			chan->idlebits = ch.idlebits;
+			chan->idlebits = ch->idlebits;
 		else
 			chan->idlebits = 0;
-		if ((ch.sigtype & DAHDI_SIG_CLEAR) == DAHDI_SIG_CLEAR) {
+		if ((ch->sigtype & DAHDI_SIG_CLEAR) == DAHDI_SIG_CLEAR) {
 			/* Set clear channel flag if appropriate */
 			chan->flags &= ~DAHDI_FLAG_AUDIO;
 			chan->flags |= DAHDI_FLAG_CLEAR;
@@ -4885,21 +6077,21 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 			chan->flags |= DAHDI_FLAG_AUDIO;
 			chan->flags &= ~DAHDI_FLAG_CLEAR;
 		}
-		if ((ch.sigtype & DAHDI_SIG_HDLCRAW) == DAHDI_SIG_HDLCRAW) {
+		if ((ch->sigtype & DAHDI_SIG_HDLCRAW) == DAHDI_SIG_HDLCRAW) {
 			/* Set the HDLC flag */
 			chan->flags |= DAHDI_FLAG_HDLC;
 		} else {
 			/* Clear the HDLC flag */
 			chan->flags &= ~DAHDI_FLAG_HDLC;
 		}
-		if ((ch.sigtype & DAHDI_SIG_HDLCFCS) == DAHDI_SIG_HDLCFCS) {
+		if ((ch->sigtype & DAHDI_SIG_HDLCFCS) == DAHDI_SIG_HDLCFCS) {
 			/* Set FCS to be calculated if appropriate */
 			chan->flags |= DAHDI_FLAG_FCS;
 		} else {
 			/* Clear FCS flag */
 			chan->flags &= ~DAHDI_FLAG_FCS;
 		}
-		if ((ch.sigtype & __DAHDI_SIG_DACS) == __DAHDI_SIG_DACS) {
+		if ((ch->sigtype & __DAHDI_SIG_DACS) == __DAHDI_SIG_DACS) {
 			if (unlikely(!dacs_chan)) {
 				spin_unlock_irqrestore(&chan->lock, flags);
 				chan_notice(chan, "%s: dacs but no dacs_chan\n",
@@ -4908,7 +6100,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 			}
 			/* Setup conference properly */
 			chan->confmode = DAHDI_CONF_DIGITALMON;
-			chan->confna = ch.idlebits;
+			chan->confna = ch->idlebits;
 			chan->dacs_chan = dacs_chan;
 			res = dahdi_chan_dacs(chan, dacs_chan);
 		} else {
@@ -4919,7 +6111,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 		if (newmaster != chan) {
 			recalc_slaves(chan->master);
 		}
-		if ((ch.sigtype & DAHDI_SIG_HARDHDLC) == DAHDI_SIG_HARDHDLC) {
+		if ((ch->sigtype & DAHDI_SIG_HARDHDLC) == DAHDI_SIG_HARDHDLC) {
 			chan->flags &= ~DAHDI_FLAG_FCS;
 			chan->flags &= ~DAHDI_FLAG_HDLC;
 			chan->flags |= DAHDI_FLAG_NOSTDTXRX;
@@ -4927,9 +6119,11 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 			chan->flags &= ~DAHDI_FLAG_NOSTDTXRX;
 		}
 
-		if ((ch.sigtype & DAHDI_SIG_MTP2) == DAHDI_SIG_MTP2)
+		if ((ch->sigtype & DAHDI_SIG_MTP2) == DAHDI_SIG_MTP2) {
 			chan->flags |= DAHDI_FLAG_MTP2;
-		else
+			/* MTP2 repeats the last frame written instead */
+			memset(&chan->txrepeat, 0, sizeof(chan->txrepeat));
+		} else
 			chan->flags &= ~DAHDI_FLAG_MTP2;
 	}
 
@@ -4937,7 +6131,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 	 * the channel lock held. */
 	spin_unlock_irqrestore(&chan->lock, flags);
 	if (!res && chan->span->ops->chanconfig)
-		res = chan->span->ops->chanconfig(file, chan, ch.sigtype);
+		res = chan->span->ops->chanconfig(file, chan, ch->sigtype);
 	spin_lock_irqsave(&chan->lock, flags);
 
 
@@ -4954,6 +6148,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 			if (chan->hdlcnetdev->netdev) {
 				chan->hdlcnetdev->chan = chan;
 				chan->hdlcnetdev->netdev->tx_queue_len = 50;
+				dahdi_net_napi_add(chan->hdlcnetdev);
 #ifdef HAVE_NET_DEVICE_OPS
 				chan->hdlcnetdev->netdev->netdev_ops = &dahdi_netdev_ops;
 #else
@@ -4965,7 +6160,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 				dev_to_hdlc(chan->hdlcnetdev->netdev)->xmit = dahdi_xmit;
 				spin_unlock_irqrestore(&chan->lock, flags);
 				/* Briefly restore interrupts while we register the device */
-				res = dahdi_register_hdlc_device(chan->hdlcnetdev->netdev, ch.netdev_name);
+				res = dahdi_register_hdlc_device(chan->hdlcnetdev->netdev, ch->netdev_name);
 				spin_lock_irqsave(&chan->lock, flags);
 			} else {
 				module_printk(KERN_NOTICE, "Unable to allocate hdlc: *shrug*\n");
@@ -4985,12 +6180,7 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 		module_printk(KERN_NOTICE, "Unable to register HDLC device for channel %s\n", chan->name);
 	if (!res) {
 		/* Setup default law */
-		chan->deflaw = ch.deflaw;
-		/* Copy back any modified settings */
-		spin_unlock_irqrestore(&chan->lock, flags);
-		if (copy_to_user((void __user *)data, &ch, sizeof(ch)))
-			return -EFAULT;
-		spin_lock_irqsave(&chan->lock, flags);
+		chan->deflaw = ch->deflaw;
 		/* And hangup */
 		dahdi_hangup(chan);
 		y = dahdi_q_sig(chan) & 0xff;
@@ -5002,7 +6192,80 @@ static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
 	module_printk(KERN_NOTICE, "Configured channel %s, flags %04lx, sig %04x\n", chan->name, chan->flags, chan->sig);
 #endif
 	spin_unlock_irqrestore(&chan->lock, flags);
+	dahdi_update_tsi(chan->span);
+	mark_chan_active(chan);
+	/* A master now distributes audio to its slaves */
+	mark_chan_active(newmaster);
+
+	return res;
+}
+
+static int dahdi_ioctl_chanconfig(struct file *file, unsigned long data)
+{
+	int res;
+	struct dahdi_chanconfig ch;
+
+	if (copy_from_user(&ch, (void __user *)data, sizeof(ch)))
+		return -EFAULT;
+	res = dahdi_chanconfig(file, &ch);
+	/* Copy back any modified settings */
+	if (!res && copy_to_user((void __user *)data, &ch, sizeof(ch)))
+		return -EFAULT;
+	return res;
+}
+
+/**
+ * dahdi_ioctl_span_dacs() - Cross connect all the channels of two spans.
+ * @data:	Pointer to user space that contains dahdi_span_dacs.
+ *
+ * Each channel is configured as with DAHDI_CHANCONFIG so hardware cross
+ * connects are still used where the spans support them.
+ */
+static int dahdi_ioctl_span_dacs(struct file *file, unsigned long data)
+{
+	int res = 0;
+	int x;
+	struct dahdi_span_dacs sd;
+	struct dahdi_chanconfig ch;
+	struct dahdi_span *dst;
+	struct dahdi_span *src = NULL;
+
+	if (copy_from_user(&sd, (void __user *)data, sizeof(sd)))
+		return -EFAULT;
+
+	dst = span_find_and_get(sd.dstspan);
+	if (!dst)
+		return -EINVAL;
+	if (sd.srcspan) {
+		src = span_find_and_get(sd.srcspan);
+		if (!src) {
+			put_span(dst);
+			return -EINVAL;
+		}
+	}
 
+	for (x = 0; !res && (x < dst->channels); x++) {
+		struct dahdi_chan *const chan = dst->chans[x];
+
+		if (src && (x >= src->channels))
+			break;
+		if (!src && !is_chan_dacsed(chan))
+			continue;
+
+		memset(&ch, 0, sizeof(ch));
+		ch.chan = chan->channo;
+		ch.deflaw = chan->deflaw;
+		if (src) {
+			ch.sigtype = (sd.rbs) ? DAHDI_SIG_DACS_RBS :
+						DAHDI_SIG_DACS;
+			ch.idlebits = src->chans[x]->channo;
+		}
+		res = dahdi_chanconfig(file, &ch);
+	}
+
+	if (src)
+		put_span(src);
+	put_span(dst);
 	return res;
 }
 
@@ -5332,6 +6595,7 @@ static int dahdi_ioctl_sfconfig(unsigned long data)
 		}
 	}
 	spin_unlock_irqrestore(&chan->lock, flags);
+	mark_chan_active(chan);
 	return res;
 }
 
@@ -5542,6 +6806,8 @@ dahdi_ctl_ioctl(struct file *file, unsigned int cmd, unsigned long data)
 		return dahdi_ioctl_attach_echocan(data);
 	case DAHDI_CHANCONFIG:
 		return dahdi_ioctl_chanconfig(file, data);
+	case DAHDI_SPAN_DACS:
+		return dahdi_ioctl_span_dacs(file, data);
 	case DAHDI_SFCONFIG:
 		return dahdi_ioctl_sfconfig(data);
 	case DAHDI_DEFAULTZONE:
@@ -5640,6 +6906,7 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 	struct dahdi_confinfo conf;
 	struct dahdi_chan *chan;
 	struct dahdi_chan *conf_chan = NULL;
+	struct dahdi_chan *old_conf_chan;
 	unsigned long flags;
 	unsigned int confmode;
 	int oldconf;
@@ -5694,6 +6961,7 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 		memset(chan->conflast2, 0, sizeof(chan->conflast2));
 	}
 	oldconf = chan->confna;  /* save old conference number */
+	old_conf_chan = (chan->confmode) ? chan->conf_chan : NULL;
 	chan->confna = conf.confno;   /* set conference number */
 	chan->conf_chan = conf_chan;
 	chan->confmode = conf.confmode;  /* set conference mode */
@@ -5749,6 +7017,15 @@ static int dahdi_ioctl_setconf(struct file *file, unsigned long data)
 
 	spin_unlock_irqrestore(&chan_lock, flags);
 
+	mark_chan_active(chan);
+	if (conf_chan) {
+		/* Keep the monitored channel's getlin / putlin up to date */
+		set_bit(DAHDI_FLAGBIT_MONITORED, &conf_chan->flags);
+		mark_chan_active(conf_chan);
+	}
+	if (old_conf_chan && (old_conf_chan != conf_chan))
+		dahdi_check_monitored(old_conf_chan);
+
 	if (ENABLE_HWPREEC == preec) {
 		int res = dahdi_enable_hw_preechocan(conf_chan);
 		if (res) {
@@ -5917,18 +7194,18 @@ static int dahdi_ioctl_iomux(struct file *file, unsigned long data)
 		spin_lock_irqsave(&chan->lock, flags);
 		chan->iomask = iomask;
 		if (iomask & DAHDI_IOMUX_READ) {
-			if (chan->outreadbuf > -1)
+			if (dahdi_chan_readable(chan))
 				wait_result |= DAHDI_IOMUX_READ;
 		}
 		if (iomask & DAHDI_IOMUX_WRITE) {
-			if (chan->inwritebuf > -1)
+			if (dahdi_chan_writable(chan))
 				wait_result |= DAHDI_IOMUX_WRITE;
 		}
 		if (iomask & DAHDI_IOMUX_WRITEEMPTY) {
 			/* if everything empty -- be sure the transmitter is
 			 * enabled */
 			chan->txdisable = 0;
-			if (chan->outwritebuf < 0)
+			if (!dahdi_chan_txpending(chan))
 				wait_result |= DAHDI_IOMUX_WRITEEMPTY;
 		}
 		if (iomask & DAHDI_IOMUX_SIGEVENT) {
@@ -5985,6 +7262,7 @@ static int dahdi_ioctl_rxmirror(struct file *file, unsigned long data)
 		srcmirror->rxmirror = chan;
 
 	spin_unlock_irqrestore(&srcmirror->lock, flags);
+	mark_chan_active(srcmirror);
 	if (srcmirror->rxmirror != chan) {
 		module_printk(KERN_INFO, "Chan %d cannot be rxmirrored, " \
 			      "already in use\n", srcmirror->channo);
@@ -6028,6 +7306,7 @@ static int dahdi_ioctl_txmirror(struct file *file, unsigned long data)
 	if (srcmirror->txmirror == NULL)
 		srcmirror->txmirror = chan;
 	spin_unlock_irqrestore(&srcmirror->lock, flags);
+	mark_chan_active(srcmirror);
 
 	if (srcmirror->txmirror != chan) {
 		module_printk(KERN_INFO, "Chan %d cannot be txmirrored, " \
@@ -6046,6 +7325,41 @@ static int dahdi_ioctl_txmirror(struct file *file, unsigned long data)
 }
 #endif /* CONFIG_DAHDI_MIRROR */
 
+/**
+ * dahdi_ioctl_getevents() - Drain all pending events in one call.
+ *
+ * Each event is returned along with the tick it was queued on, which lets
+ * applications order events against the audio they have already read.
+ */
+static int dahdi_ioctl_getevents(struct dahdi_chan *chan, unsigned long data)
+{
+	struct dahdi_event_list *list;
+	unsigned long flags;
+	int res = 0;
+
+	list = kzalloc(sizeof(*list), GFP_KERNEL);
+	if (!list)
+		return -ENOMEM;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	while (chan->eventinidx != chan->eventoutidx) {
+		struct dahdi_event *const ev = &list->events[list->count++];
+
+		ev->event = chan->eventbuf[chan->eventoutidx];
+		ev->tick = chan->eventticks[chan->eventoutidx];
+		if (++chan->eventoutidx >= DAHDI_MAX_EVENTSIZE)
+			chan->eventoutidx = 0;
+	}
+	list->overflows = chan->eventoverflows;
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	if (copy_to_user((void __user *)data, list, sizeof(*list)))
+		res = -EFAULT;
+
+	kfree(list);
+	return res;
+}
+
 static int
 dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 			  unsigned long data)
@@ -6083,11 +7397,22 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 		memset(&stack.bi, 0, sizeof(stack.bi));
 		stack.bi.rxbufpolicy = DAHDI_POLICY_IMMEDIATE;
 		stack.bi.txbufpolicy = chan->txbufpolicy;
-		stack.bi.numbufs = chan->numbufs;
+		spin_lock_irqsave(&chan->lock, flags);
+		stack.bi.numbufs = dahdi_chan_numbufs(chan);
 		stack.bi.bufsize = chan->blocksize;
-		/* XXX FIXME! XXX */
-		stack.bi.readbufs = -1;
-		stack.bi.writebufs = -1;
+		if (dahdi_chan_framed(chan)) {
+			stack.bi.readbufs = num_filled_readbufs(chan);
+			stack.bi.writebufs = num_filled_bufs(chan);
+		} else if (chan->blocksize) {
+			/* Only whole blocks can be read, but any queued
+			 * byte still has to be transmitted. */
+			stack.bi.readbufs = dahdi_ring_used(&chan->rxring) /
+					    chan->blocksize;
+			stack.bi.writebufs =
+				DIV_ROUND_UP(dahdi_ring_used(&chan->txring),
+					     chan->blocksize);
+		}
+		spin_unlock_irqrestore(&chan->lock, flags);
 		if (copy_to_user(user_data, &stack.bi, sizeof(stack.bi)))
 			return -EFAULT;
 		break;
@@ -6098,7 +7423,8 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 			return -EINVAL;
 		if (stack.bi.bufsize < 16)
 			return -EINVAL;
-		if (stack.bi.bufsize * stack.bi.numbufs > DAHDI_MAX_BUF_SPACE)
+		if (stack.bi.numbufs < 0 ||
+		    stack.bi.numbufs > DAHDI_MAX_BUF_SPACE / stack.bi.bufsize)
 			return -EINVAL;
 		/* It does not make sense to allow user mode to change the
 		 * receive buffering policy.  DAHDI always provides received
@@ -6122,7 +7448,7 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 		if (j < 16) return(-EINVAL);
 		/* allocate a single kernel buffer which we then
 		sub divide into four pieces */
-		if ((rv = dahdi_reallocbufs(chan, j, chan->numbufs)))
+		if ((rv = dahdi_reallocbufs(chan, j, dahdi_chan_numbufs(chan))))
 			return (rv);
 		break;
 	case DAHDI_FLUSH:  /* flush input buffer, output buffer, and/or event queue */
@@ -6138,6 +7464,7 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 				chan->readn[j] = 0;
 				chan->readidx[j] = 0;
 			}
+			__dahdi_ring_reset(&chan->rxring);
 			wake_up_interruptible(&chan->waitq);  /* wake_up_interruptible waiting on read */
 		   }
 		if (i & DAHDI_FLUSH_WRITE) /* if for write (output) */
@@ -6150,12 +7477,13 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 				chan->writen[j] = 0;
 				chan->writeidx[j] = 0;
 			}
+			__dahdi_ring_reset(&chan->txring);
 			wake_up_interruptible(&chan->waitq); /* wake_up_interruptible waiting on write */
 		   }
 		if (i & DAHDI_FLUSH_EVENT) /* if for events */
 		   {
 			   /* initialize the event pointers */
-			chan->eventinidx = chan->eventoutidx = 0;
+			__reset_events(chan);
 		   }
 		spin_unlock_irqrestore(&chan->lock, flags);
 		break;
@@ -6164,12 +7492,12 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 		   {
 			spin_lock_irqsave(&chan->lock, flags);
 			  /* Know if there is a write pending */
-			i = (chan->outwritebuf > -1);
+			i = dahdi_chan_txpending(chan);
 			spin_unlock_irqrestore(&chan->lock, flags);
 			if (!i)
 				break; /* skip if none */
 			rv = wait_event_interruptible(chan->waitq,
-						      (!chan->file->private_data || chan->outwritebuf > -1));
+						      (!chan->file->private_data || dahdi_chan_txpending(chan)));
 			if (rv)
 				return rv;
 			if (unlikely(!chan->file->private_data))
@@ -6195,6 +7523,27 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 		spin_unlock_irqrestore(&chan->lock, flags);
 		put_user(j, (int __user *)data);
 		break;
+	case DAHDI_GETEVENTS:
+		return dahdi_ioctl_getevents(chan, data);
+	case DAHDI_OOB_EVENTS:
+		if (get_user(j, (int __user *)data))
+			return -EFAULT;
+		if (j)
+			set_bit(DAHDI_FLAGBIT_OOBEVENTS, &chan->flags);
+		else
+			clear_bit(DAHDI_FLAGBIT_OOBEVENTS, &chan->flags);
+		break;
+	case DAHDI_MTP2_RXFILTER:
+		if (get_user(j, (int __user *)data))
+			return -EFAULT;
+		spin_lock_irqsave(&chan->lock, flags);
+		chan->mtp2_rxlen = 0;
+		if (j)
+			set_bit(DAHDI_FLAGBIT_MTP2RX, &chan->flags);
+		else
+			clear_bit(DAHDI_FLAGBIT_MTP2RX, &chan->flags);
+		spin_unlock_irqrestore(&chan->lock, flags);
+		break;
 	case DAHDI_CONFMUTE:  /* set confmute flag */
 		get_user(j, (int __user *)data);  /* get conf # */
 		if (!(chan->flags & DAHDI_FLAG_AUDIO)) return (-EINVAL);
@@ -6308,6 +7657,44 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
 }
 
 #ifdef CONFIG_DAHDI_PPP
+/* Calls into ppp_generic pending in dahdi_chan.ppp_events */
+enum {
+	DAHDI_PPP_WAKEUP = 0,
+	DAHDI_PPP_ERROR = 1,
+};
+
+/* Received frames waiting for the batch tasklet before they are dropped */
+#define DAHDI_PPP_RXQ_LEN	64
+
+/* Pseudo channels are not on a span, so they share this batch. */
+static struct dahdi_ppp_batch pseudo_ppp_batch;
+
+static inline struct dahdi_ppp_batch *chan_ppp_batch(struct dahdi_chan *chan)
+{
+	return (chan->span) ? &chan->span->ppp : &pseudo_ppp_batch;
+}
+
+/*
+ * Called from the tick with chan->lock held.  The batch tasklet is only
+ * scheduled once the whole span has been processed, see
+ * dahdi_ppp_batch_kick().
+ */
+static void __dahdi_ppp_pend(struct dahdi_chan *chan)
+{
+	struct dahdi_ppp_batch *const batch = chan_ppp_batch(chan);
+
+	spin_lock(&batch->lock);
+	if (list_empty(&chan->ppp_node))
+		list_add_tail(&chan->ppp_node, &batch->pending);
+	spin_unlock(&batch->lock);
+}
+
+static inline void dahdi_ppp_batch_kick(struct dahdi_ppp_batch *batch)
+{
+	if (!list_empty(&batch->pending))
+		tasklet_schedule(&batch->tasklet);
+}
+
 /*
  * This is called at softirq (BH) level when there are calls
  * we need to make to the ppp_generic layer.  We do it this
@@ -6316,21 +7703,98 @@ dahdi_chanandpseudo_ioctl(struct file *file, unsigned int cmd,
  */
 static void do_ppp_calls(unsigned long data)
 {
-	struct dahdi_chan *chan = (struct dahdi_chan *) data;
+	struct dahdi_ppp_batch *const batch = (struct dahdi_ppp_batch *)data;
+	struct dahdi_chan *chan;
+	struct ppp_channel *ppp;
 	struct sk_buff *skb;
+	unsigned long events;
 
-	if (!chan->ppp)
-		return;
-	if (chan->do_ppp_wakeup) {
-		chan->do_ppp_wakeup = 0;
-		ppp_output_wakeup(chan->ppp);
+	spin_lock_irq(&batch->lock);
+	while (!list_empty(&batch->pending)) {
+		chan = list_first_entry(&batch->pending, struct dahdi_chan,
+					ppp_node);
+		list_del_init(&chan->ppp_node);
+		spin_unlock_irq(&batch->lock);
+
+		/* dahdi_ppp_detach() waits for us before freeing this. */
+		ppp = READ_ONCE(chan->ppp);
+		events = xchg(&chan->ppp_events, 0);
+		if (ppp) {
+			if (test_bit(DAHDI_PPP_WAKEUP, &events))
+				ppp_output_wakeup(ppp);
+			while ((skb = skb_dequeue(&chan->ppp_rq)) != NULL)
+				ppp_input(ppp, skb);
+			if (test_bit(DAHDI_PPP_ERROR, &events))
+				ppp_input_error(ppp, 0);
+		}
+
+		spin_lock_irq(&batch->lock);
 	}
-	while ((skb = skb_dequeue(&chan->ppp_rq)) != NULL)
-		ppp_input(chan->ppp, skb);
-	if (chan->do_ppp_error) {
-		chan->do_ppp_error = 0;
-		ppp_input_error(chan->ppp, 0);
+	spin_unlock_irq(&batch->lock);
+}
+
+static void dahdi_ppp_batch_init(struct dahdi_ppp_batch *batch)
+{
+	spin_lock_init(&batch->lock);
+	INIT_LIST_HEAD(&batch->pending);
+	tasklet_init(&batch->tasklet, do_ppp_calls, (unsigned long)batch);
+}
+
+/*
+ * Takes the channel off its batch once chan->ppp has been cleared under
+ * chan->lock, so that the tick can no longer queue calls for it.
+ */
+static void dahdi_ppp_detach(struct dahdi_chan *chan, struct ppp_channel *ppp)
+{
+	struct dahdi_ppp_batch *const batch = chan_ppp_batch(chan);
+
+	spin_lock_irq(&batch->lock);
+	list_del_init(&chan->ppp_node);
+	spin_unlock_irq(&batch->lock);
+	/* The tasklet may be making calls on ppp right now. */
+	tasklet_unlock_wait(&batch->tasklet);
+	chan->ppp_events = 0;
+	skb_queue_purge(&chan->ppp_rq);
+	ppp_unregister_channel(ppp);
+	kfree(ppp);
+}
+
+/**
+ * dahdi_chan_ppp_queue() - Get how deep a PPP channel's queues are.
+ * @chan:	The channel.
+ * @tx:		Frames waiting in the write buffers.
+ * @rx:		Frames waiting for ppp_input().
+ * @rx_dropped:	Frames dropped because @rx was full.
+ *
+ * Returns -EINVAL if the channel is not attached to PPP.
+ */
+int dahdi_chan_ppp_queue(struct dahdi_chan *chan, unsigned int *tx,
+			 unsigned int *rx, unsigned int *rx_dropped)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	if (!chan->ppp) {
+		spin_unlock_irqrestore(&chan->lock, flags);
+		return -EINVAL;
 	}
+	if (chan->outwritebuf < 0)
+		*tx = 0;
+	else if (chan->inwritebuf < 0)
+		*tx = chan->numbufs;
+	else
+		*tx = (chan->inwritebuf - chan->outwritebuf + chan->numbufs) %
+		      chan->numbufs;
+	*rx = skb_queue_len(&chan->ppp_rq);
+	*rx_dropped = chan->ppp_rx_dropped;
+	spin_unlock_irqrestore(&chan->lock, flags);
+	return 0;
+}
+#else
+int dahdi_chan_ppp_queue(struct dahdi_chan *chan, unsigned int *tx,
+			 unsigned int *rx, unsigned int *rx_dropped)
+{
+	return -EINVAL;
 }
 #endif
 
@@ -6356,10 +7820,7 @@ ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 		ec_current = chan->ec_current;
 		chan->ec_current = NULL;
 		spin_unlock_irqrestore(&chan->lock, flags);
-		if (ec_state) {
-			ec_state->ops->echocan_free(chan, ec_state);
-			release_echocan(ec_current);
-		}
+		free_echocan(chan, ec_state, ec_current);
 		mutex_unlock(&chan->mutex);
 		return 0;
 	}
@@ -6385,10 +7846,7 @@ ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 	ec_current = chan->ec_current;
 	chan->ec_current = NULL;
 	spin_unlock_irqrestore(&chan->lock, flags);
-	if (ec_state) {
-		ec_state->ops->echocan_free(chan, ec_state);
-		release_echocan(ec_current);
-	}
+	free_echocan(chan, ec_state, ec_current);
 
 	switch (ecp->tap_length) {
 	case 32:
@@ -6438,6 +7896,9 @@ ioctl_echocancel(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 		chan->ec_current = ec_current;
 		chan->ec_state = ec;
 		ec->status.mode = ECHO_MODE_ACTIVE;
+		ec->status.tap_length = ecp->tap_length;
+		ec->in_batch = false;
+		ec->nlp_pending = false;
 		if (!ec->features.CED_tx_detect) {
 			echo_can_disable_detector_init(&chan->ec_state->txecdis);
 		}
@@ -6472,7 +7933,7 @@ static void set_echocan_fax_mode(struct dahdi_chan *chan, unsigned int channo, c
 		} else if (chan->ec_state->features.NLP_toggle) {
 			module_printk(KERN_NOTICE, "Disabled echo canceller NLP because of %s on channel %d\n", reason, channo);
 			dahdi_qevent_nolock(chan, DAHDI_EVENT_EC_NLP_DISABLED);
-			chan->ec_state->ops->echocan_NLP_toggle(chan->ec_state, 0);
+			__dahdi_ec_nlp_toggle(chan, 0);
 			chan->ec_state->status.mode = ECHO_MODE_FAX;
 		} else {
 			module_printk(KERN_NOTICE, "Idled echo canceller because of %s on channel %d\n", reason, channo);
@@ -6495,7 +7956,7 @@ static void set_echocan_fax_mode(struct dahdi_chan *chan, unsigned int channo, c
 		} else if (chan->ec_state->features.NLP_toggle) {
 			module_printk(KERN_NOTICE, "Enabled echo canceller NLP because of %s on channel %d\n", reason, channo);
 			dahdi_qevent_nolock(chan, DAHDI_EVENT_EC_NLP_ENABLED);
-			chan->ec_state->ops->echocan_NLP_toggle(chan->ec_state, 1);
+			__dahdi_ec_nlp_toggle(chan, 1);
 			chan->ec_state->status.mode = ECHO_MODE_ACTIVE;
 		} else {
 			module_printk(KERN_NOTICE, "Activated echo canceller because of %s on channel %d\n", reason, channo);
@@ -6516,7 +7977,8 @@ is_txstate(struct dahdi_chan *const chan, const int txstate)
 	return ret;
 }
 
-static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long data)
+static int
+_dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long data)
 {
 	struct dahdi_chan *const chan = chan_from_file(file);
 	unsigned long flags;
@@ -6565,11 +8027,13 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 			   as echo canceller */
 			struct dahdi_echocan_state *ec_state;
 			const struct dahdi_echocan_factory *ec_current;
+			struct dahdi_chan *monitored;
 
 			spin_lock_irqsave(&chan->lock, flags);
 			chan->flags &= ~DAHDI_FLAG_AUDIO;
 			/* save old conf number, if any */
 			oldconf = chan->confna;
+			monitored = (chan->confmode) ? chan->conf_chan : NULL;
 			  /* initialize conference variables */
 			chan->_confn = 0;
 			chan->confna = 0;
@@ -6595,14 +8059,13 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 			chan->txgain = defgain;
 			spin_unlock_irqrestore(&chan->lock, flags);
 
-			if (ec_state) {
-				ec_state->ops->echocan_free(chan, ec_state);
-				release_echocan(ec_current);
-			}
+			free_echocan(chan, ec_state, ec_current);
 
 			if (rxgain)
 				kfree(rxgain);
 			if (oldconf) dahdi_check_conf(oldconf);
+			if (monitored)
+				dahdi_check_monitored(monitored);
 		}
 #ifdef	DAHDI_AUDIO_NOTIFY
 		if (chan->span->ops->audio_notify)
@@ -6614,6 +8077,8 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 		if (chan->sig != DAHDI_SIG_CLEAR) return (-EINVAL);
 		get_user(j, (int __user *)data);
 		if (j) {
+			if (dahdi_chan_hdlc_counters_alloc(chan))
+				return -ENOMEM;
 			if (!chan->ppp) {
 				chan->ppp = kzalloc(sizeof(struct ppp_channel), GFP_KERNEL);
 				if (chan->ppp) {
@@ -6625,9 +8090,8 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 					chan->ppp->mtu = DAHDI_DEFAULT_MTU_MRU;
 					chan->ppp->hdrlen = 0;
 					skb_queue_head_init(&chan->ppp_rq);
-					chan->do_ppp_wakeup = 0;
-					tasklet_init(&chan->ppp_calls, do_ppp_calls,
-						     (unsigned long)chan);
+					chan->ppp_events = 0;
+					chan->ppp_rx_dropped = 0;
 					if ((ret = dahdi_reallocbufs(chan, DAHDI_DEFAULT_MTU_MRU, DAHDI_DEFAULT_NUM_BUFS))) {
 						kfree(chan->ppp);
 						chan->ppp = NULL;
@@ -6651,23 +8115,21 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 					chan->flags &= ~DAHDI_FLAG_AUDIO;
 					chan->flags |= (DAHDI_FLAG_PPP | DAHDI_FLAG_HDLC | DAHDI_FLAG_FCS);
 
-					if (tec) {
-						tec->ops->echocan_free(chan, tec);
-						release_echocan(ec_current);
-					}
+					free_echocan(chan, tec, ec_current);
 				} else
 					return -ENOMEM;
 			}
 		} else {
+			struct ppp_channel *ppp;
+
+			spin_lock_irqsave(&chan->lock, flags);
 			chan->flags &= ~(DAHDI_FLAG_PPP | DAHDI_FLAG_HDLC | DAHDI_FLAG_FCS);
-			if (chan->ppp) {
-				struct ppp_channel *ppp = chan->ppp;
-				chan->ppp = NULL;
-				tasklet_kill(&chan->ppp_calls);
-				skb_queue_purge(&chan->ppp_rq);
-				ppp_unregister_channel(ppp);
-				kfree(ppp);
-			}
+			__dahdi_reset_bufs(chan);
+			ppp = chan->ppp;
+			chan->ppp = NULL;
+			spin_unlock_irqrestore(&chan->lock, flags);
+			if (ppp)
+				dahdi_ppp_detach(chan, ppp);
 		}
 #else
 		module_printk(KERN_NOTICE, "PPP support not compiled in\n");
@@ -6677,23 +8139,68 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 	case DAHDI_HDLCRAWMODE:
 		if (chan->sig != DAHDI_SIG_CLEAR)	return (-EINVAL);
 		get_user(j, (int __user *)data);
+		if (j && dahdi_chan_hdlc_counters_alloc(chan))
+			return -ENOMEM;
+		spin_lock_irqsave(&chan->lock, flags);
 		chan->flags &= ~(DAHDI_FLAG_AUDIO | DAHDI_FLAG_HDLC | DAHDI_FLAG_FCS);
 		if (j) {
 			chan->flags |= DAHDI_FLAG_HDLC;
 			fasthdlc_init(&chan->rxhdlc, (chan->flags & DAHDI_FLAG_HDLC56) ? FASTHDLC_MODE_56 : FASTHDLC_MODE_64);
 			fasthdlc_init(&chan->txhdlc, (chan->flags & DAHDI_FLAG_HDLC56) ? FASTHDLC_MODE_56 : FASTHDLC_MODE_64);
 		}
+		__dahdi_reset_bufs(chan);
+		spin_unlock_irqrestore(&chan->lock, flags);
 		break;
 	case DAHDI_HDLCFCSMODE:
 		if (chan->sig != DAHDI_SIG_CLEAR)	return (-EINVAL);
 		get_user(j, (int __user *)data);
+		if (j && dahdi_chan_hdlc_counters_alloc(chan))
+			return -ENOMEM;
+		spin_lock_irqsave(&chan->lock, flags);
 		chan->flags &= ~(DAHDI_FLAG_AUDIO | DAHDI_FLAG_HDLC | DAHDI_FLAG_FCS);
 		if (j) {
 			chan->flags |= DAHDI_FLAG_HDLC | DAHDI_FLAG_FCS;
 			fasthdlc_init(&chan->rxhdlc, (chan->flags & DAHDI_FLAG_HDLC56) ? FASTHDLC_MODE_56 : FASTHDLC_MODE_64);
 			fasthdlc_init(&chan->txhdlc, (chan->flags & DAHDI_FLAG_HDLC56) ? FASTHDLC_MODE_56 : FASTHDLC_MODE_64);
 		}
+		__dahdi_reset_bufs(chan);
+		spin_unlock_irqrestore(&chan->lock, flags);
+		break;
+	case DAHDI_HDLC_TXREPEAT:
+	{
+		struct dahdi_hdlc_repeat rep;
+		struct dahdi_txrepeat *const r = &chan->txrepeat;
+		unsigned int fcs;
+		u8 *frame;
+
+		if (copy_from_user(&rep, (void __user *)data, sizeof(rep)))
+			return -EFAULT;
+		if (!(chan->flags & (DAHDI_FLAG_HDLC | DAHDI_FLAG_NOSTDTXRX)))
+			return -EINVAL;
+		/* An MTP2 channel never runs out of frames to repeat */
+		if (chan->flags & DAHDI_FLAG_MTP2)
+			return -EBUSY;
+		/* Room for an FCS and at least one octet */
+		if (rep.len > DAHDI_HDLC_REPEAT_MAX || (rep.len && rep.len < 3))
+			return -EINVAL;
+		spin_lock_irqsave(&chan->lock, flags);
+		frame = r->frame[r->cur ^ 1];
+		memcpy(frame, rep.frame, rep.len);
+		if (rep.len && (chan->flags & DAHDI_FLAG_FCS)) {
+			fcs = dahdi_fcs16(PPP_INITFCS, frame, rep.len - 2);
+			fcs ^= 0xffff;
+			frame[rep.len - 2] = (fcs & 0xff);
+			frame[rep.len - 1] = (fcs >> 8) & 0xff;
+		}
+		r->len[r->cur ^ 1] = rep.len;
+		r->pending = true;
+		spin_unlock_irqrestore(&chan->lock, flags);
+		/* Get an idle hardware HDLC controller going again */
+		if (rep.len && (chan->flags & DAHDI_FLAG_NOSTDTXRX) &&
+		    chan->span && chan->span->ops->hdlc_hard_xmit)
+			chan->span->ops->hdlc_hard_xmit(chan);
 		break;
+	}
 	case DAHDI_HDLC_RATE:
 		get_user(j, (int __user *)data);
 		if (j == 56) {
@@ -6754,6 +8261,28 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 			return -EINVAL;
 		}
 		break;
+	case DAHDI_EC_GETSTATS:
+	{
+		struct dahdi_echocan_stats stats;
+
+		ret = dahdi_chan_ec_stats(chan, &stats);
+		if (ret)
+			return ret;
+		if (copy_to_user((void __user *)data, &stats, sizeof(stats)))
+			return -EFAULT;
+		break;
+	}
+	case DAHDI_HDLC_GETSTATS:
+	{
+		struct dahdi_hdlc_stats stats;
+
+		ret = dahdi_chan_hdlc_stats(chan, &stats);
+		if (ret)
+			return ret;
+		if (copy_to_user((void __user *)data, &stats, sizeof(stats)))
+			return -EFAULT;
+		break;
+	}
 	case DAHDI_ECHOCANCEL_FAX_MODE:
 		if (!chan->ec_state) {
 			return -EINVAL;
@@ -6921,6 +8450,15 @@ static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long d
 	return 0;
 }
 
+static int dahdi_chan_ioctl(struct file *file, unsigned int cmd, unsigned long data)
+{
+	int res = _dahdi_chan_ioctl(file, cmd, data);
+
+	/* Whatever was just changed may need the full audio path. */
+	mark_chan_active(chan_from_file(file));
+	return res;
+}
+
 static int dahdi_prechan_ioctl(struct file *file, unsigned int cmd, unsigned long data)
 {
 	int channo;
@@ -7179,6 +8717,55 @@ void dahdi_free_device(struct dahdi_device *ddev)
 }
 EXPORT_SYMBOL(dahdi_free_device);
 
+/**
+ * dahdi_set_irq_affinity_hint() - Keep a card's interrupt on its own node.
+ * @ddev:	The DAHDI device of the card.
+ * @irq:	The interrupt the driver requested.
+ * @nid:	The node of the card, e.g. dev_to_node(&pdev->dev).
+ *
+ * The spans, channels and echo canceller state of the card are allocated on
+ * its node, so the interrupt handler is best run there too.  Does nothing
+ * unless the numa_irq_hint module parameter is set.  The hint is shown in
+ * the numa_irq_hint attribute of the device.
+ */
+void dahdi_set_irq_affinity_hint(struct dahdi_device *ddev, unsigned int irq,
+				 int nid)
+{
+	int res = -ENOSYS;
+
+	if (!numa_irq_hint || nid == NUMA_NO_NODE || ddev->hint_irq)
+		return;
+	if (!cpumask_intersects(cpumask_of_node(nid), cpu_online_mask))
+		return;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+	res = irq_set_affinity_and_hint(irq, cpumask_of_node(nid));
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+	res = irq_set_affinity_hint(irq, cpumask_of_node(nid));
+#endif
+	if (res) {
+		dev_notice(&ddev->dev, "Unable to hint IRQ %u to node %d (%d)\n",
+			   irq, nid, res);
+		return;
+	}
+	ddev->hint_irq = irq;
+	ddev->hint_node = nid;
+}
+EXPORT_SYMBOL(dahdi_set_irq_affinity_hint);
+
+void dahdi_clear_irq_affinity_hint(struct dahdi_device *ddev)
+{
+	if (!ddev->hint_irq)
+		return;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+	irq_update_affinity_hint(ddev->hint_irq, NULL);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 35)
+	irq_set_affinity_hint(ddev->hint_irq, NULL);
+#endif
+	ddev->hint_irq = 0;
+}
+EXPORT_SYMBOL(dahdi_clear_irq_affinity_hint);
+
 /**
  * __dahdi_init_span - Setup all the data structures for the span.
  * @span:	The span of interest.
@@ -7191,6 +8778,14 @@ static void __dahdi_init_span(struct dahdi_span *span)
 	INIT_LIST_HEAD(&span->spans_node);
 	spin_lock_init(&span->lock);
 	clear_bit(DAHDI_FLAGBIT_REGISTERED, &span->flags);
+	bitmap_zero(span->rxtimers, DAHDI_MAX_SPAN_CHANS);
+	bitmap_zero(span->txtimers, DAHDI_MAX_SPAN_CHANS);
+	/* Let the first tick sort out which channels are idle */
+	bitmap_fill(span->active, DAHDI_MAX_SPAN_CHANS);
+	RCU_INIT_POINTER(span->tsi, NULL);
+#ifdef CONFIG_DAHDI_PPP
+	dahdi_ppp_batch_init(&span->ppp);
+#endif
 
 	if (!span->deflaw) {
 		module_printk(KERN_NOTICE, "Span %s didn't specify default "
@@ -7247,6 +8842,11 @@ EXPORT_SYMBOL(dahdi_init_span);
  * been initialized ith the __dahdi_init_span call.
  *
  */
+static int dahdi_ec_defer_start(struct dahdi_span *span);
+static void dahdi_ec_defer_stop(struct dahdi_span *span);
+static int dahdi_hdlc_defer_start(struct dahdi_span *span);
+static void dahdi_hdlc_defer_stop(struct dahdi_span *span);
+
 static int _dahdi_assign_span(struct dahdi_span *span, unsigned int spanno,
 			      unsigned int basechan, int prefmaster)
 {
@@ -7290,6 +8890,13 @@ static int _dahdi_assign_span(struct dahdi_span *span, unsigned int spanno,
 		span->deflaw = DAHDI_LAW_MULAW;
 	}
 
+	if (span->channels > DAHDI_MAX_SPAN_CHANS) {
+		dev_notice(span_device(span),
+			"span has %d channels, at most %d are supported\n",
+			span->channels, DAHDI_MAX_SPAN_CHANS);
+		return -EINVAL;
+	}
+
 	/* Look through the span list to find the first available span number.
 	 * The spans are kept on this list in sorted order. We'll also save
 	 * off the next available channel number to use. */
@@ -7335,6 +8942,15 @@ static int _dahdi_assign_span(struct dahdi_span *span, unsigned int spanno,
 	if (span->ops->assigned)
 		span->ops->assigned(span);
 
+	if (ec_defer && dahdi_ec_defer_start(span)) {
+		dev_notice(span_device(span),
+			   "Echo cancellation stays in the interrupt\n");
+	}
+	if (hdlc_defer && dahdi_hdlc_defer_start(span)) {
+		dev_notice(span_device(span),
+			   "HDLC framing stays in the interrupt\n");
+	}
+
 	__dahdi_find_master_span();
 
 	return 0;
@@ -7498,6 +9114,7 @@ static int _dahdi_unassign_span(struct dahdi_span *span)
 	int res;
 	int x;
 	struct dahdi_span *new_master, *s;
+	struct dahdi_tsi *tsi;
 	unsigned long flags;
 
 	if (!test_bit(DAHDI_FLAGBIT_REGISTERED, &span->flags)) {
@@ -7529,8 +9146,23 @@ static int _dahdi_unassign_span(struct dahdi_span *span)
 
 	span_sysfs_remove(span);
 
+	dahdi_ec_defer_stop(span);
+	dahdi_hdlc_defer_stop(span);
+
 	for (x=0;x<span->channels;x++)
 		dahdi_chan_unreg(span->chans[x]);
+#ifdef CONFIG_DAHDI_PPP
+	tasklet_kill(&span->ppp.tasklet);
+#endif
+
+	/* The channels are about to go away, make sure no tick is still
+	 * cross-connecting from a stale DACS table that refers to them. */
+	spin_lock_irqsave(&tsi_lock, flags);
+	tsi = span->tsi;
+	rcu_assign_pointer(span->tsi, NULL);
+	spin_unlock_irqrestore(&tsi_lock, flags);
+	synchronize_rcu();
+	kfree(tsi);
 
 	new_master = master_span; /* FIXME: locking */
 	if (master_span == span)
@@ -8025,28 +9657,195 @@ static inline void __dahdi_process_getaudio_chunk(struct dahdi_chan *ss, unsigne
 		txb[x] = ms->txgain[txb[x]];
 }
 
-static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb,
+static void __putbuf_chunk(struct dahdi_chan *ss, const unsigned char *rxb,
 			   int bytes);
 
-static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *txb)
-{
+/* Ticks of line data queued between the tick and the HDLC thread */
+#define DAHDI_HDLC_DEFER_TICKS	8
 
+/* Bytes of line data each channel can queue per direction */
+#define DAHDI_HDLC_DEFER_RING	2048
 
+/**
+ * struct dahdi_hdlc_defer - HDLC framing moved out of the span's tick.
+ *
+ * For each HDLC channel of the span the tick only queues the received line
+ * bytes on line[].rx and sends what the thread encoded ahead on line[].tx.
+ * The thread deframes and frames everything queued every
+ * DAHDI_HDLC_DEFER_TICKS / 2 ticks, keeping DAHDI_HDLC_DEFER_TICKS of line
+ * data encoded ahead.  A bundle master queues one chunk per member each
+ * tick, in bundle order, on its own rings.  Both sides hold the channel's
+ * lock while touching its rings.  If the thread falls behind, received
+ * bytes that do not fit are dropped (rx_overruns) and the transmitter sends
+ * all ones, an abort, in place of what was not encoded in time
+ * (tx_underruns).  Either way only the frame in progress is lost.
+ *
+ * Once draining is set the thread stops encoding ahead and the tick goes
+ * back to framing a channel itself when its tx ring runs empty, so the
+ * frame in flight is not cut when deferral is turned off.
+ */
+struct dahdi_hdlc_defer {
+	struct dahdi_span *span;
+	struct task_struct *task;
+	int cpu;
+	unsigned int ticks;
+	bool queued;
+	bool draining;
+	int kick;
+	u8 *buf;
+	unsigned long runs;
+	unsigned long rx_overruns;
+	unsigned long tx_underruns;
+	struct dahdi_hdlc_line {
+		struct dahdi_ring rx;
+		struct dahdi_ring tx;
+	} line[];
+};
+
+/*
+ * True if the channel's framing can run on the span's HDLC thread.  Bundle
+ * members are framed through their master, which is the one deferred.
+ */
+static inline bool dahdi_hdlc_deferrable(const struct dahdi_chan *chan)
+{
+	return (chan->flags & DAHDI_FLAG_HDLC) &&
+		!(chan->flags & (DAHDI_FLAG_AUDIO | DAHDI_FLAG_LOOPED)) &&
+		!chan->confmode && chan->span && (chan->master == chan)
 #ifdef CONFIG_DAHDI_MIRROR
-	unsigned char *orig_txb = txb;
-#endif /* CONFIG_DAHDI_MIRROR */
+		&& !chan->rxmirror && !chan->txmirror
+#endif
+		;
+}
 
-	/* Called with ss->lock held */
-	/* We transmit data from our master channel */
-	struct dahdi_chan *ms = ss->master;
+/* Deframe what is queued on ring.  Called with chan->lock held. */
+static void __dahdi_hdlc_defer_deframe(struct dahdi_chan *chan,
+				       struct dahdi_ring *ring)
+{
+	u8 buf[256];
+	unsigned int n;
+
+	while ((n = min_t(unsigned int, dahdi_ring_used(ring), sizeof(buf)))) {
+		dahdi_ring_get(ring, buf, n);
+		dahdi_ring_consume(ring, n);
+		__putbuf_chunk(chan, buf, n);
+	}
+}
+
+/*
+ * Queue a received chunk for the HDLC thread.  Called with ms->lock held.
+ * Returns false if framing is not deferred on the span, or is being
+ * handed back to the tick.
+ */
+static bool __dahdi_hdlc_defer_rx(struct dahdi_chan *ms,
+				  const unsigned char *rxb)
+{
+	struct dahdi_hdlc_defer *d;
+	struct dahdi_ring *ring;
+
+	rcu_read_lock();
+	d = rcu_dereference(ms->span->hdlc_defer);
+	if (!d) {
+		rcu_read_unlock();
+		return false;
+	}
+	ring = &d->line[ms->chanpos - 1].rx;
+	if (READ_ONCE(d->draining)) {
+		/* Keep the order, what is still queued goes first */
+		__dahdi_hdlc_defer_deframe(ms, ring);
+		rcu_read_unlock();
+		return false;
+	}
+	if (ring->depth - dahdi_ring_used(ring) >= DAHDI_CHUNKSIZE) {
+		dahdi_ring_put(ring, rxb, DAHDI_CHUNKSIZE);
+		dahdi_ring_produce(ring, DAHDI_CHUNKSIZE);
+	} else {
+		d->rx_overruns++;
+	}
+	d->queued = true;
+	rcu_read_unlock();
+	return true;
+}
+
+/*
+ * Take a chunk the HDLC thread encoded ahead.  Called with ms->lock held.
+ * Returns false if framing is not deferred on the span, or is being handed
+ * back to the tick and nothing encoded ahead is left.
+ */
+static bool __dahdi_hdlc_defer_tx(struct dahdi_chan *ms, unsigned char *txb)
+{
+	struct dahdi_hdlc_defer *d;
+	struct dahdi_ring *ring;
+	unsigned int left;
+
+	rcu_read_lock();
+	d = rcu_dereference(ms->span->hdlc_defer);
+	if (!d) {
+		rcu_read_unlock();
+		return false;
+	}
+	ring = &d->line[ms->chanpos - 1].tx;
+	if (READ_ONCE(d->draining) && !dahdi_ring_used(ring)) {
+		rcu_read_unlock();
+		return false;
+	}
+	left = min_t(unsigned int, dahdi_ring_used(ring), DAHDI_CHUNKSIZE);
+	dahdi_ring_get(ring, txb, left);
+	dahdi_ring_consume(ring, left);
+	if (left < DAHDI_CHUNKSIZE) {
+		memset(txb + left, 0xff, DAHDI_CHUNKSIZE - left);
+		d->tx_underruns++;
+	}
+	d->queued = true;
+	rcu_read_unlock();
+	return true;
+}
+
+/**
+ * __dahdi_ring_transmit() - Take up to bytes of queued stream data.
+ *
+ * Called with ms->lock held.  Returns how many bytes were copied to txb.
+ */
+static int __dahdi_ring_transmit(struct dahdi_chan *ms, unsigned char *txb,
+				 int bytes)
+{
+	struct dahdi_ring *const ring = &ms->txring;
+	const unsigned int used = dahdi_ring_used(ring);
+	unsigned int left = min_t(unsigned int, used, bytes);
+	const unsigned int room = ring->depth - used;
+
+	/* Read the head before the data it covers */
+	smp_rmb();
+	dahdi_ring_get(ring, txb, left);
+	dahdi_ring_consume(ring, left);
+
+	if (left == used) {
+		/* If we're only supposed to start when full, disable the
+		 * transmitter until the writer catches up again. */
+		if ((ms->txbufpolicy == DAHDI_POLICY_WHEN_FULL) ||
+		    (ms->txbufpolicy == DAHDI_POLICY_HALF_FULL))
+			ms->txdisable = 1;
+		wake_up_interruptible(&ms->waitq);
+	} else if ((room < ms->blocksize) && (room + left >= ms->blocksize)) {
+		/* Room for another block, let a blocked writer in */
+		wake_up_interruptible(&ms->waitq);
+	}
+	return left;
+}
+
+/*
+ * Fill txb with bytes of what the master channel ms has to send.  Called with
+ * ms->lock held, from the tick or from the span's HDLC thread.
+ */
+static void __dahdi_getbuf(struct dahdi_chan *ms, unsigned char *txb,
+			   int bytes)
+{
 	/* Buffer we're using */
 	unsigned char *buf;
 	/* Old buffer number */
 	int oldbuf;
 	/* Linear representation */
 	int getlin;
-	/* How many bytes we need to process */
-	int bytes = DAHDI_CHUNKSIZE, left;
+	int left;
 	bool needtxunderrun = false;
 	int x;
 
@@ -8054,21 +9853,38 @@ static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *tx
 	   try is our write-out buffer.  Always check it first because
 	   its our 'fast path' for whatever that's worth. */
 	while(bytes) {
-		if ((ms->outwritebuf > -1) && !ms->txdisable) {
+		if (!dahdi_chan_framed(ms) && !ms->txdisable &&
+		    dahdi_ring_used(&ms->txring)) {
+			left = __dahdi_ring_transmit(ms, txb, bytes);
+			txb += left;
+			bytes -= left;
+		} else if (ms->txrepeat.idx) {
+			/* Finish the repeat frame before anything else */
+			x = __dahdi_hdlc_repeat(ms, txb, bytes);
+			txb += x;
+			bytes -= x;
+#ifdef CONFIG_DAHDI_NET
+		} else if (dahdi_have_netdev(ms) && dahdi_net_tx_pending(ms) &&
+			   !ms->txdisable) {
+			left = __dahdi_net_getbuf(ms, txb, bytes);
+			txb += left;
+			bytes -= left;
+#endif
+		} else if ((ms->outwritebuf > -1) && !ms->txdisable) {
 			buf= ms->writebuf[ms->outwritebuf];
 			left = ms->writen[ms->outwritebuf] - ms->writeidx[ms->outwritebuf];
 			if (left > bytes)
 				left = bytes;
 			if (ms->flags & DAHDI_FLAG_HDLC) {
-				/* If this is an HDLC channel we only send a byte of
-				   HDLC. */
-				for(x=0;x<left;x++) {
-					if (fasthdlc_tx_need_data(&ms->txhdlc))
-						/* Load a byte of data only if needed */
-						fasthdlc_tx_load_nocheck(&ms->txhdlc, buf[ms->writeidx[ms->outwritebuf]++]);
-					*(txb++) = fasthdlc_tx_run_nocheck(&ms->txhdlc);
-				}
-				bytes -= left;
+				/* If this is an HDLC channel, encode until the
+				   data or the chunk runs out. */
+				const unsigned char *data = buf + ms->writeidx[ms->outwritebuf];
+				int len = left;
+
+				x = fasthdlc_tx_encode(&ms->txhdlc, &data, &len, txb, bytes);
+				ms->writeidx[ms->outwritebuf] += left - len;
+				txb += x;
+				bytes -= x;
 			} else {
 				memcpy(txb, buf + ms->writeidx[ms->outwritebuf], left);
 				ms->writeidx[ms->outwritebuf]+=left;
@@ -8079,6 +9895,9 @@ static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *tx
 			if (ms->writeidx[ms->outwritebuf] >= ms->writen[ms->outwritebuf]) {
 				/* We've reached the end of our buffer.  Go to the next. */
 				oldbuf = ms->outwritebuf;
+				if (ms->flags & DAHDI_FLAG_HDLC)
+					__dahdi_hdlc_count_frame(ms, DAHDI_HDLC_TX_FRAMES,
+								 ms->writen[oldbuf]);
 				/* Clear out write index and such */
 				ms->writeidx[oldbuf] = 0;
 				ms->outwritebuf = (ms->outwritebuf + 1) % ms->numbufs;
@@ -8135,9 +9954,9 @@ out in the later versions, and is put back now. */
 					netif_wake_queue(chan_to_netdev(ms));
 #endif
 #ifdef CONFIG_DAHDI_PPP
-				if (ms->flags & DAHDI_FLAG_PPP) {
-					ms->do_ppp_wakeup = 1;
-					tasklet_schedule(&ms->ppp_calls);
+				if ((ms->flags & DAHDI_FLAG_PPP) && ms->ppp) {
+					set_bit(DAHDI_PPP_WAKEUP, &ms->ppp_events);
+					__dahdi_ppp_pend(ms);
 				}
 #endif
 			}
@@ -8171,6 +9990,12 @@ out in the later versions, and is put back now. */
 			for (x = 0; x < bytes; x++)
 				txb[x] = ms->readchunk[x];
 			bytes = 0;
+		} else if ((ms->flags & DAHDI_FLAG_HDLC) &&
+			   __dahdi_txrepeat_ready(ms)) {
+			/* Nothing queued, send the repeat frame again */
+			x = __dahdi_hdlc_repeat(ms, txb, bytes);
+			txb += x;
+			bytes -= x;
 		} else if (ms->flags & DAHDI_FLAG_HDLC) {
 			for (x=0;x<bytes;x++) {
 				/* Okay, if we're HDLC, then transmit a flag by default */
@@ -8207,6 +10032,18 @@ out in the later versions, and is put back now. */
 	} else {
 		clear_bit(DAHDI_FLAGBIT_TXUNDERRUN, &ms->flags);
 	}
+}
+
+static inline void __dahdi_getbuf_chunk(struct dahdi_chan *ss, unsigned char *txb)
+{
+#ifdef CONFIG_DAHDI_MIRROR
+	unsigned char *orig_txb = txb;
+#endif /* CONFIG_DAHDI_MIRROR */
+
+	/* Called with ss->lock held */
+	/* We transmit data from our master channel */
+	if (!dahdi_hdlc_deferrable(ss) || !__dahdi_hdlc_defer_tx(ss, txb))
+		__dahdi_getbuf(ss->master, txb, DAHDI_CHUNKSIZE);
 
 #ifdef CONFIG_DAHDI_MIRROR
 	if (ss->txmirror) {
@@ -8328,8 +10165,10 @@ static inline void __rbs_otimer_expire(struct dahdi_chan *chan)
 	case DAHDI_TXSTATE_DEBOUNCE:
 		dahdi_rbs_sethook(chan, DAHDI_TXSIG_OFFHOOK, DAHDI_TXSTATE_OFFHOOK, 0);
 		/* See if we've gone back on hook */
-		if ((chan->rxhooksig == DAHDI_RXSIG_ONHOOK) && (chan->rxflashtime > 2))
+		if ((chan->rxhooksig == DAHDI_RXSIG_ONHOOK) && (chan->rxflashtime > 2)) {
 			chan->itimerset = chan->itimer = chan->rxflashtime * DAHDI_CHUNKSIZE;
+			__arm_rx_timers(chan);
+		}
 		wake_up_interruptible(&chan->waitq);
 		break;
 
@@ -8372,6 +10211,7 @@ static inline void __rbs_otimer_expire(struct dahdi_chan *chan)
 		}
 		chan->txstate = DAHDI_TXSTATE_PULSEAFTER;
 		chan->otimer = chan->pulseaftertime * DAHDI_CHUNKSIZE;
+		__arm_tx_timer(chan);
 		wake_up_interruptible(&chan->waitq);
 		break;
 
@@ -8397,6 +10237,8 @@ static void __dahdi_hooksig_pvt(struct dahdi_chan *chan, enum dahdi_rxsig rxsig)
 	if ((chan->flags & DAHDI_FLAG_SIGFREEZE)) return;
 
 	chan->rxhooksig = rxsig;
+	/* Any of the receive timers may be started below */
+	__arm_rx_timers(chan);
 #ifdef	RINGBEGIN
 	if ((chan->sig & __DAHDI_SIG_FXS) && (rxsig == DAHDI_RXSIG_RING) &&
 	    (!chan->ringdebtimer))
@@ -8676,130 +10518,971 @@ static void process_echocan_events(struct dahdi_chan *chan)
 		}
 	}
 
-	if (events.bit.CNG_tx_detected)
-		dahdi_qevent_nolock(chan, DAHDI_EVENT_TX_CNG_DETECTED);
-
-	if (events.bit.CNG_rx_detected)
-		dahdi_qevent_nolock(chan, DAHDI_EVENT_RX_CNG_DETECTED);
+	if (events.bit.CNG_tx_detected)
+		dahdi_qevent_nolock(chan, DAHDI_EVENT_TX_CNG_DETECTED);
+
+	if (events.bit.CNG_rx_detected)
+		dahdi_qevent_nolock(chan, DAHDI_EVENT_RX_CNG_DETECTED);
+
+	if (events.bit.NLP_auto_disabled) {
+		dahdi_qevent_nolock(chan, DAHDI_EVENT_EC_NLP_DISABLED);
+		chan->ec_state->status.mode = ECHO_MODE_FAX;
+	}
+
+	if (events.bit.NLP_auto_enabled) {
+		dahdi_qevent_nolock(chan, DAHDI_EVENT_EC_NLP_ENABLED);
+		chan->ec_state->status.mode = ECHO_MODE_ACTIVE;
+	}
+}
+
+/* Only measure echo levels while the far end is above about -40 dBm0 */
+#define DAHDI_EC_STATS_MIN_REF	(256 * 256)
+
+/* Mean square of a chunk of linear samples */
+static u32 dahdi_ec_meansq(const short *s)
+{
+	u32 sum = 0;
+	int x;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+		sum += (u32)(s[x] * s[x]) / DAHDI_CHUNKSIZE;
+	return sum;
+}
+
+static inline void dahdi_ec_smooth(u32 *pow, u32 meansq)
+{
+	*pow = *pow - (*pow >> 4) + (meansq >> 4);
+}
+
+/*
+ * Account one chunk that took ns to echo cancel.  ref and in are the mean
+ * squares of the reference and the receive chunk before cancellation.
+ */
+static void dahdi_ec_stats(struct dahdi_echocan_state *ec, u32 ref, u32 in,
+			   const short *out, u32 ns)
+{
+	if (ref >= DAHDI_EC_STATS_MIN_REF) {
+		dahdi_ec_smooth(&ec->stats.ref_pow, ref);
+		dahdi_ec_smooth(&ec->stats.in_pow, in);
+		dahdi_ec_smooth(&ec->stats.out_pow, dahdi_ec_meansq(out));
+	}
+	ec->stats.chunks++;
+	ec->stats.total_ns += ns;
+	if (ns > ec->stats.max_ns)
+		ec->stats.max_ns = ns;
+}
+
+static inline u32 dahdi_ec_ns_since(ktime_t start)
+{
+	return ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+/* log2(x) in 1/256ths, interpolating linearly between powers of two */
+static int dahdi_log2_q8(u32 x)
+{
+	const int n = fls(x) - 1;
+
+	if (n >= 8)
+		return (n << 8) + ((x >> (n - 8)) & 0xff);
+	return (n << 8) + ((x << (8 - n)) & 0xff);
+}
+
+/* 10 * log10(num / den) in 0.1 dB */
+static s32 dahdi_ec_db(u32 num, u32 den)
+{
+	if (!num)
+		return 0;
+	return (dahdi_log2_q8(num) - dahdi_log2_q8(max(den, 1U))) * 30103 /
+		256000;
+}
+
+/* Peak reference level (about -57 dBm0) below which a chunk is silent */
+#define DAHDI_EC_GATE_LEVEL	32
+
+/*
+ * Whether echo cancellation of a chunk can be skipped.  That is when the
+ * reference has been silent for longer than the tail: there is no echo left
+ * to cancel, and the canceller's history holds nothing but silence, so it
+ * needs no updating until the reference comes back.
+ */
+static bool dahdi_ec_gated(struct dahdi_echocan_state *ec, const short *ref)
+{
+	int x;
+
+	for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+		if (abs(ref[x]) > DAHDI_EC_GATE_LEVEL) {
+			ec->status.silent = 0;
+			return false;
+		}
+	}
+
+	if (ec->status.silent <= ec->status.tap_length) {
+		ec->status.silent += DAHDI_CHUNKSIZE;
+		return false;
+	}
+	if (!ec_gate)
+		return false;
+	ec->stats.gated++;
+	return true;
+}
+
+/**
+ * dahdi_chan_ec_stats() - Get the statistics of a channel's echo canceller.
+ * @chan:	The channel.
+ * @stats:	Filled in.
+ *
+ * Returns -EINVAL if the channel has no echo canceller.
+ */
+int dahdi_chan_ec_stats(struct dahdi_chan *chan,
+			struct dahdi_echocan_stats *stats)
+{
+	const struct dahdi_echocan_state *ec;
+	unsigned long flags;
+
+	memset(stats, 0, sizeof(*stats));
+	spin_lock_irqsave(&chan->lock, flags);
+	ec = chan->ec_state;
+	if (!ec) {
+		spin_unlock_irqrestore(&chan->lock, flags);
+		return -EINVAL;
+	}
+	stats->erl = dahdi_ec_db(ec->stats.ref_pow, ec->stats.in_pow);
+	stats->erle = dahdi_ec_db(ec->stats.in_pow, ec->stats.out_pow);
+	stats->dtd = ec->stats.dtd;
+	stats->adapt = ec->stats.adapt;
+	stats->adapt_skipped = ec->stats.adapt_skipped;
+	stats->chunks = ec->stats.chunks;
+	stats->gated = ec->stats.gated;
+	if (ec->stats.chunks) {
+		stats->avg_ns = div_u64(ec->stats.total_ns, ec->stats.chunks);
+		stats->max_ns = ec->stats.max_ns;
+	}
+	spin_unlock_irqrestore(&chan->lock, flags);
+	return 0;
+}
+
+/* Called with ss->lock held and ss->ec_state set. */
+static void __dahdi_ec_process(struct dahdi_chan *ss, u8 *rxchunk,
+			       const u8 *preecchunk, const u8 *txchunk)
+{
+	short rxlin;
+	int x;
+
+	if (ss->ec_state->status.mode & __ECHO_MODE_MUTE) {
+		/* Special stuff for training the echo can */
+		for (x=0;x<DAHDI_CHUNKSIZE;x++) {
+			rxlin = DAHDI_XLAW(preecchunk[x], ss);
+			if (ss->ec_state->status.mode == ECHO_MODE_PRETRAINING) {
+				if (--ss->ec_state->status.pretrain_timer <= 0) {
+					ss->ec_state->status.pretrain_timer = 0;
+					ss->ec_state->status.mode = ECHO_MODE_STARTTRAINING;
+				}
+			}
+			if (ss->ec_state->status.mode == ECHO_MODE_AWAITINGECHO) {
+				ss->ec_state->status.last_train_tap = 0;
+				ss->ec_state->status.mode = ECHO_MODE_TRAINING;
+			}
+			if ((ss->ec_state->status.mode == ECHO_MODE_TRAINING) &&
+			    (ss->ec_state->ops->echocan_traintap)) {
+				if (ss->ec_state->ops->echocan_traintap(ss->ec_state, ss->ec_state->status.last_train_tap++, rxlin)) {
+					ss->ec_state->status.mode = ECHO_MODE_ACTIVE;
+				}
+			}
+			rxlin = 0;
+			rxchunk[x] = DAHDI_LIN2X((int)rxlin, ss);
+		}
+	} else if (ss->ec_state->status.mode != ECHO_MODE_IDLE) {
+		ss->ec_state->events.all = 0;
+
+		if (ss->ec_state->ops->echocan_process) {
+			short rxlins[DAHDI_CHUNKSIZE], txlins[DAHDI_CHUNKSIZE];
+			const bool stats = ec_stats;
+			ktime_t start = ktime_set(0, 0);
+			u32 ref = 0, in = 0;
+
+			for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+				rxlins[x] = DAHDI_XLAW(preecchunk[x],
+						       ss);
+				txlins[x] = DAHDI_XLAW(txchunk[x], ss);
+			}
+			if (dahdi_ec_gated(ss->ec_state, txlins))
+				return;
+			if (stats) {
+				ref = dahdi_ec_meansq(txlins);
+				in = dahdi_ec_meansq(rxlins);
+				start = ktime_get();
+			}
+			ss->ec_state->ops->echocan_process(ss->ec_state, rxlins, txlins, DAHDI_CHUNKSIZE);
+			if (stats) {
+				dahdi_ec_stats(ss->ec_state, ref, in, rxlins,
+					       dahdi_ec_ns_since(start));
+			}
+
+			for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+				rxchunk[x] = DAHDI_LIN2X((int) rxlins[x], ss);
+		} else if (ss->ec_state->ops->echocan_events)
+			ss->ec_state->ops->echocan_events(ss->ec_state);
+
+		if (ss->ec_state->events.all)
+			process_echocan_events(ss);
+
+	}
+}
+
+/**
+ * __dahdi_ec_chunk() - process echo for a single channel
+ * @ss:		DAHDI channel
+ * @rxchunk:	buffer to store audio with cancelled audio
+ * @preecchunk: chunk of audio on which to cancel echo
+ * @txchunk:	reference chunk from the other direction
+ *
+ * The echo canceller function fixes received (from device to userspace)
+ * audio. In order to fix it it uses the transmitted audio as a
+ * reference. This call updates the echo canceller for a single chunk (8
+ * bytes).
+ *
+ * Call with local interrupts disabled.
+ */
+void __dahdi_ec_chunk(struct dahdi_chan *ss, u8 *rxchunk,
+		      const u8 *preecchunk, const u8 *txchunk)
+{
+	int x;
+
+	spin_lock(&ss->lock);
+
+	if (ss->readchunkpreec) {
+		/* Save a copy of the audio before the echo can has its way with it */
+		for (x = 0; x < DAHDI_CHUNKSIZE; x++)
+			/* We only ever really need to deal with signed linear - let's just convert it now */
+			ss->readchunkpreec[x] = DAHDI_XLAW(preecchunk[x], ss);
+	}
+
+	/* Perform echo cancellation on a chunk if necessary */
+	if (ss->ec_state) {
+#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
+		dahdi_kernel_fpu_begin();
+#endif
+		__dahdi_ec_process(ss, rxchunk, preecchunk, txchunk);
+#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
+		dahdi_kernel_fpu_end();
+#endif
+	}
+
+	spin_unlock(&ss->lock);
+}
+EXPORT_SYMBOL(__dahdi_ec_chunk);
+
+/* Channels handed to echocan_process_batch() at most at once */
+#define DAHDI_EC_BATCH	16
+
+/* The echo canceller if it can be run through echocan_process_batch(). */
+static struct dahdi_echocan_state *__dahdi_ec_batchable(struct dahdi_chan *chan)
+{
+	struct dahdi_echocan_state *const ec = chan->ec_state;
+
+	if (!ec || !ec->ops->echocan_process_batch)
+		return NULL;
+	if ((ec->status.mode & __ECHO_MODE_MUTE) ||
+	    (ec->status.mode == ECHO_MODE_IDLE))
+		return NULL;
+	return ec;
+}
+
+static void __dahdi_ec_batch(struct dahdi_echocan_chunk *batch,
+			     struct dahdi_chan **chans, u8 **rx,
+			     unsigned int count)
+{
+	u32 ref[DAHDI_EC_BATCH], in[DAHDI_EC_BATCH];
+	const bool stats = ec_stats;
+	ktime_t start = ktime_set(0, 0);
+	unsigned int i;
+	u32 ns = 0;
+	int x;
+
+	if (stats) {
+		for (i = 0; i < count; i++) {
+			ref[i] = dahdi_ec_meansq(batch[i].iref);
+			in[i] = dahdi_ec_meansq(batch[i].isig);
+		}
+		start = ktime_get();
+	}
+	batch[0].ec->ops->echocan_process_batch(batch, count);
+	/* Charge each channel its share of the batch */
+	if (stats)
+		ns = dahdi_ec_ns_since(start) / count;
+
+	/* Past this the echocans may be changed or freed */
+	for (i = 0; i < count; i++)
+		smp_store_release(&batch[i].ec->in_batch, false);
+	/* Pairs with the check in wait_var_event() */
+	smp_mb();
+	for (i = 0; i < count; i++)
+		wake_up_var(&batch[i].ec->in_batch);
+
+	for (i = 0; i < count; i++) {
+		struct dahdi_chan *const chan = chans[i];
+		unsigned long flags;
+
+		spin_lock_irqsave(&chan->lock, flags);
+		/* Skip the channel if its echocan went away meanwhile */
+		if (chan->ec_state == batch[i].ec) {
+			struct dahdi_echocan_state *const ec = chan->ec_state;
+
+			if (ec->nlp_pending) {
+				ec->nlp_pending = false;
+				ec->ops->echocan_NLP_toggle(ec,
+					ec->status.mode != ECHO_MODE_FAX);
+			}
+			if (stats) {
+				dahdi_ec_stats(chan->ec_state, ref[i], in[i],
+					       batch[i].isig, ns);
+			}
+			for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+				rx[i][x] =
+					DAHDI_LIN2X((int)batch[i].isig[x], chan);
+			}
+			if (chan->ec_state->events.all)
+				process_echocan_events(chan);
+		}
+		spin_unlock_irqrestore(&chan->lock, flags);
+	}
+}
+
+/**
+ * struct dahdi_ec_slot - One tick of a span's audio waiting for the worker.
+ * @rx:		The received chunks, channels * DAHDI_CHUNKSIZE bytes.
+ * @tx:		The transmitted (reference) chunks.
+ * @out:	@rx with the echo removed.
+ */
+struct dahdi_ec_slot {
+	u8 *rx;
+	u8 *tx;
+	u8 *out;
+};
+
+/* Ticks that may be waiting for the worker before chunks are dropped */
+#define DAHDI_EC_DEFER_DEPTH	8
+
+/**
+ * struct dahdi_ec_defer - Echo cancellation moved out of the span's tick.
+ *
+ * The tick copies the span's chunks into slot[head] and hands up the chunks
+ * the worker produced from the tick before, so the receive audio of the
+ * channels with an echo canceller is delayed by exactly one chunk, along
+ * with their readchunkpreec.  Other channels are not delayed.  head is only
+ * written by the tick, tail only
+ * by the worker.  If the worker has not finished in time the previous chunk
+ * goes up without echo cancellation (late), and if every slot is taken the
+ * new chunk is parked in spare and not cancelled at all (overruns).
+ */
+struct dahdi_ec_defer {
+	struct dahdi_span *span;
+	struct work_struct work;
+	int cpu;
+	unsigned int head;
+	unsigned int tail;
+	bool prev_spare;
+	u8 *spare;
+	struct dahdi_ec_slot slot[DAHDI_EC_DEFER_DEPTH];
+	unsigned int max_depth;
+	unsigned long late;
+	unsigned long overruns;
+	u8 buf[];
+};
+
+/*
+ * Echo cancel channels first to last - 1 of span.  With a slot, the chunks
+ * are taken from it instead of the channels.  Each batched echo canceller is
+ * marked in_batch under its channel's lock.  Freeing it first waits with
+ * dahdi_ec_quiesce(), and an NLP switch meanwhile is left to the batch, so
+ * the tick never waits on a batch it interrupted.
+ */
+static void __dahdi_ec_span(struct dahdi_span *span, struct dahdi_ec_slot *slot,
+			    int first, int last)
+{
+	struct dahdi_echocan_chunk batch[DAHDI_EC_BATCH];
+	struct dahdi_chan *chans[DAHDI_EC_BATCH];
+	u8 *rxs[DAHDI_EC_BATCH];
+	const struct dahdi_echocan_ops *ops = NULL;
+	unsigned int count = 0;
+	unsigned long flags;
+	int x, y;
+
+#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
+	dahdi_kernel_fpu_begin();
+#endif
+	for (x = first; x < last; x++) {
+		struct dahdi_chan *const chan = span->chans[x];
+		struct dahdi_echocan_state *ec;
+		u8 *rx, *tx;
+
+		if (!chan->ec_current)
+			continue;
+
+		if (slot) {
+			rx = slot->out + x * DAHDI_CHUNKSIZE;
+			tx = slot->tx + x * DAHDI_CHUNKSIZE;
+		} else {
+			rx = chan->readchunk;
+			tx = chan->writechunk;
+		}
+
+		spin_lock_irqsave(&chan->lock, flags);
+		ec = __dahdi_ec_batchable(chan);
+		if (ec && count &&
+		    ((ec->ops != ops) || (count == DAHDI_EC_BATCH))) {
+			spin_unlock_irqrestore(&chan->lock, flags);
+			__dahdi_ec_batch(batch, chans, rxs, count);
+			count = 0;
+			spin_lock_irqsave(&chan->lock, flags);
+			ec = __dahdi_ec_batchable(chan);
+		}
+
+		/* A deferred tick saved the pre echo can copy already */
+		if (!slot && chan->readchunkpreec) {
+			for (y = 0; y < DAHDI_CHUNKSIZE; y++) {
+				chan->readchunkpreec[y] =
+					DAHDI_XLAW(chan->readchunk[y], chan);
+			}
+		}
+
+		if (ec) {
+			for (y = 0; y < DAHDI_CHUNKSIZE; y++)
+				batch[count].iref[y] = DAHDI_XLAW(tx[y], chan);
+			if (!dahdi_ec_gated(ec, batch[count].iref)) {
+				ec->events.all = 0;
+				ec->in_batch = true;
+				batch[count].ec = ec;
+				for (y = 0; y < DAHDI_CHUNKSIZE; y++) {
+					batch[count].isig[y] =
+						DAHDI_XLAW(rx[y], chan);
+				}
+				rxs[count] = rx;
+				chans[count++] = chan;
+				ops = ec->ops;
+			}
+		} else if (chan->ec_state) {
+			__dahdi_ec_process(chan, rx, rx, tx);
+		}
+		spin_unlock_irqrestore(&chan->lock, flags);
+	}
+	if (count)
+		__dahdi_ec_batch(batch, chans, rxs, count);
+#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
+	dahdi_kernel_fpu_end();
+#endif
+}
+
+/* Hand this tick's chunks to the worker and the last tick's ones up. */
+static void __dahdi_ec_defer(struct dahdi_span *span, struct dahdi_ec_defer *d)
+{
+	const unsigned int head = d->head;
+	const unsigned int depth = head - READ_ONCE(d->tail);
+	struct dahdi_ec_slot *const prev =
+				&d->slot[(head - 1) % DAHDI_EC_DEFER_DEPTH];
+	struct dahdi_ec_slot *next = NULL;
+	const u8 *src, *raw;
+	u8 *dst;
+	int x, y;
+
+	/* Pairs with the barrier before the worker moves tail */
+	smp_mb();
+	raw = d->prev_spare ? d->spare : prev->rx;
+	if (d->prev_spare) {
+		src = d->spare;
+	} else if (!depth) {
+		src = prev->out;
+	} else {
+		src = prev->rx;
+		d->late++;
+	}
+
+	if (depth < DAHDI_EC_DEFER_DEPTH) {
+		next = &d->slot[head % DAHDI_EC_DEFER_DEPTH];
+		dst = next->rx;
+	} else {
+		dst = d->spare;
+		d->overruns++;
+	}
+
+	for (x = 0; x < span->channels; x++) {
+		struct dahdi_chan *const chan = span->chans[x];
+		const unsigned int off = x * DAHDI_CHUNKSIZE;
+		u8 cur[DAHDI_CHUNKSIZE];
+
+		spin_lock(&chan->lock);
+		/* Queued for all, a canceller added meanwhile needs it */
+		memcpy(cur, chan->readchunk, DAHDI_CHUNKSIZE);
+		if (chan->ec_state) {
+			/* The same chunk as readchunk, before cancelling */
+			if (chan->readchunkpreec) {
+				for (y = 0; y < DAHDI_CHUNKSIZE; y++) {
+					chan->readchunkpreec[y] =
+						DAHDI_XLAW(raw[off + y], chan);
+				}
+			}
+			memcpy(chan->readchunk, src + off, DAHDI_CHUNKSIZE);
+		}
+		/* src and dst are the same when overrunning twice in a row */
+		memcpy(dst + off, cur, DAHDI_CHUNKSIZE);
+		if (next)
+			memcpy(next->tx + off, chan->writechunk, DAHDI_CHUNKSIZE);
+		spin_unlock(&chan->lock);
+	}
+
+	d->prev_spare = !next;
+	if (!next)
+		return;
+
+	if (depth + 1 > d->max_depth)
+		d->max_depth = depth + 1;
+	smp_wmb();
+	WRITE_ONCE(d->head, head + 1);
+	if (cpu_online(d->cpu))
+		queue_work_on(d->cpu, dahdi_ec_wq, &d->work);
+	else
+		queue_work(dahdi_ec_wq, &d->work);
+}
+
+static void dahdi_ec_defer_work(struct work_struct *work)
+{
+	struct dahdi_ec_defer *const d =
+			container_of(work, struct dahdi_ec_defer, work);
+	struct dahdi_span *const span = d->span;
+	unsigned int tail = d->tail;
+#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
+	unsigned long flags;
+	int x;
+#endif
+
+	while (tail != READ_ONCE(d->head)) {
+		struct dahdi_ec_slot *const slot =
+				&d->slot[tail % DAHDI_EC_DEFER_DEPTH];
+
+		smp_rmb();
+		memcpy(slot->out, slot->rx, span->channels * DAHDI_CHUNKSIZE);
+#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
+		/*
+		 * The FPU save area is per CPU, so no tick may come in while
+		 * it is used.  Let them in between batches.
+		 */
+		for (x = 0; x < span->channels; x += DAHDI_EC_BATCH) {
+			local_irq_save(flags);
+			__dahdi_ec_span(span, slot, x,
+					min(x + DAHDI_EC_BATCH, span->channels));
+			local_irq_restore(flags);
+		}
+#else
+		__dahdi_ec_span(span, slot, 0, span->channels);
+#endif
+		/* Done with the slot, and slot->out is ready */
+		smp_mb();
+		WRITE_ONCE(d->tail, ++tail);
+	}
+}
+
+/**
+ * dahdi_ec_span() - process echo for all channels in a span.
+ * @span:	DAHDI span
+ *
+ * Similar to calling dahdi_ec_chunk() for each of the channels in the
+ * span. Uses dahdi_chunk.write_chunk for the rxchunk (the chunk to fix)
+ * and dahdi_chan.readchunk as the txchunk (the reference chunk).
+ *
+ * Channels whose echo canceller provides echocan_process_batch are handed
+ * to it together, DAHDI_EC_BATCH at a time.
+ *
+ * If echo cancellation is deferred on the span, this only queues the chunks
+ * for the worker and, on the channels with an echo canceller, returns the
+ * ones of the previous call in their place.
+ */
+void _dahdi_ec_span(struct dahdi_span *span)
+{
+	struct dahdi_ec_defer *d;
+
+	rcu_read_lock();
+	d = rcu_dereference(span->ec_defer);
+	if (d) {
+		__dahdi_ec_defer(span, d);
+		rcu_read_unlock();
+		return;
+	}
+	rcu_read_unlock();
+
+	__dahdi_ec_span(span, NULL, 0, span->channels);
+}
+EXPORT_SYMBOL(_dahdi_ec_span);
+
+static DEFINE_MUTEX(ec_defer_mutex);
+
+/* Spread spans over the online CPUs of the card's node, if it has any */
+static int dahdi_ec_defer_cpu(const struct dahdi_span *span)
+{
+	const int nid = dahdi_span_node(span);
+	const struct cpumask *mask = cpu_online_mask;
+	int n = 0, cpu;
+
+	if (nid != NUMA_NO_NODE &&
+	    cpumask_intersects(cpumask_of_node(nid), cpu_online_mask))
+		mask = cpumask_of_node(nid);
+
+	/* The node's mask has its offline CPUs in it as well */
+	for_each_cpu_and(cpu, mask, cpu_online_mask)
+		n++;
+	n = span->spanno % n;
+	for_each_cpu_and(cpu, mask, cpu_online_mask) {
+		if (!n--)
+			return cpu;
+	}
+	return raw_smp_processor_id();
+}
+
+static int dahdi_ec_defer_start(struct dahdi_span *span)
+{
+	const size_t len = span->channels * DAHDI_CHUNKSIZE;
+	struct dahdi_ec_defer *d;
+	u8 *buf;
+	int x;
+
+	mutex_lock(&ec_defer_mutex);
+	if (span->ec_defer || !span->channels ||
+	    !test_bit(DAHDI_FLAGBIT_REGISTERED, &span->flags)) {
+		mutex_unlock(&ec_defer_mutex);
+		return 0;
+	}
+
+	d = kzalloc_node(sizeof(*d) + (3 * DAHDI_EC_DEFER_DEPTH + 1) * len,
+			 GFP_KERNEL, dahdi_span_node(span));
+	if (!d) {
+		mutex_unlock(&ec_defer_mutex);
+		return -ENOMEM;
+	}
+
+	d->span = span;
+	INIT_WORK(&d->work, dahdi_ec_defer_work);
+	d->cpu = dahdi_ec_defer_cpu(span);
+	buf = d->buf;
+	for (x = 0; x < DAHDI_EC_DEFER_DEPTH; x++) {
+		d->slot[x].rx = buf;
+		d->slot[x].tx = buf + len;
+		d->slot[x].out = buf + 2 * len;
+		buf += 3 * len;
+	}
+
+	/* The first tick hands up silence */
+	d->spare = buf;
+	d->prev_spare = true;
+	for (x = 0; x < span->channels; x++) {
+		memset(d->spare + x * DAHDI_CHUNKSIZE,
+		       DAHDI_LIN2X(0, span->chans[x]), DAHDI_CHUNKSIZE);
+	}
+
+	rcu_assign_pointer(span->ec_defer, d);
+	mutex_unlock(&ec_defer_mutex);
+	return 0;
+}
+
+static void dahdi_ec_defer_stop(struct dahdi_span *span)
+{
+	struct dahdi_ec_defer *d;
+
+	mutex_lock(&ec_defer_mutex);
+	d = span->ec_defer;
+	if (d) {
+		rcu_assign_pointer(span->ec_defer, NULL);
+		/* No tick can queue the work anymore after this */
+		synchronize_rcu();
+		cancel_work_sync(&d->work);
+		kfree(d);
+	}
+	mutex_unlock(&ec_defer_mutex);
+}
+
+/**
+ * dahdi_span_set_ec_defer() - Move software echo cancellation off the tick.
+ * @span:	An assigned span.
+ * @enable:	Non zero to run the span's echo cancellers on a worker.
+ *
+ * Deferring adds one chunk of delay to everything the span receives.
+ */
+int dahdi_span_set_ec_defer(struct dahdi_span *span, int enable)
+{
+	if (!test_bit(DAHDI_FLAGBIT_REGISTERED, &span->flags))
+		return -ENODEV;
+	if (!enable) {
+		dahdi_ec_defer_stop(span);
+		return 0;
+	}
+	return dahdi_ec_defer_start(span);
+}
+
+int dahdi_span_ec_defer_stats(struct dahdi_span *span, char *buf)
+{
+	const struct dahdi_ec_defer *d;
+	int len;
+
+	rcu_read_lock();
+	d = rcu_dereference(span->ec_defer);
+	if (d) {
+		len = sprintf(buf, "latency_us: %d\ndepth: %u\n"
+			      "max_depth: %u\nlate: %lu\noverruns: %lu\n",
+			      DAHDI_CHUNKSIZE * 1000 / 8,
+			      READ_ONCE(d->head) - READ_ONCE(d->tail),
+			      d->max_depth, d->late, d->overruns);
+	} else {
+		len = sprintf(buf, "latency_us: 0\n");
+	}
+	rcu_read_unlock();
+	return len;
+}
+
+/*
+ * Deframe what the tick queued for chan and encode enough ahead to cover the
+ * next DAHDI_HDLC_DEFER_TICKS, for each member of its bundle.  Called with
+ * chan->lock held.
+ */
+static void __dahdi_hdlc_defer_chan(struct dahdi_hdlc_defer *d,
+				    struct dahdi_chan *chan,
+				    struct dahdi_hdlc_line *line)
+{
+	u8 buf[256];
+	unsigned int n, used, target;
+	struct dahdi_chan *slave;
+
+	__dahdi_hdlc_defer_deframe(chan, &line->rx);
+	if (READ_ONCE(d->draining))
+		return;
+
+	target = 0;
+	for (slave = chan; slave; slave = slave->nextslave)
+		target += DAHDI_HDLC_DEFER_TICKS * DAHDI_CHUNKSIZE;
+	target = min(target, line->tx.depth);
+
+	while ((used = dahdi_ring_used(&line->tx)) < target) {
+		n = min_t(unsigned int, target - used, sizeof(buf));
+		__dahdi_getbuf(chan, buf, n);
+		dahdi_ring_put(&line->tx, buf, n);
+		dahdi_ring_produce(&line->tx, n);
+	}
+}
+
+static void dahdi_hdlc_defer_run(struct dahdi_hdlc_defer *d)
+{
+	struct dahdi_span *const span = d->span;
+	unsigned long flags;
+	int x;
+
+	/* Lets the softirqs the deframing raised run once done */
+	local_bh_disable();
+	for (x = 0; x < span->channels; x++) {
+		struct dahdi_chan *const chan = span->chans[x];
+		struct dahdi_hdlc_line *const line = &d->line[x];
+
+		spin_lock_irqsave(&chan->lock, flags);
+		if (dahdi_hdlc_deferrable(chan)) {
+			__dahdi_hdlc_defer_chan(d, chan, line);
+		} else if (dahdi_ring_used(&line->rx) ||
+			   dahdi_ring_used(&line->tx)) {
+			/* Left HDLC mode, the queued line data is stale */
+			line->rx.head = line->rx.tail = 0;
+			line->tx.head = line->tx.tail = 0;
+		}
+		spin_unlock_irqrestore(&chan->lock, flags);
+	}
+#ifdef CONFIG_DAHDI_PPP
+	dahdi_ppp_batch_kick(&span->ppp);
+#endif
+	local_bh_enable();
+	d->runs++;
+}
+
+static int dahdi_hdlc_defer_thread(void *data)
+{
+	struct dahdi_hdlc_defer *const d = data;
 
-	if (events.bit.NLP_auto_disabled) {
-		dahdi_qevent_nolock(chan, DAHDI_EVENT_EC_NLP_DISABLED);
-		chan->ec_state->status.mode = ECHO_MODE_FAX;
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+		if (!xchg(&d->kick, 0)) {
+			schedule();
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+		dahdi_hdlc_defer_run(d);
 	}
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
 
-	if (events.bit.NLP_auto_enabled) {
-		dahdi_qevent_nolock(chan, DAHDI_EVENT_EC_NLP_ENABLED);
-		chan->ec_state->status.mode = ECHO_MODE_ACTIVE;
+/* Called from the span's tick, wakes the thread every half of its lead */
+static void dahdi_hdlc_defer_kick(struct dahdi_span *span)
+{
+	struct dahdi_hdlc_defer *d;
+
+	rcu_read_lock();
+	d = rcu_dereference(span->hdlc_defer);
+	if (d && d->queued && (++d->ticks >= DAHDI_HDLC_DEFER_TICKS / 2)) {
+		d->ticks = 0;
+		d->queued = false;
+		WRITE_ONCE(d->kick, 1);
+		wake_up_process(d->task);
 	}
+	rcu_read_unlock();
 }
 
-/**
- * __dahdi_ec_chunk() - process echo for a single channel
- * @ss:		DAHDI channel
- * @rxchunk:	buffer to store audio with cancelled audio
- * @preecchunk: chunk of audio on which to cancel echo
- * @txchunk:	reference chunk from the other direction
- *
- * The echo canceller function fixes received (from device to userspace)
- * audio. In order to fix it it uses the transmitted audio as a
- * reference. This call updates the echo canceller for a single chunk (8
- * bytes).
- *
- * Call with local interrupts disabled.
- */
-void __dahdi_ec_chunk(struct dahdi_chan *ss, u8 *rxchunk,
-		      const u8 *preecchunk, const u8 *txchunk)
+static DEFINE_MUTEX(hdlc_defer_mutex);
+
+static int dahdi_hdlc_defer_start(struct dahdi_span *span)
 {
-	short rxlin;
-	int x;
+	const int nid = dahdi_span_node(span);
+	struct dahdi_hdlc_defer *d;
+	u8 *buf;
+	int x, res;
 
-	spin_lock(&ss->lock);
+	mutex_lock(&hdlc_defer_mutex);
+	if (span->hdlc_defer || !span->channels ||
+	    !test_bit(DAHDI_FLAGBIT_REGISTERED, &span->flags)) {
+		mutex_unlock(&hdlc_defer_mutex);
+		return 0;
+	}
 
-	if (ss->readchunkpreec) {
-		/* Save a copy of the audio before the echo can has its way with it */
-		for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-			/* We only ever really need to deal with signed linear - let's just convert it now */
-			ss->readchunkpreec[x] = DAHDI_XLAW(preecchunk[x], ss);
+	d = kzalloc_node(sizeof(*d) + span->channels * sizeof(d->line[0]),
+			 GFP_KERNEL, nid);
+	buf = kzalloc_node(span->channels * 2 * DAHDI_HDLC_DEFER_RING,
+			   GFP_KERNEL, nid);
+	if (!d || !buf) {
+		kfree(buf);
+		kfree(d);
+		mutex_unlock(&hdlc_defer_mutex);
+		return -ENOMEM;
 	}
 
-	/* Perform echo cancellation on a chunk if necessary */
-	if (ss->ec_state) {
-#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
-		dahdi_kernel_fpu_begin();
+	d->span = span;
+	d->buf = buf;
+	for (x = 0; x < span->channels; x++) {
+		dahdi_ring_init(&d->line[x].rx, buf, DAHDI_HDLC_DEFER_RING,
+				DAHDI_HDLC_DEFER_RING);
+		buf += DAHDI_HDLC_DEFER_RING;
+		dahdi_ring_init(&d->line[x].tx, buf, DAHDI_HDLC_DEFER_RING,
+				DAHDI_HDLC_DEFER_RING);
+		buf += DAHDI_HDLC_DEFER_RING;
+	}
+
+	d->task = kthread_create_on_node(dahdi_hdlc_defer_thread, d, nid,
+					 "dahdi_hdlc/%d", span->spanno);
+	if (IS_ERR(d->task)) {
+		res = PTR_ERR(d->task);
+		kfree(d->buf);
+		kfree(d);
+		mutex_unlock(&hdlc_defer_mutex);
+		return res;
+	}
+	d->cpu = dahdi_ec_defer_cpu(span);
+	kthread_bind(d->task, d->cpu);
+	/* It stands in for work the interrupt handler used to do */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	sched_set_fifo_low(d->task);
+#else
+	{
+		struct sched_param param = { .sched_priority = 1 };
+		sched_setscheduler(d->task, SCHED_FIFO, &param);
+	}
 #endif
-		if (ss->ec_state->status.mode & __ECHO_MODE_MUTE) {
-			/* Special stuff for training the echo can */
-			for (x=0;x<DAHDI_CHUNKSIZE;x++) {
-				rxlin = DAHDI_XLAW(preecchunk[x], ss);
-				if (ss->ec_state->status.mode == ECHO_MODE_PRETRAINING) {
-					if (--ss->ec_state->status.pretrain_timer <= 0) {
-						ss->ec_state->status.pretrain_timer = 0;
-						ss->ec_state->status.mode = ECHO_MODE_STARTTRAINING;
-					}
-				}
-				if (ss->ec_state->status.mode == ECHO_MODE_AWAITINGECHO) {
-					ss->ec_state->status.last_train_tap = 0;
-					ss->ec_state->status.mode = ECHO_MODE_TRAINING;
-				}
-				if ((ss->ec_state->status.mode == ECHO_MODE_TRAINING) &&
-				    (ss->ec_state->ops->echocan_traintap)) {
-					if (ss->ec_state->ops->echocan_traintap(ss->ec_state, ss->ec_state->status.last_train_tap++, rxlin)) {
-						ss->ec_state->status.mode = ECHO_MODE_ACTIVE;
-					}
-				}
-				rxlin = 0;
-				rxchunk[x] = DAHDI_LIN2X((int)rxlin, ss);
-			}
-		} else if (ss->ec_state->status.mode != ECHO_MODE_IDLE) {
-			ss->ec_state->events.all = 0;
-
-			if (ss->ec_state->ops->echocan_process) {
-				short rxlins[DAHDI_CHUNKSIZE], txlins[DAHDI_CHUNKSIZE];
 
-				for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
-					rxlins[x] = DAHDI_XLAW(preecchunk[x],
-							       ss);
-					txlins[x] = DAHDI_XLAW(txchunk[x], ss);
-				}
-				ss->ec_state->ops->echocan_process(ss->ec_state, rxlins, txlins, DAHDI_CHUNKSIZE);
+	rcu_assign_pointer(span->hdlc_defer, d);
+	/* Encode ahead right away, now that the tick takes from the rings */
+	d->kick = 1;
+	wake_up_process(d->task);
+	mutex_unlock(&hdlc_defer_mutex);
+	return 0;
+}
 
-				for (x = 0; x < DAHDI_CHUNKSIZE; x++)
-					rxchunk[x] = DAHDI_LIN2X((int) rxlins[x], ss);
-			} else if (ss->ec_state->ops->echocan_events)
-				ss->ec_state->ops->echocan_events(ss->ec_state);
+/* True once the tick has sent everything the thread encoded ahead */
+static bool dahdi_hdlc_defer_drained(struct dahdi_hdlc_defer *d)
+{
+	struct dahdi_span *const span = d->span;
+	unsigned long flags;
+	bool drained = true;
+	int x;
 
-			if (ss->ec_state->events.all)
-				process_echocan_events(ss);
+	for (x = 0; x < span->channels && drained; x++) {
+		struct dahdi_chan *const chan = span->chans[x];
 
-		}
-#if defined(CONFIG_DAHDI_MMX) || defined(ECHO_CAN_FP)
-		dahdi_kernel_fpu_end();
-#endif
+		spin_lock_irqsave(&chan->lock, flags);
+		if (dahdi_hdlc_deferrable(chan) &&
+		    dahdi_ring_used(&d->line[x].tx))
+			drained = false;
+		spin_unlock_irqrestore(&chan->lock, flags);
 	}
+	return drained;
+}
 
-	spin_unlock(&ss->lock);
+static void dahdi_hdlc_defer_stop(struct dahdi_span *span)
+{
+	struct dahdi_hdlc_defer *d;
+	int tries;
+
+	mutex_lock(&hdlc_defer_mutex);
+	d = span->hdlc_defer;
+	if (d) {
+		/*
+		 * Let the tick send what was encoded ahead before it frames
+		 * on its own again.  A span that stopped ticking has nothing
+		 * in flight, so do not wait for it for long.
+		 */
+		WRITE_ONCE(d->draining, true);
+		for (tries = 0; tries < 2 * DAHDI_HDLC_DEFER_TICKS &&
+		     !dahdi_hdlc_defer_drained(d); tries++)
+			msleep(1);
+		rcu_assign_pointer(span->hdlc_defer, NULL);
+		/* No tick can queue or wake anymore after this */
+		synchronize_rcu();
+		kthread_stop(d->task);
+		kfree(d->buf);
+		kfree(d);
+	}
+	mutex_unlock(&hdlc_defer_mutex);
 }
-EXPORT_SYMBOL(__dahdi_ec_chunk);
 
 /**
- * dahdi_ec_span() - process echo for all channels in a span.
- * @span:	DAHDI span
+ * dahdi_span_set_hdlc_defer() - Move HDLC framing off the tick.
+ * @span:	An assigned span.
+ * @enable:	Non zero to frame and deframe the span's HDLC channels on a
+ *		kernel thread.
  *
- * Similar to calling dahdi_ec_chunk() for each of the channels in the
- * span. Uses dahdi_chunk.write_chunk for the rxchunk (the chunk to fix)
- * and dahdi_chan.readchunk as the txchunk (the reference chunk).
+ * Deferring adds up to DAHDI_HDLC_DEFER_TICKS of delay in each direction.
+ * Turning it off waits for what was already encoded to be sent.
  */
-void _dahdi_ec_span(struct dahdi_span *span)
+int dahdi_span_set_hdlc_defer(struct dahdi_span *span, int enable)
 {
-	int x;
-	for (x = 0; x < span->channels; x++) {
-		struct dahdi_chan *const chan = span->chans[x];
-		if (!chan->ec_current)
-			continue;
-		_dahdi_ec_chunk(chan, chan->readchunk, chan->writechunk);
+	if (!test_bit(DAHDI_FLAGBIT_REGISTERED, &span->flags))
+		return -ENODEV;
+	if (!enable) {
+		dahdi_hdlc_defer_stop(span);
+		return 0;
 	}
+	return dahdi_hdlc_defer_start(span);
+}
+
+int dahdi_span_hdlc_defer_stats(struct dahdi_span *span, char *buf)
+{
+	const struct dahdi_hdlc_defer *d;
+	int len;
+
+	rcu_read_lock();
+	d = rcu_dereference(span->hdlc_defer);
+	if (d) {
+		len = sprintf(buf, "latency_us: %d\ncpu: %d\nruns: %lu\n"
+			      "rx_overruns: %lu\ntx_underruns: %lu\n",
+			      DAHDI_HDLC_DEFER_TICKS * DAHDI_CHUNKSIZE * 1000 / 8,
+			      d->cpu, d->runs, d->rx_overruns, d->tx_underruns);
+	} else {
+		len = sprintf(buf, "latency_us: 0\n");
+	}
+	rcu_read_unlock();
+	return len;
 }
-EXPORT_SYMBOL(_dahdi_ec_span);
 
 /* return 0 if nothing detected, 1 if lack of tone, 2 if presence of tone */
 /* modifies buffer pointed to by 'amp' with notched-out values */
@@ -9100,7 +11783,47 @@ static inline void __dahdi_process_putaudio_chunk(struct dahdi_chan *ss, unsigne
 }
 
 /* HDLC (or other) receiver buffer functions for read side */
-static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
+/**
+ * __dahdi_ring_receive() - Queue received stream data for read().
+ *
+ * Called with ms->lock held.  Returns how many of the bytes fit.
+ */
+static int __dahdi_ring_receive(struct dahdi_chan *ms, const unsigned char *rxb,
+				int bytes)
+{
+	struct dahdi_ring *const ring = &ms->rxring;
+	const unsigned int used = dahdi_ring_used(ring);
+	unsigned int left;
+
+	if (!ring->buf)
+		return 0;
+	left = min_t(unsigned int, ring->depth - used, bytes);
+	/* Do not overwrite anything before the reader is done with it */
+	smp_mb();
+	dahdi_ring_put(ring, rxb, left);
+	dahdi_ring_produce(ring, left);
+
+	/* Notify a blocked reader once a whole block is waiting */
+	if ((used < ms->blocksize) && (used + left >= ms->blocksize))
+		wake_up_interruptible(&ms->waitq);
+	return left;
+}
+
+static void __dahdi_rx_overrun(struct dahdi_chan *ms, bool overrun)
+{
+	if (overrun) {
+		if (!test_bit(DAHDI_FLAGBIT_RXOVERRUN, &ms->flags)) {
+			if (test_bit(DAHDI_FLAGBIT_BUFEVENTS, &ms->flags))
+				__qevent(ms, DAHDI_EVENT_READ_OVERRUN);
+			set_bit(DAHDI_FLAGBIT_RXOVERRUN, &ms->flags);
+		}
+	} else {
+		clear_bit(DAHDI_FLAGBIT_RXOVERRUN, &ms->flags);
+	}
+}
+
+static void __putbuf_chunk(struct dahdi_chan *ss, const unsigned char *rxb,
+			   int bytes)
 {
 	/* We transmit data from our master channel */
 	/* Called with ss->lock held */
@@ -9117,6 +11840,22 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 	int res;
 	int left, x;
 
+	if (!dahdi_chan_framed(ms)) {
+		/* Whatever does not fit in the ring is an overrun */
+		bytes -= __dahdi_ring_receive(ms, rxb, bytes);
+		__dahdi_rx_overrun(ms, bytes);
+		return;
+	}
+
+#ifdef CONFIG_DAHDI_NET
+	if (dahdi_have_netdev(ms) && (ms->flags & DAHDI_FLAG_HDLC) &&
+	    ms->blocksize) {
+		x = __dahdi_net_putbuf(ms, rxb, bytes);
+		rxb += x;
+		bytes -= x;
+	}
+#endif
+
 	while(bytes) {
 #if defined(CONFIG_DAHDI_NET)  || defined(CONFIG_DAHDI_PPP)
 		skb = NULL;
@@ -9131,49 +11870,41 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 			if (left > bytes)
 				left = bytes;
 			if (ms->flags & DAHDI_FLAG_HDLC) {
-				for (x=0;x<left;x++) {
-					/* Handle HDLC deframing */
-					fasthdlc_rx_load_nocheck(&ms->rxhdlc, *(rxb++));
-					bytes--;
-					res = fasthdlc_rx_run(&ms->rxhdlc);
-					/* If there is nothing there, continue */
-					if (res & RETURN_EMPTY_FLAG)
-						continue;
-					else if (res & RETURN_COMPLETE_FLAG) {
-						/* Only count this if it's a non-empty frame */
-						if (ms->readidx[ms->inreadbuf]) {
-							if ((ms->flags & DAHDI_FLAG_FCS) && (ms->infcs != PPP_GOODFCS)) {
-								abort = DAHDI_EVENT_BADFCS;
-							} else
-								eof=1;
-							break;
-						}
-						continue;
-					} else if (res & RETURN_DISCARD_FLAG) {
-						/* This could be someone idling with
-						  "idle" instead of "flag" */
-						if (!ms->readidx[ms->inreadbuf])
-							continue;
-						abort = DAHDI_EVENT_ABORT;
-						break;
-					} else {
-						unsigned char rxc;
-						rxc = res;
-						ms->infcs = PPP_FCS(ms->infcs, rxc);
-						buf[ms->readidx[ms->inreadbuf]++] = rxc;
-						/* Pay attention to the possibility of an overrun */
-						if (ms->readidx[ms->inreadbuf] >= ms->blocksize) {
-							if (!ss->span->alarms)
-								module_printk(KERN_WARNING, "HDLC Receiver overrun on channel %s (master=%s)\n", ss->name, ss->master->name);
-							abort=DAHDI_EVENT_OVERRUN;
-							/* Force the HDLC state back to frame-search mode */
-							ms->rxhdlc.state = 0;
-							ms->rxhdlc.bits = 0;
-							ms->readidx[ms->inreadbuf]=0;
-							break;
+				/* Handle HDLC deframing, up to the end of a frame */
+				res = fasthdlc_rx_decode(&ms->rxhdlc, &rxb, &bytes,
+						buf + ms->readidx[ms->inreadbuf],
+						ms->blocksize - ms->readidx[ms->inreadbuf]);
+				ms->readidx[ms->inreadbuf] += res & RETURN_LEN_MASK;
+				if (res & RETURN_COMPLETE_FLAG) {
+					/* Only count this if it's a non-empty frame */
+					if (ms->readidx[ms->inreadbuf]) {
+						/* The FCS of the whole frame, at once */
+						if ((ms->flags & DAHDI_FLAG_FCS) &&
+						    (dahdi_fcs16(PPP_INITFCS, buf, ms->readidx[ms->inreadbuf]) != PPP_GOODFCS)) {
+							abort = DAHDI_EVENT_BADFCS;
+						} else {
+							eof=1;
+							__dahdi_hdlc_count_frame(ms, DAHDI_HDLC_RX_FRAMES,
+										 ms->readidx[ms->inreadbuf]);
 						}
 					}
+				} else if (res & RETURN_DISCARD_FLAG) {
+					/* This could be someone idling with
+					  "idle" instead of "flag" */
+					if (ms->readidx[ms->inreadbuf])
+						abort = DAHDI_EVENT_ABORT;
+				} else if (ms->readidx[ms->inreadbuf] >= ms->blocksize) {
+					/* Pay attention to the possibility of an overrun */
+					if (!ss->span->alarms)
+						module_printk(KERN_WARNING, "HDLC Receiver overrun on channel %s (master=%s)\n", ss->name, ss->master->name);
+					abort=DAHDI_EVENT_OVERRUN;
+					/* Force the HDLC state back to frame-search mode */
+					ms->rxhdlc.state = 0;
+					ms->rxhdlc.bits = 0;
+					ms->readidx[ms->inreadbuf]=0;
 				}
+				if (abort)
+					__dahdi_hdlc_count_abort(ms, abort);
 			} else {
 				/* Not HDLC */
 				memcpy(buf + ms->readidx[ms->inreadbuf], rxb, left);
@@ -9190,7 +11921,6 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 			if (eof)  {
 				/* Finished with this buffer, try another. */
 				oldbuf = ms->inreadbuf;
-				ms->infcs = PPP_INITFCS;
 				ms->readn[ms->inreadbuf] = ms->readidx[ms->inreadbuf];
 #ifdef CONFIG_DAHDI_DEBUG
 				module_printk(KERN_NOTICE, "EOF, len is %d\n", ms->readn[ms->inreadbuf]);
@@ -9208,7 +11938,7 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 						ms->readn[ms->inreadbuf] -= 2;
 						/* Allocate an SKB */
 #ifdef CONFIG_DAHDI_PPP
-						if (!ms->do_ppp_error)
+						if (!test_bit(DAHDI_PPP_ERROR, &ms->ppp_events))
 #endif
 							skb = dev_alloc_skb(ms->readn[ms->inreadbuf] + 2);
 						if (skb) {
@@ -9227,6 +11957,7 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 #endif
 
 						} else {
+							__dahdi_hdlc_count(ms, DAHDI_HDLC_RX_DROPPED, 1);
 #ifdef CONFIG_DAHDI_NET
 							if (dahdi_have_netdev(ms)) {
 								struct net_device_stats *stats = hdlc_stats(ms->hdlcnetdev->netdev);
@@ -9240,7 +11971,7 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 #endif
 #if 1
 #ifdef CONFIG_DAHDI_PPP
-							if (!ms->do_ppp_error)
+							if (!test_bit(DAHDI_PPP_ERROR, &ms->ppp_events))
 #endif
 								module_printk(KERN_NOTICE, "Memory squeeze, dropped one\n");
 #endif
@@ -9253,24 +11984,12 @@ static void __putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 				} else
 #endif
 				{
-					/* This logic might confuse and astound.  Basically we need to find
-					 * the previous buffer index.  It should be safe because, regardless
-					 * of whether or not it has been copied to user space, nothing should
-					 * have messed around with it since then */
-
-					int comparemessage;
-					/* Shut compiler up */
-					int myres = 0;
-
-					if (ms->flags & DAHDI_FLAG_MTP2) {
-						comparemessage = (ms->inreadbuf - 1) & (ms->numbufs - 1);
-
-						myres = memcmp(ms->readbuf[comparemessage], ms->readbuf[ms->inreadbuf], ms->readn[ms->inreadbuf]);
-					}
-
-					if ((ms->flags & DAHDI_FLAG_MTP2) && !myres) {
-						/* Our messages are the same, so discard -
+					if ((ms->flags & (DAHDI_FLAG_MTP2 | DAHDI_FLAG_MTP2RX)) &&
+					    __dahdi_mtp2_rx_repeat(ms, ms->readbuf[ms->inreadbuf],
+								   ms->readn[ms->inreadbuf])) {
+						/* Same as the last one, so discard -
 						 * 	Don't advance buffers, reset indexes and buffer sizes. */
+						__dahdi_hdlc_count(ms, DAHDI_HDLC_RX_SUPPRESSED, 1);
 						ms->readn[ms->inreadbuf] = 0;
 						ms->readidx[ms->inreadbuf] = 0;
 					} else {
@@ -9315,7 +12034,6 @@ that the waitqueue is empty. */
 			if (abort) {
 				/* Start over reading frame */
 				ms->readidx[ms->inreadbuf] = 0;
-				ms->infcs = PPP_INITFCS;
 
 #ifdef CONFIG_DAHDI_NET
 				if (dahdi_have_netdev(ms)) {
@@ -9331,8 +12049,11 @@ that the waitqueue is empty. */
 #endif
 #ifdef CONFIG_DAHDI_PPP
 				if (ms->flags & DAHDI_FLAG_PPP) {
-					ms->do_ppp_error = 1;
-					tasklet_schedule(&ms->ppp_calls);
+					if (ms->ppp) {
+						set_bit(DAHDI_PPP_ERROR,
+							&ms->ppp_events);
+						__dahdi_ppp_pend(ms);
+					}
 				} else
 #endif
 					if (test_bit(DAHDI_FLAGBIT_OPEN, &ms->flags) && !ss->span->alarms) {
@@ -9340,21 +12061,14 @@ that the waitqueue is empty. */
 						__qevent(ss->master, abort);
 					}
 			}
-		} else /* No place to receive -- drop on the floor */
+		} else { /* No place to receive -- drop on the floor */
+			if (ms->flags & DAHDI_FLAG_HDLC)
+				__dahdi_hdlc_rx_nobuf(ms, rxb, bytes);
 			break;
+		}
 #ifdef CONFIG_DAHDI_NET
 		if (skb && dahdi_have_netdev(ms))
-		{
-			skb_reset_mac_header(skb);
-			skb->dev = chan_to_netdev(ms);
-#ifdef DAHDI_HDLC_TYPE_TRANS
-			skb->protocol = hdlc_type_trans(skb,
-							chan_to_netdev(ms));
-#else
-			skb->protocol = htons (ETH_P_HDLC);
-#endif
-			netif_rx(skb);
-		}
+			dahdi_net_rx(ms, skb);
 #endif
 #ifdef CONFIG_DAHDI_PPP
 		if (skb && (ms->flags & DAHDI_FLAG_PPP)) {
@@ -9366,28 +12080,28 @@ that the waitqueue is empty. */
 				/* Invalid SKB -- drop */
 				if (tmp)
 					module_printk(KERN_NOTICE, "Received invalid SKB (%02x, %02x)\n", tmp[0], tmp[1]);
+				__dahdi_hdlc_count(ms, DAHDI_HDLC_RX_DROPPED, 1);
+				dev_kfree_skb_irq(skb);
+			} else if (!ms->ppp ||
+				   skb_queue_len(&ms->ppp_rq) >= DAHDI_PPP_RXQ_LEN) {
+				ms->ppp_rx_dropped++;
+				__dahdi_hdlc_count(ms, DAHDI_HDLC_RX_DROPPED, 1);
 				dev_kfree_skb_irq(skb);
 			} else {
 				skb_queue_tail(&ms->ppp_rq, skb);
-				tasklet_schedule(&ms->ppp_calls);
+				__dahdi_ppp_pend(ms);
 			}
 		}
 #endif
 	}
 
-	if (bytes) {
-		if (!test_bit(DAHDI_FLAGBIT_RXOVERRUN, &ms->flags)) {
-			if (test_bit(DAHDI_FLAGBIT_BUFEVENTS, &ms->flags))
-				__qevent(ms, DAHDI_EVENT_READ_OVERRUN);
-			set_bit(DAHDI_FLAGBIT_RXOVERRUN, &ms->flags);
-		}
-	} else {
-		clear_bit(DAHDI_FLAGBIT_RXOVERRUN, &ms->flags);
-	}
+	__dahdi_rx_overrun(ms, bytes);
 }
 
 static inline void __dahdi_putbuf_chunk(struct dahdi_chan *ss, unsigned char *rxb)
 {
+	if (dahdi_hdlc_deferrable(ss) && __dahdi_hdlc_defer_rx(ss, rxb))
+		return;
 	__putbuf_chunk(ss, rxb, DAHDI_CHUNKSIZE);
 
 #ifdef CONFIG_DAHDI_MIRROR
@@ -9401,6 +12115,7 @@ static inline void __dahdi_putbuf_chunk(struct dahdi_chan *ss, unsigned char *rx
 
 static void __dahdi_hdlc_abort(struct dahdi_chan *ss, int event)
 {
+	__dahdi_hdlc_count_abort(ss, event);
 	if (ss->inreadbuf >= 0)
 		ss->readidx[ss->inreadbuf] = 0;
 	if (test_bit(DAHDI_FLAGBIT_OPEN, &ss->flags) && !ss->span->alarms)
@@ -9425,6 +12140,7 @@ void dahdi_hdlc_putbuf(struct dahdi_chan *ss, unsigned char *rxb, int bytes)
 #ifdef CONFIG_DAHDI_DEBUG
 		module_printk(KERN_NOTICE, "No place to receive HDLC frame\n");
 #endif
+		__dahdi_hdlc_count(ss, DAHDI_HDLC_RX_NOBUF, bytes);
 		spin_unlock_irqrestore(&ss->lock, flags);
 		return;
 	}
@@ -9472,6 +12188,17 @@ void dahdi_hdlc_finish(struct dahdi_chan *ss)
 	}
 
 	ss->readn[ss->inreadbuf] = ss->readidx[ss->inreadbuf];
+	__dahdi_hdlc_count_frame(ss, DAHDI_HDLC_RX_FRAMES,
+				 ss->readn[ss->inreadbuf]);
+	if ((ss->flags & (DAHDI_FLAG_MTP2 | DAHDI_FLAG_MTP2RX)) &&
+	    __dahdi_mtp2_rx_repeat(ss, ss->readbuf[ss->inreadbuf],
+				   ss->readn[ss->inreadbuf])) {
+		__dahdi_hdlc_count(ss, DAHDI_HDLC_RX_SUPPRESSED, 1);
+		ss->readn[ss->inreadbuf] = 0;
+		ss->readidx[ss->inreadbuf] = 0;
+		spin_unlock_irqrestore(&ss->lock, flags);
+		return;
+	}
 	ss->inreadbuf = (ss->inreadbuf + 1) % ss->numbufs;
 	if (ss->inreadbuf == ss->outreadbuf) {
 		ss->inreadbuf = -1;
@@ -9497,7 +12224,24 @@ int dahdi_hdlc_getbuf(struct dahdi_chan *ss, unsigned char *bufptr, unsigned int
 	int oldbuf;
 
 	spin_lock_irqsave(&ss->lock, flags);
-	if (ss->outwritebuf > -1) {
+	if (ss->txrepeat.idx ||
+	    ((ss->outwritebuf < 0) && __dahdi_txrepeat_ready(ss))) {
+		struct dahdi_txrepeat *const r = &ss->txrepeat;
+
+		/* Nothing queued, send the repeat frame less its FCS */
+		left = r->len[r->cur] - 2 - r->idx;
+		if (left <= *size) {
+			*size = left;
+			res = 1;
+		} else
+			res = 0;
+		memcpy(bufptr, r->frame[r->cur] + r->idx, *size);
+		r->idx += *size;
+		if (res) {
+			r->idx = 0;
+			__dahdi_hdlc_count(ss, DAHDI_HDLC_TX_REPEATED, 1);
+		}
+	} else if (ss->outwritebuf > -1) {
 		buf = ss->writebuf[ss->outwritebuf];
 		left = ss->writen[ss->outwritebuf] - ss->writeidx[ss->outwritebuf];
 		/* Strip off the empty HDLC CRC end */
@@ -9514,6 +12258,8 @@ int dahdi_hdlc_getbuf(struct dahdi_chan *ss, unsigned char *bufptr, unsigned int
 		if (res) {
 			/* Rotate buffers */
 			oldbuf = ss->outwritebuf;
+			__dahdi_hdlc_count_frame(ss, DAHDI_HDLC_TX_FRAMES,
+						 ss->writen[oldbuf]);
 			ss->writeidx[oldbuf] = 0;
 			ss->writen[oldbuf] = 0;
 			ss->outwritebuf = (ss->outwritebuf + 1) % ss->numbufs;
@@ -9610,8 +12356,8 @@ dahdi_chan_poll(struct file *file, struct poll_table_struct *wait_table)
 	poll_wait(file, &c->waitq, wait_table);
 
 	spin_lock_irqsave(&c->lock, flags);
-	ret |= (c->inwritebuf > -1) ? POLLOUT|POLLWRNORM : 0;
-	ret |= (c->outreadbuf > -1) ?  POLLIN|POLLRDNORM : 0;
+	ret |= dahdi_chan_writable(c) ? POLLOUT|POLLWRNORM : 0;
+	ret |= dahdi_chan_readable(c) ?  POLLIN|POLLRDNORM : 0;
 	ret |= (c->eventoutidx != c->eventinidx) ? POLLPRI : 0;
 	spin_unlock_irqrestore(&c->lock, flags);
 
@@ -9775,49 +12521,96 @@ static void __transmit_to_slaves(struct dahdi_chan *const chan)
 	}
 }
 
+/**
+ * __dahdi_tsi_transmit() - Perform all the software cross-connects of a span.
+ *
+ * Only the channels passing robbed bits along need their lock, to keep txsig
+ * in step with what was handed to the driver.
+ */
+static void __dahdi_tsi_transmit(struct dahdi_span *span)
+{
+	const struct dahdi_tsi *tsi;
+	unsigned int i;
+
+	rcu_read_lock();
+	tsi = rcu_dereference(span->tsi);
+	for (i = 0; tsi && (i < tsi->count); i++) {
+		struct dahdi_chan *const chan = tsi->xc[i].dst;
+		const struct dahdi_chan *const src = tsi->xc[i].src;
+
+		memcpy(chan->writechunk, src->readchunk, DAHDI_CHUNKSIZE);
+		if ((chan->sig == DAHDI_SIG_DACS_RBS) &&
+		    (chan->txsig != src->rxsig)) {
+			/* Just set bits for our destination */
+			spin_lock(&chan->lock);
+			chan->txsig = src->rxsig;
+			span->ops->rbsbits(chan, src->rxsig);
+			spin_unlock(&chan->lock);
+		}
+	}
+	rcu_read_unlock();
+}
+
 int _dahdi_transmit(struct dahdi_span *span)
 {
 	unsigned int x;
 
-	for (x=0;x<span->channels;x++) {
+	/* Idle channels just send silence.  Do these first since a channel
+	 * may go idle in the loop below after sending its last samples. */
+	for (x = find_first_zero_bit(span->active, span->channels);
+	     x < span->channels;
+	     x = find_next_zero_bit(span->active, span->channels, x + 1)) {
+		struct dahdi_chan *const chan = span->chans[x];
+		/* The driver transmits for NOSTDTXRX channels itself */
+		if (likely(chan->writechunk) &&
+		    !(chan->flags & DAHDI_FLAG_NOSTDTXRX))
+			memset(chan->writechunk, DAHDI_LIN2X(0, chan),
+			       DAHDI_CHUNKSIZE);
+	}
+
+	for_each_set_bit(x, span->active, span->channels) {
 		struct dahdi_chan *const chan = span->chans[x];
 		spin_lock(&chan->lock);
 		if (unlikely(chan->flags & DAHDI_FLAG_NOSTDTXRX)) {
 			spin_unlock(&chan->lock);
 			continue;
 		}
-		if (chan == chan->master) {
-			if (is_chan_dacsed(chan)) {
-				struct dahdi_chan *const src = chan->dacs_chan;
-				memcpy(chan->writechunk, src->readchunk,
-				       DAHDI_CHUNKSIZE);
-				if (chan->sig == DAHDI_SIG_DACS_RBS) {
-					/* Just set bits for our destination */
-					if (chan->txsig != src->rxsig) {
-						chan->txsig = src->rxsig;
-						span->ops->rbsbits(chan, src->rxsig);
-					}
-				}
-				/* there is no further processing to do for
-				 * DACS channels, so jump to the next channel
-				 * in the span */
-				spin_unlock(&chan->lock);
-				continue;
-			} else if (chan->nextslave) {
+		/* DACSed channels are handled by __dahdi_tsi_transmit() */
+		if ((chan == chan->master) && !is_chan_dacsed(chan)) {
+			if (chan->nextslave) {
 				__transmit_to_slaves(chan);
 			} else {
 				/* Process a normal channel */
 				__dahdi_real_transmit(chan);
 			}
+		}
+		if (__dahdi_chan_idle(chan))
+			clear_bit(x, span->active);
+		spin_unlock(&chan->lock);
+	}
+
+	__dahdi_tsi_transmit(span);
+
+	for_each_set_bit(x, span->txtimers, span->channels) {
+		struct dahdi_chan *const chan = span->chans[x];
+		spin_lock(&chan->lock);
+		if (!(chan->flags & DAHDI_FLAG_NOSTDTXRX) &&
+		    (chan == chan->master) && !is_chan_dacsed(chan)) {
 			if (chan->otimer) {
 				chan->otimer -= DAHDI_CHUNKSIZE;
 				if (chan->otimer <= 0)
 					__rbs_otimer_expire(chan);
 			}
+			if (!chan->otimer)
+				clear_bit(x, span->txtimers);
 		}
 		spin_unlock(&chan->lock);
 	}
 
+#ifdef CONFIG_DAHDI_PPP
+	dahdi_ppp_batch_kick(&span->ppp);
+#endif
+
 	if (span->mainttimer) {
 		span->mainttimer -= DAHDI_CHUNKSIZE;
 		if (span->mainttimer <= 0) {
@@ -9916,6 +12709,8 @@ static void _process_masterspan(void)
 	   activities which touch all sorts of channels */
 	spin_lock(&chan_lock);
 
+	++dahdi_ticks;
+
 	/* Process any timers */
 	process_timers();
 
@@ -9970,6 +12765,9 @@ static void _process_masterspan(void)
 	list_for_each_entry(pseudo, &pseudo_chans, node) {
 		pseudo_rx_audio(&pseudo->chan);
 	}
+#ifdef CONFIG_DAHDI_PPP
+	dahdi_ppp_batch_kick(&pseudo_ppp_batch);
+#endif
 
 	list_for_each_entry(s, &span_list, spans_node) {
 		for (x = 0; x < s->channels; x++) {
@@ -9983,6 +12781,10 @@ static void _process_masterspan(void)
 				__buf_push(&chan->confout, NULL);
 			spin_unlock(&chan->lock);
 		}
+#ifdef CONFIG_DAHDI_PPP
+		/* Conferenced channels may have queued calls above. */
+		dahdi_ppp_batch_kick(&s->ppp);
+#endif
 
 		dahdi_sync_tick(s);
 	}
@@ -10136,6 +12938,59 @@ static inline bool should_skip_receive(const struct dahdi_chan *const chan)
 		is_chan_dacsed(chan));
 }
 
+/**
+ * __dahdi_rx_timers() - Run the receive side hook state timers for a channel.
+ *
+ * Returns true if any of them are still running.  Called with chan->lock held.
+ */
+static bool __dahdi_rx_timers(struct dahdi_chan *chan)
+{
+	if (chan->itimer) {
+		chan->itimer -= DAHDI_CHUNKSIZE;
+		if (chan->itimer <= 0)
+			rbs_itimer_expire(chan);
+	}
+	if (chan->ringdebtimer)
+		chan->ringdebtimer--;
+	if (chan->sig & __DAHDI_SIG_FXS) {
+		if (chan->rxhooksig == DAHDI_RXSIG_RING)
+			chan->ringtrailer = DAHDI_RINGTRAILER;
+		else if (chan->ringtrailer) {
+			chan->ringtrailer -= DAHDI_CHUNKSIZE;
+			/* See if RING trailer is expired */
+			if (!chan->ringtrailer && !chan->ringdebtimer)
+				__qevent(chan, DAHDI_EVENT_RINGOFFHOOK);
+		}
+	}
+	if (chan->pulsetimer) {
+		chan->pulsetimer--;
+		if (chan->pulsetimer <= 0) {
+			if (chan->pulsecount) {
+				if (chan->pulsecount > 12) {
+
+					module_printk(KERN_NOTICE, "Got pulse digit %d on %s???\n",
+				    chan->pulsecount,
+					chan->name);
+				} else if (chan->pulsecount > 11) {
+					__qevent(chan, DAHDI_EVENT_PULSEDIGIT | '#');
+				} else if (chan->pulsecount > 10) {
+					__qevent(chan, DAHDI_EVENT_PULSEDIGIT | '*');
+				} else if (chan->pulsecount > 9) {
+					__qevent(chan, DAHDI_EVENT_PULSEDIGIT | '0');
+				} else {
+					__qevent(chan, DAHDI_EVENT_PULSEDIGIT | ('0' +
+						chan->pulsecount));
+				}
+				chan->pulsecount = 0;
+			}
+		}
+	}
+	if (chan->itimer || chan->ringdebtimer || chan->pulsetimer)
+		return true;
+	return (chan->sig & __DAHDI_SIG_FXS) &&
+		(chan->ringtrailer || (chan->rxhooksig == DAHDI_RXSIG_RING));
+}
+
 int _dahdi_receive(struct dahdi_span *span)
 {
 	unsigned int x;
@@ -10143,7 +12998,8 @@ int _dahdi_receive(struct dahdi_span *span)
 #ifdef CONFIG_DAHDI_WATCHDOG
 	span->watchcounter--;
 #endif
-	for (x = 0; x < span->channels; x++) {
+	/* Nothing to do with the audio received on idle channels. */
+	for_each_set_bit(x, span->active, span->channels) {
 		struct dahdi_chan *const chan = span->chans[x];
 		spin_lock(&chan->lock);
 		if (should_skip_receive(chan)) {
@@ -10157,52 +13013,25 @@ int _dahdi_receive(struct dahdi_span *span)
 			/* Process a normal channel */
 			__dahdi_real_receive(chan);
 		}
-		if (chan->itimer) {
-			chan->itimer -= DAHDI_CHUNKSIZE;
-			if (chan->itimer <= 0)
-				rbs_itimer_expire(chan);
-		}
-		if (chan->ringdebtimer)
-			chan->ringdebtimer--;
-		if (chan->sig & __DAHDI_SIG_FXS) {
-			if (chan->rxhooksig == DAHDI_RXSIG_RING)
-				chan->ringtrailer = DAHDI_RINGTRAILER;
-			else if (chan->ringtrailer) {
-				chan->ringtrailer -= DAHDI_CHUNKSIZE;
-				/* See if RING trailer is expired */
-				if (!chan->ringtrailer && !chan->ringdebtimer)
-					__qevent(chan, DAHDI_EVENT_RINGOFFHOOK);
-			}
-		}
-		if (chan->pulsetimer) {
-			chan->pulsetimer--;
-			if (chan->pulsetimer <= 0) {
-				if (chan->pulsecount) {
-					if (chan->pulsecount > 12) {
-
-						module_printk(KERN_NOTICE, "Got pulse digit %d on %s???\n",
-					    chan->pulsecount,
-						chan->name);
-					} else if (chan->pulsecount > 11) {
-						__qevent(chan, DAHDI_EVENT_PULSEDIGIT | '#');
-					} else if (chan->pulsecount > 10) {
-						__qevent(chan, DAHDI_EVENT_PULSEDIGIT | '*');
-					} else if (chan->pulsecount > 9) {
-						__qevent(chan, DAHDI_EVENT_PULSEDIGIT | '0');
-					} else {
-						__qevent(chan, DAHDI_EVENT_PULSEDIGIT | ('0' +
-							chan->pulsecount));
-					}
-					chan->pulsecount = 0;
-				}
-			}
-		}
 #ifdef BUFFER_DEBUG
 		chan->statcount -= DAHDI_CHUNKSIZE;
 #endif
 		spin_unlock(&chan->lock);
 	}
 
+	for_each_set_bit(x, span->rxtimers, span->channels) {
+		struct dahdi_chan *const chan = span->chans[x];
+		spin_lock(&chan->lock);
+		if (!should_skip_receive(chan) && !__dahdi_rx_timers(chan))
+			clear_bit(x, span->rxtimers);
+		spin_unlock(&chan->lock);
+	}
+
+#ifdef CONFIG_DAHDI_PPP
+	dahdi_ppp_batch_kick(&span->ppp);
+#endif
+	dahdi_hdlc_defer_kick(span);
+
 	if (dahdi_is_sync_master(span))
 		_process_masterspan();
 
@@ -10230,6 +13059,34 @@ MODULE_PARM_DESC(max_pseudo_channels, "Maximum number of pseudo channels.");
 module_param(hwec_overrides_swec, int, 0644);
 MODULE_PARM_DESC(hwec_overrides_swec, "When true, a hardware echo canceller is used instead of configured SWEC.");
 
+module_param(ec_gate, int, 0644);
+MODULE_PARM_DESC(ec_gate,
+		 "If 1 (default) software echo cancellers are not run while "
+		 "the reference has been silent for longer than their tail.");
+
+module_param(ec_stats, int, 0644);
+MODULE_PARM_DESC(ec_stats,
+		 "If 1 the echo levels and the time spent in software echo "
+		 "cancellation are measured on every chunk, for ERL, ERLE and "
+		 "timing in DAHDI_EC_GETSTATS and ec_stats. Off by default.");
+
+module_param(ec_defer, int, 0644);
+MODULE_PARM_DESC(ec_defer,
+		 "If 1 software echo cancellation of spans assigned from now "
+		 "on is run on a per span worker instead of the interrupt, "
+		 "one chunk later. See also the ec_defer span attribute.");
+
+module_param(hdlc_defer, int, 0644);
+MODULE_PARM_DESC(hdlc_defer,
+		 "If 1 HDLC framing of spans assigned from now on is run on a "
+		 "per span kernel thread instead of the interrupt, a few ms "
+		 "later. See also the hdlc_defer span attribute.");
+
+module_param(numa_irq_hint, int, 0644);
+MODULE_PARM_DESC(numa_irq_hint,
+		 "If 1 drivers that support it set the affinity of their "
+		 "interrupt to the CPUs of the card's NUMA node.");
+
 module_param(auto_assign_spans, int, 0644);
 MODULE_PARM_DESC(auto_assign_spans,
 		 "If 1 spans will automatically have their children span and "
@@ -10404,6 +13261,10 @@ static int __init dahdi_init(void)
 	int res = 0;
 
 	module_printk(KERN_INFO, "Version: %s\n", dahdi_version);
+	res = dahdi_fcs_init();
+	if (res)
+		return res;
+
 #ifdef CONFIG_PROC_FS
 	root_proc_entry = proc_mkdir("dahdi", NULL);
 	if (!root_proc_entry) {
@@ -10411,6 +13272,20 @@ static int __init dahdi_init(void)
 		return -EEXIST;
 	}
 #endif
+	res = dahdi_ecpool_init();
+	if (res)
+		goto failed_ecpool_init;
+
+	dahdi_ec_wq = alloc_workqueue("dahdi_ec", WQ_HIGHPRI | WQ_CPU_INTENSIVE,
+				      0);
+	if (!dahdi_ec_wq) {
+		res = -ENOMEM;
+		goto failed_ec_wq;
+	}
+#ifdef CONFIG_DAHDI_PPP
+	dahdi_ppp_batch_init(&pseudo_ppp_batch);
+#endif
+
 	res = dahdi_sysfs_init(&dahdi_fops);
 	if (res)
 		goto failed_driver_init;
@@ -10435,6 +13310,10 @@ failed_register_ec_factory:
 	coretimer_cleanup();
 	dahdi_sysfs_exit();
 failed_driver_init:
+	destroy_workqueue(dahdi_ec_wq);
+failed_ec_wq:
+	dahdi_ecpool_exit();
+failed_ecpool_init:
 	if (root_proc_entry) {
 		remove_proc_entry("dahdi", NULL);
 		root_proc_entry = NULL;
@@ -10454,6 +13333,11 @@ static void __exit dahdi_cleanup(void)
 	dahdi_unregister_echocan_factory(&hwec_factory);
 	coretimer_cleanup();
 	dahdi_sysfs_exit();
+#ifdef CONFIG_DAHDI_PPP
+	tasklet_kill(&pseudo_ppp_batch.tasklet);
+#endif
+	destroy_workqueue(dahdi_ec_wq);
+	dahdi_ecpool_exit();
 
 #ifdef CONFIG_PROC_FS
 	if (root_proc_entry) {
@@ -0,0 +1,225 @@
+/* dahdi-ecpool.c
+ *
+ * A pool of software echo canceller state blocks, so that enabling echo
+ * cancellation on a call does not need a (possibly high order) allocation.
+ *
+ * Blocks come in power of two size classes and are kept on free lists per
+ * NUMA node. A freed block goes back to its list, and is cleared when it
+ * is handed out again.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <dahdi/kernel.h>
+#include "dahdi.h"
+
+/* Size classes are 4 KiB to 128 KiB; larger states are not pooled */
+#define ECPOOL_MIN_SHIFT	12
+#define ECPOOL_CLASSES		6
+
+static int ecpool_max = 16;
+module_param(ecpool_max, int, 0644);
+MODULE_PARM_DESC(ecpool_max,
+		 "Free echo canceller states kept per size class and node");
+
+static int ecpool_prealloc;
+module_param(ecpool_prealloc, int, 0444);
+MODULE_PARM_DESC(ecpool_prealloc,
+		 "Echo canceller states allocated up front per size class and node");
+
+struct ecpool_hdr {
+	struct list_head node;
+	unsigned int cls;	/* ECPOOL_CLASSES if not pooled */
+	int nid;
+};
+
+/* Keep the state itself well aligned */
+#define ECPOOL_HDR	ALIGN(sizeof(struct ecpool_hdr), 16)
+
+struct ecpool_list {
+	spinlock_t lock;
+	struct list_head free;
+	int count;
+};
+
+/* nr_node_ids * ECPOOL_CLASSES lists */
+static struct ecpool_list *ecpool;
+
+static inline struct ecpool_list *ecpool_list(int nid, unsigned int cls)
+{
+	return &ecpool[nid * ECPOOL_CLASSES + cls];
+}
+
+static inline size_t ecpool_class_size(unsigned int cls)
+{
+	return 1UL << (ECPOOL_MIN_SHIFT + cls);
+}
+
+static unsigned int ecpool_class(size_t size)
+{
+	unsigned int cls;
+
+	for (cls = 0; cls < ECPOOL_CLASSES; cls++) {
+		if (ECPOOL_HDR + size <= ecpool_class_size(cls))
+			break;
+	}
+	return cls;
+}
+
+/* The node of the hardware the channel is on, else the current one */
+static int ecpool_node(const struct dahdi_chan *chan)
+{
+	int nid = dahdi_chan_node(chan);
+
+	if (nid < 0 || nid >= nr_node_ids || !node_online(nid))
+		nid = numa_node_id();
+	return nid;
+}
+
+static struct ecpool_hdr *ecpool_new(int nid, unsigned int cls, size_t size)
+{
+	struct ecpool_hdr *hdr;
+
+	if (cls < ECPOOL_CLASSES)
+		size = ecpool_class_size(cls);
+	else
+		size += ECPOOL_HDR;
+
+	hdr = kmalloc_node(size, GFP_KERNEL, nid);
+	if (!hdr)
+		return NULL;
+	hdr->cls = cls;
+	hdr->nid = nid;
+	return hdr;
+}
+
+/**
+ * dahdi_echocan_state_alloc() - Get a zeroed echo canceller state block.
+ * @chan:	The channel the state is for (may be NULL).
+ * @size:	The size of the state.
+ *
+ * Meant for dahdi_echocan_factory.echocan_create(). The block must be
+ * released with dahdi_echocan_state_free().
+ */
+void *dahdi_echocan_state_alloc(const struct dahdi_chan *chan, size_t size)
+{
+	const int nid = ecpool_node(chan);
+	const unsigned int cls = ecpool_class(size);
+	struct ecpool_hdr *hdr = NULL;
+	unsigned long flags;
+
+	if (ecpool && cls < ECPOOL_CLASSES) {
+		struct ecpool_list *const l = ecpool_list(nid, cls);
+
+		spin_lock_irqsave(&l->lock, flags);
+		if (!list_empty(&l->free)) {
+			hdr = list_first_entry(&l->free, struct ecpool_hdr,
+					       node);
+			list_del(&hdr->node);
+			l->count--;
+		}
+		spin_unlock_irqrestore(&l->lock, flags);
+	}
+
+	if (!hdr) {
+		hdr = ecpool_new(nid, cls, size);
+		if (!hdr)
+			return NULL;
+	}
+
+	memset((char *)hdr + ECPOOL_HDR, 0, size);
+	return (char *)hdr + ECPOOL_HDR;
+}
+EXPORT_SYMBOL(dahdi_echocan_state_alloc);
+
+/**
+ * dahdi_echocan_state_free() - Release a block from dahdi_echocan_state_alloc()
+ * @state:	The block, may be NULL.
+ */
+void dahdi_echocan_state_free(void *state)
+{
+	struct ecpool_hdr *hdr;
+	unsigned long flags;
+
+	if (!state)
+		return;
+
+	hdr = (struct ecpool_hdr *)((char *)state - ECPOOL_HDR);
+	if (ecpool && hdr->cls < ECPOOL_CLASSES) {
+		struct ecpool_list *const l = ecpool_list(hdr->nid, hdr->cls);
+
+		spin_lock_irqsave(&l->lock, flags);
+		if (l->count < ecpool_max) {
+			list_add(&hdr->node, &l->free);
+			l->count++;
+			hdr = NULL;
+		}
+		spin_unlock_irqrestore(&l->lock, flags);
+	}
+	kfree(hdr);
+}
+EXPORT_SYMBOL(dahdi_echocan_state_free);
+
+int __init dahdi_ecpool_init(void)
+{
+	struct ecpool_hdr *hdr;
+	unsigned int cls;
+	int nid, i;
+
+	ecpool = kcalloc(nr_node_ids * ECPOOL_CLASSES, sizeof(*ecpool),
+			 GFP_KERNEL);
+	if (!ecpool)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_node_ids * ECPOOL_CLASSES; i++) {
+		spin_lock_init(&ecpool[i].lock);
+		INIT_LIST_HEAD(&ecpool[i].free);
+	}
+
+	for_each_online_node(nid) {
+		for (cls = 0; cls < ECPOOL_CLASSES; cls++) {
+			struct ecpool_list *const l = ecpool_list(nid, cls);
+
+			for (i = 0; i < min(ecpool_prealloc, ecpool_max); i++) {
+				hdr = ecpool_new(nid, cls, 0);
+				if (!hdr)
+					break;
+				list_add(&hdr->node, &l->free);
+				l->count++;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void dahdi_ecpool_exit(void)
+{
+	struct ecpool_hdr *hdr, *next;
+	int i;
+
+	for (i = 0; i < nr_node_ids * ECPOOL_CLASSES; i++) {
+		list_for_each_entry_safe(hdr, next, &ecpool[i].free, node)
+			kfree(hdr);
+	}
+	kfree(ecpool);
+	ecpool = NULL;
+}
@@ -0,0 +1,97 @@
+/* dahdi-fcs.c
+ *
+ * The 16 bit HDLC frame check sequence (RFC 1662), eight bytes at a time.
+ *
+ * This is the same CRC as PPP_FCS(), which goes through a 256 entry table
+ * one byte at a time, so every byte waits on the previous one.  Slicing by
+ * eight uses eight tables, where table k gives the effect of a byte that is
+ * followed by k more, so that eight lookups can be done independently and
+ * combined.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/ppp_defs.h>
+#include <dahdi/kernel.h>
+#include "dahdi.h"
+
+/* x^16 + x^12 + x^5 + 1, bit reversed */
+#define FCS16_POLY	0x8408
+
+static u16 fcs16_table[8][256] __read_mostly;
+
+/**
+ * dahdi_fcs16() - Update an HDLC FCS with a buffer.
+ * @fcs:	The FCS so far, PPP_INITFCS for a new frame.
+ * @buf:	The data.
+ * @len:	Its length.
+ *
+ * Gives the same result as PPP_FCS() for each byte in turn.  A received
+ * frame including its FCS is good if the result is PPP_GOODFCS; when
+ * sending, the result for the data is inverted and appended LSB first.
+ */
+u16 dahdi_fcs16(u16 fcs, const u8 *buf, size_t len)
+{
+	while (len >= 8) {
+		fcs ^= buf[0] | (buf[1] << 8);
+		fcs = fcs16_table[7][fcs & 0xff] ^
+		      fcs16_table[6][fcs >> 8] ^
+		      fcs16_table[5][buf[2]] ^
+		      fcs16_table[4][buf[3]] ^
+		      fcs16_table[3][buf[4]] ^
+		      fcs16_table[2][buf[5]] ^
+		      fcs16_table[1][buf[6]] ^
+		      fcs16_table[0][buf[7]];
+		buf += 8;
+		len -= 8;
+	}
+	while (len--)
+		fcs = (fcs >> 8) ^ fcs16_table[0][(fcs ^ *buf++) & 0xff];
+	return fcs;
+}
+EXPORT_SYMBOL(dahdi_fcs16);
+
+int __init dahdi_fcs_init(void)
+{
+	static const u8 check[] = "123456789 The quick brown fox";
+	unsigned int fcs, i, k;
+
+	for (i = 0; i < 256; i++) {
+		fcs = i;
+		for (k = 0; k < 8; k++)
+			fcs = (fcs & 1) ? (fcs >> 1) ^ FCS16_POLY : fcs >> 1;
+		fcs16_table[0][i] = fcs;
+	}
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			fcs = fcs16_table[k - 1][i];
+			fcs16_table[k][i] = (fcs >> 8) ^ fcs16_table[0][fcs & 0xff];
+		}
+	}
+
+	/* Check against the byte at a time version, at every alignment */
+	for (i = 0; i < sizeof(check); i++) {
+		fcs = PPP_INITFCS;
+		for (k = i; k < sizeof(check); k++)
+			fcs = PPP_FCS(fcs, check[k]);
+		if (fcs != dahdi_fcs16(PPP_INITFCS, check + i,
+				       sizeof(check) - i)) {
+			module_printk(KERN_ERR, "FCS self test failed\n");
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
@@ -160,6 +160,58 @@ static BUS_ATTR_READER(ec_state_show, dev, buf)
 	return len;
 }
 
+static BUS_ATTR_READER(ec_stats_show, dev, buf)
+{
+	struct dahdi_chan *chan;
+	struct dahdi_echocan_stats stats;
+
+	chan = dev_to_chan(dev);
+	if (dahdi_chan_ec_stats(chan, &stats))
+		return sprintf(buf, "\n");
+	return sprintf(buf,
+		       "erl: %s%d.%d dB\n"
+		       "erle: %s%d.%d dB\n"
+		       "dtd: %u\n"
+		       "adapt: %u\n"
+		       "adapt_skipped: %u\n"
+		       "chunks: %u\n"
+		       "avg_ns: %u\n"
+		       "max_ns: %u\n"
+		       "gated: %u\n",
+		       (stats.erl < 0) ? "-" : "", abs(stats.erl) / 10,
+		       abs(stats.erl) % 10,
+		       (stats.erle < 0) ? "-" : "", abs(stats.erle) / 10,
+		       abs(stats.erle) % 10,
+		       stats.dtd, stats.adapt, stats.adapt_skipped,
+		       stats.chunks, stats.avg_ns, stats.max_ns, stats.gated);
+}
+
+static BUS_ATTR_READER(ppp_queue_show, dev, buf)
+{
+	struct dahdi_chan *chan;
+	unsigned int tx, rx, rx_dropped;
+
+	chan = dev_to_chan(dev);
+	if (dahdi_chan_ppp_queue(chan, &tx, &rx, &rx_dropped))
+		return sprintf(buf, "\n");
+	return sprintf(buf,
+		       "tx: %u\n"
+		       "rx: %u\n"
+		       "rx_dropped: %u\n",
+		       tx, rx, rx_dropped);
+}
+
+static BUS_ATTR_READER(hdlc_stats_show, dev, buf)
+{
+	struct dahdi_chan *chan;
+	struct dahdi_hdlc_stats stats;
+
+	chan = dev_to_chan(dev);
+	if (dahdi_chan_hdlc_stats(chan, &stats))
+		return sprintf(buf, "\n");
+	return dahdi_hdlc_stats_show(&stats, buf);
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
 static struct device_attribute chan_dev_attrs[] = {
 	__ATTR_RO(name),
@@ -170,6 +222,9 @@ static struct device_attribute chan_dev_attrs[] = {
 	__ATTR_RO(alarms),
 	__ATTR_RO(ec_factory),
 	__ATTR_RO(ec_state),
+	__ATTR_RO(ec_stats),
+	__ATTR_RO(ppp_queue),
+	__ATTR_RO(hdlc_stats),
 	__ATTR_RO(blocksize),
 #ifdef OPTIMIZE_CHANMUTE
 	__ATTR_RO(chanmute),
@@ -186,6 +241,9 @@ static DEVICE_ATTR_RO(sigcap);
 static DEVICE_ATTR_RO(alarms);
 static DEVICE_ATTR_RO(ec_factory);
 static DEVICE_ATTR_RO(ec_state);
+static DEVICE_ATTR_RO(ec_stats);
+static DEVICE_ATTR_RO(ppp_queue);
+static DEVICE_ATTR_RO(hdlc_stats);
 static DEVICE_ATTR_RO(blocksize);
 #ifdef OPTIMIZE_CHANMUTE
 static DEVICE_ATTR_RO(chanmute);
@@ -201,6 +259,9 @@ static struct attribute *chan_dev_attrs[] = {
 	&dev_attr_alarms.attr,
 	&dev_attr_ec_factory.attr,
 	&dev_attr_ec_state.attr,
+	&dev_attr_ec_stats.attr,
+	&dev_attr_ppp_queue.attr,
+	&dev_attr_hdlc_stats.attr,
 	&dev_attr_blocksize.attr,
 #ifdef OPTIMIZE_CHANMUTE
 	&dev_attr_chanmute.attr,
@@ -180,6 +180,83 @@ static BUS_ATTR_READER(linecompat_show, dev, buf)
 	return len;
 }
 
+static BUS_ATTR_READER(ec_defer_show, dev, buf)
+{
+	struct dahdi_span *span;
+
+	span = dev_to_span(dev);
+	return sprintf(buf, "%d\n", span->ec_defer != NULL);
+}
+
+static BUS_ATTR_WRITER(ec_defer_store, dev, buf, count)
+{
+	struct dahdi_span *span;
+	int enable;
+	int ret;
+
+	span = dev_to_span(dev);
+	if (sscanf(buf, "%d", &enable) != 1)
+		return -EINVAL;
+	ret = dahdi_span_set_ec_defer(span, enable);
+	return (ret) ? ret : count;
+}
+
+static BUS_ATTR_READER(ec_defer_stats_show, dev, buf)
+{
+	struct dahdi_span *span;
+
+	span = dev_to_span(dev);
+	return dahdi_span_ec_defer_stats(span, buf);
+}
+
+static BUS_ATTR_READER(hdlc_defer_show, dev, buf)
+{
+	struct dahdi_span *span;
+
+	span = dev_to_span(dev);
+	return sprintf(buf, "%d\n", span->hdlc_defer != NULL);
+}
+
+static BUS_ATTR_WRITER(hdlc_defer_store, dev, buf, count)
+{
+	struct dahdi_span *span;
+	int enable;
+	int ret;
+
+	span = dev_to_span(dev);
+	if (sscanf(buf, "%d", &enable) != 1)
+		return -EINVAL;
+	ret = dahdi_span_set_hdlc_defer(span, enable);
+	return (ret) ? ret : count;
+}
+
+static BUS_ATTR_READER(hdlc_defer_stats_show, dev, buf)
+{
+	struct dahdi_span *span;
+
+	span = dev_to_span(dev);
+	return dahdi_span_hdlc_defer_stats(span, buf);
+}
+
+static BUS_ATTR_READER(hdlc_stats_show, dev, buf)
+{
+	struct dahdi_span *span;
+	struct dahdi_hdlc_stats stats;
+
+	span = dev_to_span(dev);
+	if (!dahdi_span_hdlc_stats(span, &stats))
+		return sprintf(buf, "\n");
+	return dahdi_hdlc_stats_show(&stats, buf);
+}
+
+static BUS_ATTR_READER(numa_node_show, dev, buf)
+{
+	struct dahdi_span *span;
+
+	span = dev_to_span(dev);
+	return sprintf(buf, "%d\n", dahdi_span_node(span));
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
 static struct device_attribute span_dev_attrs[] = {
 	__ATTR_RO(name),
@@ -195,6 +272,13 @@ static struct device_attribute span_dev_attrs[] = {
 	__ATTR_RO(channels),
 	__ATTR_RO(lineconfig),
 	__ATTR_RO(linecompat),
+	__ATTR(ec_defer, S_IRUGO | S_IWUSR, ec_defer_show, ec_defer_store),
+	__ATTR_RO(ec_defer_stats),
+	__ATTR(hdlc_defer, S_IRUGO | S_IWUSR, hdlc_defer_show,
+	       hdlc_defer_store),
+	__ATTR_RO(hdlc_defer_stats),
+	__ATTR_RO(hdlc_stats),
+	__ATTR_RO(numa_node),
 	__ATTR_NULL,
 };
 #else
@@ -211,6 +295,12 @@ static DEVICE_ATTR_RO(basechan);
 static DEVICE_ATTR_RO(channels);
 static DEVICE_ATTR_RO(lineconfig);
 static DEVICE_ATTR_RO(linecompat);
+static DEVICE_ATTR_RW(ec_defer);
+static DEVICE_ATTR_RO(ec_defer_stats);
+static DEVICE_ATTR_RW(hdlc_defer);
+static DEVICE_ATTR_RO(hdlc_defer_stats);
+static DEVICE_ATTR_RO(hdlc_stats);
+static DEVICE_ATTR_RO(numa_node);
 
 static struct attribute *span_dev_attrs[] = {
 	&dev_attr_name.attr,
@@ -226,6 +316,12 @@ static struct attribute *span_dev_attrs[] = {
 	&dev_attr_channels.attr,
 	&dev_attr_lineconfig.attr,
 	&dev_attr_linecompat.attr,
+	&dev_attr_ec_defer.attr,
+	&dev_attr_ec_defer_stats.attr,
+	&dev_attr_hdlc_defer.attr,
+	&dev_attr_hdlc_defer_stats.attr,
+	&dev_attr_hdlc_stats.attr,
+	&dev_attr_numa_node.attr,
 	NULL,
 };
 ATTRIBUTE_GROUPS(span_dev);
@@ -662,6 +758,26 @@ dahdi_registration_time_show(struct device *dev,
 	return count;
 }
 
+static ssize_t
+dahdi_numa_node_show(struct device *dev,
+		     struct device_attribute *attr, char *buf)
+{
+	struct dahdi_device *ddev = to_ddev(dev);
+
+	return sprintf(buf, "%d\n", dahdi_device_node(ddev));
+}
+
+static ssize_t
+dahdi_numa_irq_hint_show(struct device *dev,
+			 struct device_attribute *attr, char *buf)
+{
+	struct dahdi_device *ddev = to_ddev(dev);
+
+	if (!ddev->hint_irq)
+		return sprintf(buf, "none\n");
+	return sprintf(buf, "%u:%d\n", ddev->hint_irq, ddev->hint_node);
+}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
 static struct device_attribute dahdi_device_attrs[] = {
 	__ATTR(manufacturer, S_IRUGO, manufacturer_show, NULL),
@@ -675,6 +791,8 @@ static struct device_attribute dahdi_device_attrs[] = {
 	__ATTR(spantype, S_IWUSR | S_IRUGO, dahdi_spantype_show,
 	       dahdi_spantype_store),
 	__ATTR(registration_time, S_IRUGO, dahdi_registration_time_show, NULL),
+	__ATTR(numa_node, S_IRUGO, dahdi_numa_node_show, NULL),
+	__ATTR(numa_irq_hint, S_IRUGO, dahdi_numa_irq_hint_show, NULL),
 	__ATTR_NULL,
 };
 #else
@@ -688,6 +806,10 @@ static DEVICE_ATTR_WO(assign_span);
 static DEVICE_ATTR_WO(unassign_span);
 static DEVICE_ATTR_RW(dahdi_spantype);
 static DEVICE_ATTR_RO(dahdi_registration_time);
+static struct device_attribute dev_attr_dahdi_numa_node =
+	__ATTR(numa_node, S_IRUGO, dahdi_numa_node_show, NULL);
+static struct device_attribute dev_attr_dahdi_numa_irq_hint =
+	__ATTR(numa_irq_hint, S_IRUGO, dahdi_numa_irq_hint_show, NULL);
 static struct attribute *dahdi_device_attrs[] = {
 	&dev_attr_manufacturer.attr,
 	&dev_attr_type.attr,
@@ -699,6 +821,8 @@ static struct attribute *dahdi_device_attrs[] = {
 	&dev_attr_unassign_span.attr,
 	&dev_attr_dahdi_spantype.attr,
 	&dev_attr_dahdi_registration_time.attr,
+	&dev_attr_dahdi_numa_node.attr,
+	&dev_attr_dahdi_numa_irq_hint.attr,
 	NULL,
 };
 ATTRIBUTE_GROUPS(dahdi_device);
@@ -35,6 +35,11 @@ void span_sysfs_remove(struct dahdi_span *span);
 int __init dahdi_sysfs_init(const struct file_operations *dahdi_fops);
 void dahdi_sysfs_exit(void);
 
+int __init dahdi_fcs_init(void);
+
+int __init dahdi_ecpool_init(void);
+void dahdi_ecpool_exit(void);
+
 void dahdi_sysfs_init_device(struct dahdi_device *ddev);
 int dahdi_sysfs_add_device(struct dahdi_device *ddev, struct device *parent);
 void dahdi_sysfs_unregister_device(struct dahdi_device *ddev);
@@ -43,6 +48,19 @@ int dahdi_assign_span(struct dahdi_span *span, unsigned int spanno,
 			unsigned int basechan, int prefmaster);
 int dahdi_unassign_span(struct dahdi_span *span);
 int dahdi_assign_device_spans(struct dahdi_device *ddev);
+int dahdi_span_set_ec_defer(struct dahdi_span *span, int enable);
+int dahdi_span_ec_defer_stats(struct dahdi_span *span, char *buf);
+int dahdi_span_set_hdlc_defer(struct dahdi_span *span, int enable);
+int dahdi_span_hdlc_defer_stats(struct dahdi_span *span, char *buf);
+int dahdi_chan_ec_stats(struct dahdi_chan *chan,
+			struct dahdi_echocan_stats *stats);
+int dahdi_chan_ppp_queue(struct dahdi_chan *chan, unsigned int *tx,
+			 unsigned int *rx, unsigned int *rx_dropped);
+int dahdi_chan_hdlc_stats(struct dahdi_chan *chan,
+			  struct dahdi_hdlc_stats *stats);
+int dahdi_span_hdlc_stats(struct dahdi_span *span,
+			  struct dahdi_hdlc_stats *stats);
+int dahdi_hdlc_stats_show(const struct dahdi_hdlc_stats *stats, char *buf);
 
 static inline int get_span(struct dahdi_span *span)
 {
@@ -143,6 +143,8 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec);
 static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec);
 static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
+static void echo_can_process_batch(struct dahdi_echocan_chunk *chunks,
+				   unsigned int count);
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val);
 static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enable);
 static const char *name = "KB1";
@@ -161,6 +163,7 @@ static const struct dahdi_echocan_features my_features = {
 static const struct dahdi_echocan_ops my_ops = {
 	.echocan_free = echo_can_free,
 	.echocan_process = echo_can_process,
+	.echocan_process_batch = echo_can_process_batch,
 	.echocan_traintap = echo_can_traintap,
 	.echocan_NLP_toggle = echocan_NLP_toggle,
 };
@@ -331,7 +334,7 @@ static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *e
 {
 	struct ec_pvt *pvt = dahdi_to_pvt(ec);
 
-	kfree(pvt);
+	dahdi_echocan_state_free(pvt);
 }
 
 static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
@@ -468,6 +471,8 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 	/* -------------------------------------------------------- */
 	if (((pvt->s_tilde_i >> (DEFAULT_ALPHA_ST_I - 1)) > pvt->max_y_tilde)
 	    && (pvt->max_y_tilde > 0))  {
+		if (!pvt->HCNTR_d)
+			pvt->dahdi.stats.dtd++;
 		/* Then start the Hangover counter */
 		pvt->HCNTR_d = DEFAULT_HANGT;
 #ifdef MEC2_STATS_DETAILED
@@ -499,6 +504,7 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 			pvt->avg_Lu_i_ok = pvt->avg_Lu_i_ok + pvt->Lu_i;
 			++pvt->cntr_coeff_updates;
 #endif
+			pvt->dahdi.stats.adapt++;
 			for (k = 0; k < pvt->N_d; k++) {
 				/* eq. (7): compute an expectation over M_d samples */
 				int grad2;
@@ -517,7 +523,11 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 			pvt->avg_Lu_i_toolow = pvt->avg_Lu_i_toolow + pvt->Lu_i;
 			++pvt->cntr_coeff_missedupdates;
 #endif
+			pvt->dahdi.stats.adapt_skipped++;
 		}
+	} else if (!(pvt->i_d % DEFAULT_M)) {
+		/* Near end speech */
+		pvt->dahdi.stats.adapt_skipped++;
 	}
   
 	/* paragraph below eq. (15): if no near-end speech in the sample and 
@@ -626,6 +636,23 @@ static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const
 	}
 }
 
+/* One channel at a time, so each canceller's history stays in cache. */
+static void echo_can_process_batch(struct dahdi_echocan_chunk *chunks,
+				   unsigned int count)
+{
+	unsigned int i;
+	int x;
+
+	for (i = 0; i < count; i++) {
+		struct ec_pvt *pvt = dahdi_to_pvt(chunks[i].ec);
+
+		for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+			chunks[i].isig[x] = sample_update(pvt, chunks[i].iref[x],
+							  chunks[i].isig[x]);
+		}
+	}
+}
+
 static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec)
 {
@@ -645,7 +672,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 	if (maxu < (1 << DEFAULT_SIGMA_LU_I))
 		maxu = (1 << DEFAULT_SIGMA_LU_I);
 
-	size = sizeof(*ec) +
+	size = sizeof(*pvt) +
 		4 + 						/* align */
 		sizeof(int) * ecp->tap_length +			/* a_i */
 		sizeof(short) * ecp->tap_length + 		/* a_s */
@@ -654,7 +681,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 		2 * sizeof(short) * (maxu) +			/* u_s */
 		2 * sizeof(short) * ecp->tap_length;		/* y_tilde_s */
 
-	pvt = kzalloc(size, GFP_KERNEL);
+	pvt = dahdi_echocan_state_alloc(chan, size);
 	if (!pvt)
 		return -ENOMEM;
 
@@ -670,7 +697,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 			pvt->aggressive = p[x].value ? 1 : 0;
 		} else {
 			printk(KERN_WARNING "Unknown parameter supplied to KB1 echo canceler: '%s'\n", p[x].name);
-			kfree(pvt);
+			dahdi_echocan_state_free(pvt);
 
 			return -EINVAL;
 		}
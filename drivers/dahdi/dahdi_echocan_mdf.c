@@ -0,0 +1,549 @@
+/*
+ * DAHDI MDF echo canceller
+ *
+ * A partitioned block frequency domain adaptive filter (the "multidelay
+ * block frequency domain" filter of Soo and Pang) in fixed point.  The
+ * tail is split into partitions of one block each; every block costs a
+ * few short FFTs plus one complex multiply-accumulate per bin and
+ * partition, instead of a full length convolution and update per sample,
+ * which makes long tails cheap.
+ *
+ * The receive direction is delayed by one block less one chunk, since a
+ * whole block has to be gathered before it can be processed.
+ */
+
+/*
+ * See http://www.asterisk.org for more information about
+ * the Asterisk project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2 as published by the
+ * Free Software Foundation. See the LICENSE file included with
+ * this program for more details.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/errno.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/ctype.h>
+#include <linux/moduleparam.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+
+#include <dahdi/kernel.h>
+
+static int debug;
+static int block_size = 32;
+
+/* Largest block (in samples) supported, and log2 of its FFT size */
+#define MDF_MAX_BLOCK		64
+#define MDF_MAX_ORDER		7
+
+/* Adaptation step size, 2^-MDF_MU_SHIFT of a full normalized step */
+#define MDF_MU_SHIFT		0
+#define MDF_MU			(1ULL << (45 - MDF_MU_SHIFT))
+
+/* Added to the reference power of each bin, per partition, so quiet
+ * references do not make huge steps.  It also bounds the gain, which is
+ * kept in an s32: with one partition and no power at all it is
+ * MDF_MU / MDF_DELTA, at most 2^30. */
+#define MDF_DELTA		(1 << 15)
+
+/* Don't adapt unless the reference peaks above this within the tail */
+#define MDF_MIN_REF		128
+
+/* Keep adaptation off this long after near end speech was seen */
+#define MDF_HANGOVER_MS		60
+
+/* With NLP on, residual smaller than this is cleared while only the far
+ * end talks */
+#define MDF_NLP_LEVEL		64
+
+static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
+			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec);
+static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec);
+static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
+static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enable);
+static const char *name = "MDF";
+static const char *ec_name(const struct dahdi_chan *chan) { return name; }
+
+static const struct dahdi_echocan_factory my_factory = {
+	.get_name = ec_name,
+	.owner = THIS_MODULE,
+	.echocan_create = echo_can_create,
+};
+
+static const struct dahdi_echocan_features my_features = {
+	.NLP_toggle = 1,
+};
+
+static const struct dahdi_echocan_ops my_ops = {
+	.echocan_free = echo_can_free,
+	.echocan_process = echo_can_process,
+	.echocan_NLP_toggle = echocan_NLP_toggle,
+};
+
+struct mdf_cpx {
+	s32 re;
+	s32 im;
+};
+
+struct mdf_cpx16 {
+	s16 re;
+	s16 im;
+};
+
+/*
+ * Spectra are kept for bins 0 .. len of the 2 * len point FFT; the rest
+ * follow by symmetry since all the signals are real.
+ *
+ * Reference spectra are stored as 2/n of the plain DFT, which keeps a full
+ * scale sine within 16 bits.  The weights are n/2 times the DFT of each
+ * partition's impulse response, with 16 + wshift fractional bits.
+ */
+struct ec_pvt {
+	struct dahdi_echocan_state dahdi;
+	unsigned int len;	/* block length, in samples */
+	unsigned int order;	/* log2 of the FFT size (2 * len) */
+	unsigned int bins;	/* len + 1 */
+	unsigned int parts;	/* partitions, each len taps */
+	unsigned int cur;	/* partition slot of the newest reference */
+	unsigned int constrain;	/* next partition to constrain */
+	unsigned int pos;	/* samples gathered of the next block */
+	unsigned int outpos;	/* next sample of out to return */
+	int wshift;
+	int hangover;
+	int hangover_blocks;
+	int use_nlp;
+
+	u64 *power;		/* sum of |x|^2 over partitions, per bin */
+	s64 *acc;		/* filter accumulators, 2 per bin */
+	struct mdf_cpx *w;	/* weights, parts * bins */
+	struct mdf_cpx *fft;	/* scratch, 2 * len */
+	struct mdf_cpx16 *x;	/* reference spectra, parts * bins */
+	struct mdf_cpx16 *w16;	/* w >> 16, used for filtering */
+	u16 *xmax;		/* reference peak of each partition */
+	short *xold;		/* previous reference block */
+	short *xin;		/* reference block being gathered */
+	short *din;		/* receive block being gathered */
+	short *out;		/* last processed receive block */
+};
+
+#define dahdi_to_pvt(a) container_of(a, struct ec_pvt, dahdi)
+
+/* cos(2 * pi * k / 128) in Q15, for k = 0 .. 32 */
+static const s16 mdf_cos[33] = {
+	32767, 32728, 32609, 32412, 32137, 31785, 31356, 30852,
+	30273, 29621, 28898, 28105, 27245, 26319, 25329, 24279,
+	23170, 22005, 20787, 19519, 18204, 16846, 15446, 14010,
+	12539, 11039, 9512, 7962, 6393, 4808, 3212, 1608,
+	0,
+};
+
+static inline s32 mdf_sat32(s64 v)
+{
+	if (v > INT_MAX)
+		return INT_MAX;
+	if (v < INT_MIN)
+		return INT_MIN;
+	return v;
+}
+
+static inline s16 mdf_sat16(s64 v)
+{
+	if (v > 32767)
+		return 32767;
+	if (v < -32768)
+		return -32768;
+	return v;
+}
+
+static inline u32 mdf_pow(const struct mdf_cpx16 *x)
+{
+	return (u32)(x->re * x->re) + (u32)(x->im * x->im);
+}
+
+/* exp(-2 * pi * i * j / 128) for j = 0 .. 63, in Q15 */
+static inline void mdf_twiddle(unsigned int j, s32 *c, s32 *s)
+{
+	if (j <= 32) {
+		*c = mdf_cos[j];
+		*s = -mdf_cos[32 - j];
+	} else {
+		*c = -mdf_cos[64 - j];
+		*s = -mdf_cos[j - 32];
+	}
+}
+
+/*
+ * In place radix-2 FFT of 1 << order points.  inverse flips the sign of
+ * the twiddles, and shift halves the data after each stage, making the
+ * result 1/n of the plain transform.  Stores saturate rather than wrap.
+ */
+static void mdf_fft(struct mdf_cpx *d, unsigned int order, int inverse,
+		    int shift)
+{
+	const unsigned int n = 1 << order;
+	unsigned int i, j, k, bit, stage;
+	s32 c, s;
+
+	for (i = 1, j = 0; i < n; i++) {
+		for (bit = n >> 1; j & bit; bit >>= 1)
+			j ^= bit;
+		j ^= bit;
+		if (i < j)
+			swap(d[i], d[j]);
+	}
+
+	for (stage = 0; stage < order; stage++) {
+		const unsigned int half = 1 << stage;
+
+		for (k = 0; k < half; k++) {
+			mdf_twiddle(k << (MDF_MAX_ORDER - 1 - stage), &c, &s);
+			if (inverse)
+				s = -s;
+			for (i = k; i < n; i += half << 1) {
+				struct mdf_cpx *const a = &d[i];
+				struct mdf_cpx *const b = &d[i + half];
+				const s64 tr = ((s64)b->re * c - (s64)b->im * s) >> 15;
+				const s64 ti = ((s64)b->re * s + (s64)b->im * c) >> 15;
+				const s64 ar = a->re;
+				const s64 ai = a->im;
+
+				a->re = mdf_sat32((ar + tr) >> shift);
+				a->im = mdf_sat32((ai + ti) >> shift);
+				b->re = mdf_sat32((ar - tr) >> shift);
+				b->im = mdf_sat32((ai - ti) >> shift);
+			}
+		}
+	}
+}
+
+/* Fill in the upper half of a real signal's spectrum from bins 0 .. len */
+static inline void mdf_mirror(struct mdf_cpx *f, unsigned int len)
+{
+	unsigned int k;
+
+	for (k = len + 1; k < 2 * len; k++) {
+		f[k].re = f[2 * len - k].re;
+		f[k].im = -f[2 * len - k].im;
+	}
+}
+
+static inline void mdf_set_w16(struct mdf_cpx16 *w16, const struct mdf_cpx *w)
+{
+	w16->re = w->re >> 16;
+	w16->im = w->im >> 16;
+}
+
+/*
+ * Adapting every bin independently lets each partition's impulse response
+ * grow past its len taps.  Trim one partition per block back to len taps,
+ * as in the alternating constraint of the MDF.
+ */
+static void mdf_constrain(struct ec_pvt *pvt)
+{
+	struct mdf_cpx *const w = pvt->w + pvt->constrain * pvt->bins;
+	struct mdf_cpx16 *const w16 = pvt->w16 + pvt->constrain * pvt->bins;
+	struct mdf_cpx *const f = pvt->fft;
+	unsigned int i, k;
+
+	memcpy(f, w, pvt->bins * sizeof(*f));
+	mdf_mirror(f, pvt->len);
+	mdf_fft(f, pvt->order, 1, 1);
+	for (i = 0; i < pvt->len; i++) {
+		f[i].im = 0;
+		f[pvt->len + i].re = 0;
+		f[pvt->len + i].im = 0;
+	}
+	mdf_fft(f, pvt->order, 0, 0);
+	for (k = 0; k < pvt->bins; k++) {
+		w[k] = f[k];
+		mdf_set_w16(&w16[k], &w[k]);
+	}
+
+	if (++pvt->constrain == pvt->parts)
+		pvt->constrain = 0;
+}
+
+static void mdf_adapt(struct ec_pvt *pvt, const short *e)
+{
+	const unsigned int len = pvt->len;
+	const unsigned int bins = pvt->bins;
+	struct mdf_cpx *const f = pvt->fft;
+	const u64 delta = (u64)MDF_DELTA * pvt->parts;
+	unsigned int i, k, p, slot;
+
+	/* Spectrum of the error, zero padded at the front */
+	for (i = 0; i < len; i++) {
+		f[i].re = f[i].im = 0;
+		f[len + i].re = e[i] << 1;
+		f[len + i].im = 0;
+	}
+	mdf_fft(f, pvt->order, 0, 1);
+
+	/* Normalized step for each bin, with 16 fractional bits. The real
+	 * parts of the scratch hold it once the error spectrum is in acc. */
+	for (k = 0; k < bins; k++) {
+		pvt->acc[2 * k] = f[k].re;
+		pvt->acc[2 * k + 1] = f[k].im;
+		f[k].re = div64_u64(MDF_MU, pvt->power[k] + delta);
+	}
+
+	/* w += mu * conj(x) * e / power */
+	slot = pvt->cur;
+	for (p = 0; p < pvt->parts; p++) {
+		const struct mdf_cpx16 *x = pvt->x + slot * bins;
+		struct mdf_cpx *w = pvt->w + p * bins;
+		struct mdf_cpx16 *w16 = pvt->w16 + p * bins;
+
+		for (k = 0; k < bins; k++) {
+			const s64 er = pvt->acc[2 * k];
+			const s64 ei = pvt->acc[2 * k + 1];
+			const s64 gre = x[k].re * er + x[k].im * ei;
+			const s64 gim = x[k].re * ei - x[k].im * er;
+
+			w[k].re = mdf_sat32(w[k].re + ((gre * f[k].re) >> 16));
+			w[k].im = mdf_sat32(w[k].im + ((gim * f[k].re) >> 16));
+			mdf_set_w16(&w16[k], &w[k]);
+		}
+		if (++slot == pvt->parts)
+			slot = 0;
+	}
+
+	mdf_constrain(pvt);
+}
+
+/* Cancel the echo from one gathered block, and adapt to it */
+static void mdf_block(struct ec_pvt *pvt)
+{
+	const unsigned int len = pvt->len;
+	const unsigned int bins = pvt->bins;
+	struct mdf_cpx *const f = pvt->fft;
+	struct mdf_cpx16 *xcur;
+	unsigned int i, k, p, slot;
+	int xpeak = 0, dpeak = 0, tailpeak = 0;
+	int farend;
+
+	/* The newest reference block takes the slot of the oldest */
+	pvt->cur = pvt->cur ? pvt->cur - 1 : pvt->parts - 1;
+	xcur = pvt->x + pvt->cur * bins;
+
+	for (i = 0; i < len; i++) {
+		f[i].re = pvt->xold[i] << 1;
+		f[i].im = 0;
+		f[len + i].re = pvt->xin[i] << 1;
+		f[len + i].im = 0;
+		xpeak = max(xpeak, abs(pvt->xin[i]));
+		dpeak = max(dpeak, abs(pvt->din[i]));
+	}
+	memcpy(pvt->xold, pvt->xin, len * sizeof(*pvt->xold));
+	mdf_fft(f, pvt->order, 0, 1);
+	for (k = 0; k < bins; k++) {
+		pvt->power[k] -= mdf_pow(&xcur[k]);
+		xcur[k].re = mdf_sat16(f[k].re);
+		xcur[k].im = mdf_sat16(f[k].im);
+		pvt->power[k] += mdf_pow(&xcur[k]);
+	}
+	pvt->xmax[pvt->cur] = xpeak;
+	for (p = 0; p < pvt->parts; p++)
+		tailpeak = max(tailpeak, (int)pvt->xmax[p]);
+
+	/* Echo estimate: sum over the partitions of w * x */
+	memset(pvt->acc, 0, 2 * bins * sizeof(*pvt->acc));
+	slot = pvt->cur;
+	for (p = 0; p < pvt->parts; p++) {
+		const struct mdf_cpx16 *x = pvt->x + slot * bins;
+		const struct mdf_cpx16 *w = pvt->w16 + p * bins;
+		s64 *acc = pvt->acc;
+
+		for (k = 0; k < bins; k++) {
+			*acc++ += (s64)x[k].re * w[k].re - (s64)x[k].im * w[k].im;
+			*acc++ += (s64)x[k].re * w[k].im + (s64)x[k].im * w[k].re;
+		}
+		if (++slot == pvt->parts)
+			slot = 0;
+	}
+	for (k = 0; k < bins; k++) {
+		f[k].re = mdf_sat32(pvt->acc[2 * k] >> pvt->wshift);
+		f[k].im = mdf_sat32(pvt->acc[2 * k + 1] >> pvt->wshift);
+	}
+	mdf_mirror(f, len);
+	mdf_fft(f, pvt->order, 1, 1);
+
+	/* Overlap-save: the second half is the linear convolution */
+	for (i = 0; i < len; i++)
+		pvt->out[i] = mdf_sat16(pvt->din[i] - f[len + i].re);
+
+	/* Geigel double talk detection, assuming at least 6dB of ERL */
+	if (dpeak > tailpeak / 2) {
+		if (!pvt->hangover)
+			pvt->dahdi.stats.dtd++;
+		pvt->hangover = pvt->hangover_blocks;
+	} else if (pvt->hangover) {
+		pvt->hangover--;
+	}
+	farend = !pvt->hangover && (tailpeak >= MDF_MIN_REF);
+
+	if (farend) {
+		mdf_adapt(pvt, pvt->out);
+		pvt->dahdi.stats.adapt++;
+	} else {
+		pvt->dahdi.stats.adapt_skipped++;
+	}
+
+	if (pvt->use_nlp && farend) {
+		for (i = 0; i < len; i++) {
+			if (abs(pvt->out[i]) < MDF_NLP_LEVEL)
+				pvt->out[i] = 0;
+		}
+	}
+}
+
+static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size)
+{
+	struct ec_pvt *pvt = dahdi_to_pvt(ec);
+	u32 x;
+
+	for (x = 0; x < size; x++) {
+		pvt->xin[pvt->pos] = iref[x];
+		pvt->din[pvt->pos] = isig[x];
+		if (++pvt->pos == pvt->len) {
+			mdf_block(pvt);
+			pvt->pos = 0;
+		}
+	}
+
+	for (x = 0; x < size; x++) {
+		isig[x] = pvt->out[pvt->outpos];
+		if (++pvt->outpos == pvt->len)
+			pvt->outpos = 0;
+	}
+}
+
+static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
+			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec)
+{
+	struct ec_pvt *pvt;
+	unsigned int len = block_size;
+	unsigned int parts, bins;
+	unsigned int x;
+	size_t size;
+	char *c;
+
+	for (x = 0; x < ecp->param_count; x++) {
+		for (c = p[x].name; *c; c++)
+			*c = tolower(*c);
+		if (!strcmp(p[x].name, "block")) {
+			len = p[x].value;
+		} else {
+			printk(KERN_WARNING "Unknown parameter supplied to MDF echo canceler: '%s'\n", p[x].name);
+			return -EINVAL;
+		}
+	}
+
+	if (len < DAHDI_CHUNKSIZE || len > MDF_MAX_BLOCK || !is_power_of_2(len)) {
+		printk(KERN_WARNING "MDF echo canceler block must be a power of two from %d to %d samples, not %u\n",
+		       DAHDI_CHUNKSIZE, MDF_MAX_BLOCK, len);
+		return -EINVAL;
+	}
+
+	parts = max(1U, DIV_ROUND_UP(ecp->tap_length, len));
+	bins = len + 1;
+
+	size = sizeof(*pvt) +
+		sizeof(u64) * bins +				/* power */
+		sizeof(s64) * 2 * bins +			/* acc */
+		sizeof(struct mdf_cpx) * parts * bins +		/* w */
+		sizeof(struct mdf_cpx) * 2 * len +		/* fft */
+		sizeof(struct mdf_cpx16) * parts * bins +	/* x */
+		sizeof(struct mdf_cpx16) * parts * bins +	/* w16 */
+		sizeof(u16) * parts +				/* xmax */
+		sizeof(short) * 4 * len;			/* xold, xin, din, out */
+
+	pvt = dahdi_echocan_state_alloc(chan, size);
+	if (!pvt)
+		return -ENOMEM;
+
+	pvt->dahdi.ops = &my_ops;
+	pvt->dahdi.features = my_features;
+
+	pvt->len = len;
+	pvt->order = ilog2(2 * len);
+	pvt->bins = bins;
+	pvt->parts = parts;
+	pvt->wshift = 14 - pvt->order;
+	pvt->outpos = DAHDI_CHUNKSIZE % len;
+	pvt->hangover_blocks = DAHDI_MS_TO_SAMPLES(MDF_HANGOVER_MS) / len;
+	/* Non-linear processor - a fancy way to say "zap small signals, to avoid
+	   accumulating noise". */
+	pvt->use_nlp = 1;
+
+	pvt->power = (u64 *)(pvt + 1);
+	pvt->acc = (s64 *)(pvt->power + bins);
+	pvt->w = (struct mdf_cpx *)(pvt->acc + 2 * bins);
+	pvt->fft = pvt->w + parts * bins;
+	pvt->x = (struct mdf_cpx16 *)(pvt->fft + 2 * len);
+	pvt->w16 = pvt->x + parts * bins;
+	pvt->xmax = (u16 *)(pvt->w16 + parts * bins);
+	pvt->xold = (short *)(pvt->xmax + parts);
+	pvt->xin = pvt->xold + len;
+	pvt->din = pvt->xin + len;
+	pvt->out = pvt->din + len;
+
+	if (debug) {
+		printk(KERN_DEBUG "MDF: %u taps as %u partitions of %u\n",
+		       ecp->tap_length, parts, len);
+	}
+
+	*ec = &pvt->dahdi;
+	return 0;
+}
+
+static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec)
+{
+	struct ec_pvt *pvt = dahdi_to_pvt(ec);
+
+	dahdi_echocan_state_free(pvt);
+}
+
+static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enable)
+{
+	struct ec_pvt *pvt = dahdi_to_pvt(ec);
+
+	pvt->use_nlp = enable ? 1 : 0;
+}
+
+static int __init mod_init(void)
+{
+	if (dahdi_register_echocan_factory(&my_factory)) {
+		module_printk(KERN_ERR, "could not register with DAHDI core\n");
+
+		return -EPERM;
+	}
+
+	module_printk(KERN_NOTICE, "Registered echo canceler '%s'\n",
+		      my_factory.get_name(NULL));
+
+	return 0;
+}
+
+static void __exit mod_exit(void)
+{
+	dahdi_unregister_echocan_factory(&my_factory);
+}
+
+module_param(debug, int, S_IRUGO | S_IWUSR);
+module_param(block_size, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(block_size, "Default block length in samples (8 to 64, a power of two)");
+
+MODULE_DESCRIPTION("DAHDI 'MDF' Echo Canceler");
+MODULE_LICENSE("GPL v2");
+
+module_init(mod_init);
+module_exit(mod_exit);
@@ -38,11 +38,16 @@
 #include <linux/init.h>
 #include <linux/ctype.h>
 #include <linux/moduleparam.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 
 #include <dahdi/kernel.h>
 
 static int debug;
 static int aggressive;
+static int sparse;
+static int simd = 1;
+static int benchmark;
 
 #define ABS(a) abs(a!=-32768?a:-32767)
 
@@ -67,6 +72,18 @@ static int aggressive;
 /* Get optimized routines for math */
 #include "arith.h"
 
+#if defined(DAHDI_ARITH_X86_SIMD)
+#include <asm/cpufeature.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+#include <asm/fpu/api.h>
+#else
+#include <asm/i387.h>
+#endif
+#elif defined(DAHDI_ARITH_NEON)
+#include <asm/neon.h>
+#include <asm/simd.h>
+#endif
+
 /*
    Important constants for tuning mg2 echo can
  */
@@ -131,6 +148,20 @@ static int aggressive;
 /* Backup coefficients every this number of samples */
 #define BACKUP 256
 
+/* Sparse mode: after adapting over the whole tail for SPARSE_SCAN samples,
+ * only the taps from SPARSE_MARGIN before the first to SPARSE_MARGIN after
+ * the last one within SPARSE_FLOOR (a shift, 4 = -24dB) of the largest are
+ * kept, and only those are convolved and adapted for SPARSE_HOLD samples.
+ * Then the whole tail is scanned again.  The window is only used if the
+ * scan saw at least SPARSE_MIN_UPDATES coefficient updates and it covers
+ * at most half of the tail.
+ */
+#define SPARSE_SCAN DAHDI_MS_TO_SAMPLES(2000)
+#define SPARSE_HOLD DAHDI_MS_TO_SAMPLES(20000)
+#define SPARSE_MIN_UPDATES 250
+#define SPARSE_FLOOR 4
+#define SPARSE_MARGIN 16
+
 /***************************************************************/
 /* The following knobs are not implemented in the current code */
 
@@ -175,6 +206,8 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec);
 static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec);
 static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
+static void echo_can_process_batch(struct dahdi_echocan_chunk *chunks,
+				   unsigned int count);
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val);
 static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enable);
 static const char *name = "MG2";
@@ -193,6 +226,7 @@ static const struct dahdi_echocan_features my_features = {
 static const struct dahdi_echocan_ops my_ops = {
 	.echocan_free = echo_can_free,
 	.echocan_process = echo_can_process,
+	.echocan_process_batch = echo_can_process_batch,
 	.echocan_traintap = echo_can_traintap,
 	.echocan_NLP_toggle = echocan_NLP_toggle,
 };
@@ -209,6 +243,9 @@ struct ec_pvt {
 	/* ---------------------- */
 	/* Number of filter coefficents */
 	int N_d;
+	/* Taps in use, all others are zero (sparse mode) */
+	int win_lo;
+	int win_hi;
 	/* Rate of adaptation of filter */
 	int beta2_i;
 
@@ -273,6 +310,11 @@ struct ec_pvt {
 	int dc_estimate;
 #endif
 	int use_nlp;
+	unsigned int sparse:1;
+	/* Samples until the sparse window is next chosen or dropped */
+	int sparse_timer;
+	/* Coefficient updates during the current full tail scan */
+	int sparse_updates;
 };
 
 #define dahdi_to_pvt(a) container_of(a, struct ec_pvt, dahdi)
@@ -317,6 +359,9 @@ static inline void init_cc(struct ec_pvt *pvt, int N, int maxy, int maxu)
 
 	/* Reset parameters */
 	pvt->N_d = N;
+	pvt->win_lo = 0;
+	pvt->win_hi = N;
+	pvt->sparse_timer = SPARSE_SCAN;
 	pvt->beta2_i = DEFAULT_BETA1_I;
   
 	/* Allocate coefficient memory */
@@ -381,7 +426,7 @@ static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *e
 #if defined(DC_NORMALIZE) && defined(MEC2_DCBIAS_MESSAGE)
 	printk(KERN_INFO "EC: DC bias calculated: %d V\n", pvt->dc_estimate >> 15);
 #endif
-	kfree(pvt);
+	dahdi_echocan_state_free(pvt);
 }
 
 #ifdef DC_NORMALIZE
@@ -392,7 +437,146 @@ static inline short dc_removal(int *dc_estimate, short samp)
 }
 #endif
 
-static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
+/* Vector unit used for CONVOLVE2() and TAPS2SHORT() */
+enum mg2_simd {
+	MG2_SCALAR,
+	MG2_SSE2,
+	MG2_AVX2,
+	MG2_NEON,
+};
+
+static const char *const mg2_simd_names[] = {
+	[MG2_SCALAR] = "scalar",
+	[MG2_SSE2] = "sse2",
+	[MG2_AVX2] = "avx2",
+	[MG2_NEON] = "neon",
+};
+
+/* The best one this CPU has, set once at module load */
+static enum mg2_simd mg2_simd_level = MG2_SCALAR;
+
+static inline int mg2_convolve(enum mg2_simd level, const short *coeffs,
+			       const short *hist, int len)
+{
+	switch (level) {
+#if defined(DAHDI_ARITH_X86_SIMD)
+	case MG2_AVX2:
+		return CONVOLVE2_AVX2(coeffs, hist, len);
+	case MG2_SSE2:
+		return CONVOLVE2_SSE2(coeffs, hist, len);
+#elif defined(DAHDI_ARITH_NEON)
+	case MG2_NEON:
+		return CONVOLVE2_NEON(coeffs, hist, len);
+#endif
+	default:
+		return CONVOLVE2(coeffs, hist, len);
+	}
+}
+
+static inline void mg2_taps2short(enum mg2_simd level, short *taps_short,
+				  const int *taps, int ntaps)
+{
+	switch (level) {
+#if defined(DAHDI_ARITH_X86_SIMD)
+	case MG2_AVX2:
+	case MG2_SSE2:
+		TAPS2SHORT_SSE2(taps_short, taps, ntaps);
+		break;
+#elif defined(DAHDI_ARITH_NEON)
+	case MG2_NEON:
+		TAPS2SHORT_NEON(taps_short, taps, ntaps);
+		break;
+#endif
+	default:
+		TAPS2SHORT(taps_short, taps, ntaps);
+		break;
+	}
+}
+
+/*
+ * Claim the vector unit for a run of sample_update() calls.  Returns the
+ * level to pass to them, which is MG2_SCALAR when the vector registers
+ * cannot be used in the current context.
+ */
+static inline enum mg2_simd mg2_simd_begin(enum mg2_simd level)
+{
+	if (level == MG2_SCALAR)
+		return MG2_SCALAR;
+#if defined(DAHDI_ARITH_X86_SIMD)
+	if (!irq_fpu_usable())
+		return MG2_SCALAR;
+	kernel_fpu_begin();
+#elif defined(DAHDI_ARITH_NEON)
+	if (!may_use_simd())
+		return MG2_SCALAR;
+	kernel_neon_begin();
+#endif
+	return level;
+}
+
+static inline void mg2_simd_end(enum mg2_simd level)
+{
+	if (level == MG2_SCALAR)
+		return;
+#if defined(DAHDI_ARITH_X86_SIMD)
+	kernel_fpu_end();
+#elif defined(DAHDI_ARITH_NEON)
+	kernel_neon_end();
+#endif
+}
+
+/* Zero taps from to to - 1, along with their backups */
+static void sparse_clear(struct ec_pvt *pvt, int from, int to)
+{
+	memset(pvt->a_i + from, 0, sizeof(int) * (to - from));
+	memset(pvt->a_s + from, 0, sizeof(short) * (to - from));
+	memset(pvt->b_i + from, 0, sizeof(int) * (to - from));
+	memset(pvt->c_i + from, 0, sizeof(int) * (to - from));
+}
+
+/* Narrow the taps in use down to where the echo is, if it is worth it */
+static void sparse_window(struct ec_pvt *pvt)
+{
+	int peak = 0;
+	int lo, hi, k;
+
+	for (k = 0; k < pvt->N_d; k++)
+		peak = max(peak, abs(pvt->a_i[k]));
+	peak >>= SPARSE_FLOOR;
+	if (!peak)
+		return;
+
+	for (lo = 0; abs(pvt->a_i[lo]) < peak; lo++)
+		;
+	for (hi = pvt->N_d; abs(pvt->a_i[hi - 1]) < peak; hi--)
+		;
+	lo = max(lo - SPARSE_MARGIN, 0);
+	hi = min(hi + SPARSE_MARGIN, pvt->N_d);
+	if ((hi - lo) * 2 > pvt->N_d)
+		return;
+
+	sparse_clear(pvt, 0, lo);
+	sparse_clear(pvt, hi, pvt->N_d);
+	pvt->win_lo = lo;
+	pvt->win_hi = hi;
+}
+
+/* Alternate between scanning the whole tail and using a window of it */
+static void sparse_update(struct ec_pvt *pvt)
+{
+	if (pvt->win_hi - pvt->win_lo < pvt->N_d) {
+		pvt->win_lo = 0;
+		pvt->win_hi = pvt->N_d;
+	} else if (pvt->sparse_updates >= SPARSE_MIN_UPDATES) {
+		sparse_window(pvt);
+	}
+	pvt->sparse_updates = 0;
+	pvt->sparse_timer = (pvt->win_hi - pvt->win_lo < pvt->N_d) ?
+				SPARSE_HOLD : SPARSE_SCAN;
+}
+
+static inline short sample_update(struct ec_pvt *pvt, short iref, short isig,
+				  enum mg2_simd level)
 {
 	/* Declare local variables that are used more than once */
 	/* ... */
@@ -433,9 +617,9 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
  
 
 	/* eq. (2): compute r in fixed-point */
-	rs = CONVOLVE2(pvt->a_s,
-		       pvt->y_s.buf_d + pvt->y_s.idx_d,
-		       pvt->N_d);
+	rs = mg2_convolve(level, pvt->a_s + pvt->win_lo,
+			  pvt->y_s.buf_d + pvt->y_s.idx_d + pvt->win_lo,
+			  pvt->win_hi - pvt->win_lo);
 	rs >>= 15;
 
 	if (pvt->lastsig == isig) {
@@ -576,6 +760,8 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 	/* -------------------------------------------------------- */
 	if (((pvt->s_tilde_i >> (DEFAULT_ALPHA_ST_I - 1)) > pvt->max_y_tilde)
 	    && (pvt->max_y_tilde > 0))  {
+		if (!pvt->HCNTR_d)
+			pvt->dahdi.stats.dtd++;
 		/* Then start the Hangover counter */
 		pvt->HCNTR_d = DEFAULT_HANGT;
 		RESTORE_COEFFS;
@@ -615,15 +801,17 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 			pvt->avg_Lu_i_ok = pvt->avg_Lu_i_ok + pvt->Lu_i;
 			++pvt->cntr_coeff_updates;
 #endif
-			for (k = 0; k < pvt->N_d; k++) {
+			pvt->dahdi.stats.adapt++;
+			pvt->sparse_updates++;
+			for (k = pvt->win_lo; k < pvt->win_hi; k++) {
 				/* eq. (7): compute an expectation over M_d samples */
 				int grad2;
-				grad2 = CONVOLVE2(pvt->u_s.buf_d + pvt->u_s.idx_d,
-						  pvt->y_s.buf_d + pvt->y_s.idx_d + k,
-						  DEFAULT_M);
+				grad2 = mg2_convolve(level,
+						     pvt->u_s.buf_d + pvt->u_s.idx_d,
+						     pvt->y_s.buf_d + pvt->y_s.idx_d + k,
+						     DEFAULT_M);
 				/* eq. (7): update the coefficient */
 				pvt->a_i[k] += grad2 / two_beta_i;
-				pvt->a_s[k] = pvt->a_i[k] >> 16;
 
 #ifdef USED_COEFFS
 				if (pvt->N_d > USED_COEFFS) {
@@ -641,11 +829,14 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 				}
 #endif
 			}
+			mg2_taps2short(level, pvt->a_s + pvt->win_lo,
+				       pvt->a_i + pvt->win_lo,
+				       pvt->win_hi - pvt->win_lo);
 
 #ifdef USED_COEFFS
 			/* Filter out irrelevant coefficients */
 			if (pvt->N_d > USED_COEFFS)
-				for (k = 0; k < pvt->N_d; k++)
+				for (k = pvt->win_lo; k < pvt->win_hi; k++)
 					if (abs(pvt->a_i[k]) < max_coeffs[USED_COEFFS-1])
 						pvt->a_i[k] = pvt->a_s[k] = 0;
 #endif
@@ -657,7 +848,11 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 			pvt->avg_Lu_i_toolow = pvt->avg_Lu_i_toolow + pvt->Lu_i;
 			++pvt->cntr_coeff_missedupdates;
 #endif
+			pvt->dahdi.stats.adapt_skipped++;
 		}
+	} else if (!(pvt->i_d % DEFAULT_M)) {
+		/* Near end speech */
+		pvt->dahdi.stats.adapt_skipped++;
 	}
   
 	/* paragraph below eq. (15): if no near-end speech in the sample and 
@@ -748,6 +943,9 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 	}
 #endif
 
+	if (pvt->sparse && !--pvt->sparse_timer)
+		sparse_update(pvt);
+
 	/* Increment the sample index and return the corrected sample */
 	pvt->i_d++;
 	return u;
@@ -756,14 +954,38 @@ static inline short sample_update(struct ec_pvt *pvt, short iref, short isig)
 static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size)
 {
 	struct ec_pvt *pvt = dahdi_to_pvt(ec);
+	enum mg2_simd level;
 	u32 x;
 	short result;
 
+	level = mg2_simd_begin(mg2_simd_level);
 	for (x = 0; x < size; x++) {
-		result = sample_update(pvt, *iref, *isig);
+		result = sample_update(pvt, *iref, *isig, level);
 		*isig++ = result;
 		++iref;
 	}
+	mg2_simd_end(level);
+}
+
+/* One channel at a time, so each canceller's history stays in cache. */
+static void echo_can_process_batch(struct dahdi_echocan_chunk *chunks,
+				   unsigned int count)
+{
+	enum mg2_simd level;
+	unsigned int i;
+	int x;
+
+	level = mg2_simd_begin(mg2_simd_level);
+	for (i = 0; i < count; i++) {
+		struct ec_pvt *pvt = dahdi_to_pvt(chunks[i].ec);
+
+		for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+			chunks[i].isig[x] = sample_update(pvt, chunks[i].iref[x],
+							  chunks[i].isig[x],
+							  level);
+		}
+	}
+	mg2_simd_end(level);
 }
 
 static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
@@ -784,7 +1006,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 		maxy = (1 << DEFAULT_SIGMA_LY_I);
 	if (maxu < (1 << DEFAULT_SIGMA_LU_I))
 		maxu = (1 << DEFAULT_SIGMA_LU_I);
-	size = sizeof(**ec) +
+	size = sizeof(*pvt) +
 		4 + 						/* align */
 		sizeof(int) * ecp->tap_length +			/* a_i */
 		sizeof(short) * ecp->tap_length + 		/* a_s */
@@ -795,13 +1017,14 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 		2 * sizeof(short) * (maxu) +			/* u_s */
 		2 * sizeof(short) * ecp->tap_length;		/* y_tilde_s */
 
-	pvt = kzalloc(size, GFP_KERNEL);
+	pvt = dahdi_echocan_state_alloc(chan, size);
 	if (!pvt)
 		return -ENOMEM;
 
 	pvt->dahdi.ops = &my_ops;
 
 	pvt->aggressive = aggressive;
+	pvt->sparse = sparse;
 	pvt->dahdi.features = my_features;
 
 	for (x = 0; x < ecp->param_count; x++) {
@@ -809,9 +1032,11 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 			*c = tolower(*c);
 		if (!strcmp(p[x].name, "aggressive")) {
 			pvt->aggressive = p[x].value ? 1 : 0;
+		} else if (!strcmp(p[x].name, "sparse")) {
+			pvt->sparse = p[x].value ? 1 : 0;
 		} else {
 			printk(KERN_WARNING "Unknown parameter supplied to MG2 echo canceler: '%s'\n", p[x].name);
-			kfree(pvt);
+			dahdi_echocan_state_free(pvt);
 
 			return -EINVAL;
 		}
@@ -860,16 +1085,152 @@ static void echocan_NLP_toggle(struct dahdi_echocan_state *ec, unsigned int enab
 	pvt->use_nlp = enable ? 1 : 0;
 }
 
+static enum mg2_simd __init mg2_simd_probe(void)
+{
+#if defined(DAHDI_ARITH_X86_SIMD)
+	if (boot_cpu_has(X86_FEATURE_AVX) && boot_cpu_has(X86_FEATURE_AVX2))
+		return MG2_AVX2;
+	return MG2_SSE2;
+#elif defined(DAHDI_ARITH_NEON)
+	return MG2_NEON;
+#else
+	return MG2_SCALAR;
+#endif
+}
+
+/* Cheap pseudo random samples for the self test and benchmark */
+static inline short mg2_rand(u32 *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 16;
+}
+
+/*
+ * Check that the kernels for level give the same results as the plain C
+ * ones, including odd lengths, unaligned buffers and full scale values.
+ */
+static int __init mg2_simd_selftest(enum mg2_simd level)
+{
+	const int max = 1024 + 32;
+	short *a, *b, *s1, *s2;
+	int *taps;
+	u32 seed = 1;
+	int len, i, res = 0;
+
+	a = kmalloc(sizeof(short) * max * 4 + sizeof(int) * max, GFP_KERNEL);
+	if (!a)
+		return -ENOMEM;
+	b = a + max;
+	s1 = b + max;
+	s2 = s1 + max;
+	taps = (int *)(s2 + max);
+
+	for (i = 0; i < max; i++) {
+		a[i] = (i % 61) ? mg2_rand(&seed) : -32768;
+		b[i] = (i % 67) ? mg2_rand(&seed) : -32768;
+		taps[i] = (mg2_rand(&seed) << 16) | (u16)mg2_rand(&seed);
+	}
+
+	level = mg2_simd_begin(level);
+	for (len = 0; len <= 1024 + 17 && !res; len++) {
+		if (mg2_convolve(level, a + 1, b + 3, len) !=
+		    CONVOLVE2(a + 1, b + 3, len))
+			res = -EIO;
+		mg2_taps2short(level, s1 + 1, taps + 1, len);
+		TAPS2SHORT(s2 + 1, taps + 1, len);
+		if (memcmp(s1 + 1, s2 + 1, sizeof(short) * len))
+			res = -EIO;
+	}
+	mg2_simd_end(level);
+
+	kfree(a);
+	return res;
+}
+
+/*
+ * Run a canceller of each common length over a second of audio with an
+ * echo it can adapt to, and report how many such channels one core can
+ * keep up with.
+ */
+static void __init mg2_benchmark(enum mg2_simd level)
+{
+	static const int taps[] = {128, 256, 512, 1024};
+	struct dahdi_echocanparams ecp = { 0 };
+	struct dahdi_echocan_state *ec;
+	short isig[DAHDI_CHUNKSIZE], iref[DAHDI_CHUNKSIZE];
+	short echo[DAHDI_CHUNKSIZE * 4] = { 0 };
+	enum mg2_simd cur;
+	u32 seed = 1;
+	ktime_t start;
+	s64 ns;
+	int i, x, y;
+
+	for (i = 0; i < ARRAY_SIZE(taps); i++) {
+		ecp.tap_length = taps[i];
+		if (echo_can_create(NULL, &ecp, NULL, &ec))
+			return;
+
+		start = ktime_get();
+		for (x = 0; x < DAHDI_MS_TO_SAMPLES(1000) / DAHDI_CHUNKSIZE; x++) {
+			memmove(echo, echo + DAHDI_CHUNKSIZE,
+				sizeof(echo) - sizeof(iref));
+			for (y = 0; y < DAHDI_CHUNKSIZE; y++) {
+				iref[y] = mg2_rand(&seed) >> 2;
+				echo[ARRAY_SIZE(echo) - DAHDI_CHUNKSIZE + y] =
+					iref[y];
+				isig[y] = (echo[y] >> 1) +
+					  (mg2_rand(&seed) >> 8);
+			}
+			cur = mg2_simd_begin(level);
+			for (y = 0; y < DAHDI_CHUNKSIZE; y++) {
+				isig[y] = sample_update(dahdi_to_pvt(ec),
+							iref[y], isig[y], cur);
+			}
+			mg2_simd_end(cur);
+		}
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		echo_can_free(NULL, ec);
+
+		module_printk(KERN_INFO, "%s: %4d taps: %lld channels per core\n",
+			      mg2_simd_names[level], taps[i],
+			      div64_s64(NSEC_PER_SEC, max_t(s64, ns, 1)));
+	}
+}
+
 static int __init mod_init(void)
 {
+	if (simd) {
+		mg2_simd_level = mg2_simd_probe();
+		if (mg2_simd_level != MG2_SCALAR &&
+		    mg2_simd_selftest(mg2_simd_level)) {
+			module_printk(KERN_WARNING,
+				      "%s self test failed, not using it\n",
+				      mg2_simd_names[mg2_simd_level]);
+			mg2_simd_level = MG2_SCALAR;
+		}
+	}
+
+	if (benchmark) {
+		mg2_benchmark(MG2_SCALAR);
+#if defined(DAHDI_ARITH_X86_SIMD)
+		if (mg2_simd_level >= MG2_SSE2)
+			mg2_benchmark(MG2_SSE2);
+		if (mg2_simd_level >= MG2_AVX2)
+			mg2_benchmark(MG2_AVX2);
+#endif
+		if (mg2_simd_level == MG2_NEON)
+			mg2_benchmark(MG2_NEON);
+	}
+
 	if (dahdi_register_echocan_factory(&my_factory)) {
 		module_printk(KERN_ERR, "could not register with DAHDI core\n");
 
 		return -EPERM;
 	}
 
-	module_printk(KERN_NOTICE, "Registered echo canceler '%s'\n",
-		      my_factory.get_name(NULL));
+	module_printk(KERN_NOTICE, "Registered echo canceler '%s' (%s)\n",
+		      my_factory.get_name(NULL), mg2_simd_names[mg2_simd_level]);
 
 	return 0;
 }
@@ -881,6 +1242,13 @@ static void __exit mod_exit(void)
 
 module_param(debug, int, S_IRUGO | S_IWUSR);
 module_param(aggressive, int, S_IRUGO | S_IWUSR);
+module_param(sparse, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(sparse, "Only convolve and adapt the part of the tail with "
+		 "echo in it, rescanning the whole tail periodically");
+module_param(simd, int, S_IRUGO);
+MODULE_PARM_DESC(simd, "Use SSE2/AVX2/NEON when the CPU has them (default 1)");
+module_param(benchmark, int, S_IRUGO);
+MODULE_PARM_DESC(benchmark, "Report channels per core for each kernel on load");
 
 MODULE_DESCRIPTION("DAHDI 'MG2' Echo Canceler");
 MODULE_AUTHOR("Michael Gernoth");
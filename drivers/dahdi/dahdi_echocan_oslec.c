@@ -40,6 +40,8 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec);
 static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *ec);
 static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
+static void echo_can_process_batch(struct dahdi_echocan_chunk *chunks,
+				   unsigned int count);
 static int echo_can_traintap(struct dahdi_echocan_state *ec, int pos, short val);
 #ifdef CONFIG_DAHDI_ECHOCAN_PROCESS_TX
 static void echo_can_hpf_tx(struct dahdi_echocan_state *ec,
@@ -57,6 +59,7 @@ static const struct dahdi_echocan_factory my_factory = {
 static const struct dahdi_echocan_ops my_ops = {
 	.echocan_free = echo_can_free,
 	.echocan_process = echo_can_process,
+	.echocan_process_batch = echo_can_process_batch,
 	.echocan_traintap = echo_can_traintap,
 #ifdef CONFIG_DAHDI_ECHOCAN_PROCESS_TX
 	.echocan_process_tx = echo_can_hpf_tx,
@@ -91,6 +94,23 @@ static void echo_can_process(struct dahdi_echocan_state *ec, short *isig, const
 	}
 }
 
+static void echo_can_process_batch(struct dahdi_echocan_chunk *chunks,
+				   unsigned int count)
+{
+	unsigned int i;
+	int x;
+
+	for (i = 0; i < count; i++) {
+		struct ec_pvt *pvt = dahdi_to_pvt(chunks[i].ec);
+
+		for (x = 0; x < DAHDI_CHUNKSIZE; x++) {
+			chunks[i].isig[x] = oslec_update(pvt->oslec,
+							 chunks[i].iref[x],
+							 chunks[i].isig[x]);
+		}
+	}
+}
+
 static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *ecp,
 			   struct dahdi_echocanparam *p, struct dahdi_echocan_state **ec)
 {
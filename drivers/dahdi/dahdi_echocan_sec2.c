@@ -138,7 +138,7 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 
 	size = sizeof(*pvt) + ecp->tap_length * sizeof(int32_t) + ecp->tap_length * 3 * sizeof(int16_t);
 	
-	pvt = kzalloc(size, GFP_KERNEL);
+	pvt = dahdi_echocan_state_alloc(chan, size);
 	if (!pvt)
 		return -ENOMEM;
 
@@ -152,8 +152,8 @@ static int echo_can_create(struct dahdi_chan *chan, struct dahdi_echocanparams *
 	pvt->taps = ecp->tap_length;
 	pvt->curr_pos = ecp->tap_length - 1;
 	pvt->tap_mask = ecp->tap_length - 1;
-	pvt->fir_taps32 = (int32_t *) (pvt + sizeof(*pvt));
-	pvt->fir_taps16 = (int16_t *) (pvt + sizeof(*pvt) + ecp->tap_length * sizeof(int32_t));
+	pvt->fir_taps32 = (int32_t *) ((char *) pvt + sizeof(*pvt));
+	pvt->fir_taps16 = (int16_t *) ((char *) pvt + sizeof(*pvt) + ecp->tap_length * sizeof(int32_t));
 	/* Create FIR filter */
 	fir16_create(&pvt->fir_state, pvt->fir_taps16, pvt->taps);
 	pvt->rx_power_threshold = 10000000;
@@ -171,7 +171,7 @@ static void echo_can_free(struct dahdi_chan *chan, struct dahdi_echocan_state *e
 	struct ec_pvt *pvt = dahdi_to_pvt(ec);
 
 	fir16_free(&pvt->fir_state);
-	kfree(pvt);
+	dahdi_echocan_state_free(pvt);
 }
 
 static inline int16_t sample_update(struct ec_pvt *pvt, int16_t tx, int16_t rx)
@@ -251,6 +251,8 @@ static inline int16_t sample_update(struct ec_pvt *pvt, int16_t tx, int16_t rx)
 				pvt->latest_correction = -1;
 			}
 		} else {
+			if (!pvt->nonupdate_dwell)
+				pvt->dahdi.stats.dtd++;
 			pvt->nonupdate_dwell = NONUPDATE_DWELL_TIME;
 			pvt->latest_correction = -2;
 		}
@@ -258,6 +260,10 @@ static inline int16_t sample_update(struct ec_pvt *pvt, int16_t tx, int16_t rx)
 		pvt->nonupdate_dwell = 0;
 		pvt->latest_correction = -3;
 	}
+	if (pvt->latest_correction < 0)
+		pvt->dahdi.stats.adapt_skipped++;
+	else
+		pvt->dahdi.stats.adapt++;
 	/* Calculate short term power levels using very simple single pole IIRs */
 	/* TODO: Is the nasty modulus approach the fastest, or would a real
 	   tx*tx power calculation actually be faster? */
@@ -47,8 +47,12 @@
 #include <linux/lapb.h>
 #include <linux/rtnetlink.h>
 #include <linux/etherdevice.h>
+#include <linux/hash.h>
+#include <linux/rcupdate.h>
 #include <linux/hdlc.h>
 
+#include <dahdi/hdlc_fr_user.h>
+
 #undef DEBUG_PKT
 #undef DEBUG_ECN
 #undef DEBUG_LINK
@@ -130,26 +134,94 @@ static inline void dlci_to_q922(u8 *hdr, u16 dlci)
 
 
 
-static inline pvc_device* find_pvc(hdlc_device *hdlc, u16 dlci)
+/*
+ * The pvc_device as allocated here.  The PVCs of all FRADs are also in
+ * one hash table keyed by master and DLCI, so that fr_rx() does not have
+ * to walk the sorted per FRAD list for every frame.  Readers of the hash
+ * hold rcu_read_lock(), writers hold the RTNL or run from the LMI code
+ * and take fr_pvc_hash_lock.
+ */
+struct fr_pvc {
+	pvc_device pvc;			/* must be first, see dev_to_pvc() */
+	struct fr_pvc __rcu *hash_next;
+	struct rcu_head rcu;
+	struct fr_pvc_counters counters;
+};
+
+#define FR_PVC_HASH_BITS	8
+
+static struct fr_pvc __rcu *fr_pvc_hash[1 << FR_PVC_HASH_BITS];
+static DEFINE_SPINLOCK(fr_pvc_hash_lock);
+
+static inline struct fr_pvc *to_fr_pvc(pvc_device *pvc)
 {
-	pvc_device *pvc = hdlc->state.fr.first_pvc;
+	return container_of(pvc, struct fr_pvc, pvc);
+}
 
-	while (pvc) {
-		if (pvc->dlci == dlci)
-			return pvc;
-		if (pvc->dlci > dlci)
-			return NULL; /* the listed is sorted */
-		pvc = pvc->next;
+static inline struct fr_pvc __rcu **fr_pvc_bucket(struct net_device *dev,
+						  u16 dlci)
+{
+	return &fr_pvc_hash[hash_long((unsigned long)dev ^ dlci,
+				      FR_PVC_HASH_BITS)];
+}
+
+
+/* Must be called with rcu_read_lock() or the RTNL held */
+static inline pvc_device* find_pvc(struct net_device *dev, u16 dlci)
+{
+	struct fr_pvc *fpvc = rcu_dereference_rtnl(*fr_pvc_bucket(dev, dlci));
+
+	while (fpvc) {
+		if (fpvc->pvc.dlci == dlci && fpvc->pvc.master == dev)
+			return &fpvc->pvc;
+		fpvc = rcu_dereference_rtnl(fpvc->hash_next);
 	}
 
 	return NULL;
 }
 
 
+/* Must be called with fr_pvc_hash_lock held */
+#define fr_pvc_deref(p) \
+	rcu_dereference_protected(p, lockdep_is_held(&fr_pvc_hash_lock))
+
+
+/* Freed PVCs are waited for in hdlc_module_exit() with rcu_barrier() */
+static void fr_pvc_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct fr_pvc, rcu));
+}
+
+
+/* Takes the PVC out of the hash and frees it once fr_rx() is done with it */
+static void free_pvc(pvc_device *pvc)
+{
+	struct fr_pvc *fpvc = to_fr_pvc(pvc);
+	struct fr_pvc __rcu **fpvc_p = fr_pvc_bucket(pvc->master, pvc->dlci);
+	struct fr_pvc *p;
+	unsigned long flags;
+
+	spin_lock_irqsave(&fr_pvc_hash_lock, flags);
+	while ((p = fr_pvc_deref(*fpvc_p))) {
+		if (p == fpvc) {
+			rcu_assign_pointer(*fpvc_p, fr_pvc_deref(fpvc->hash_next));
+			break;
+		}
+		fpvc_p = &p->hash_next;
+	}
+	spin_unlock_irqrestore(&fr_pvc_hash_lock, flags);
+
+	call_rcu(&fpvc->rcu, fr_pvc_free_rcu);
+}
+
+
 static inline pvc_device* add_pvc(struct net_device *dev, u16 dlci)
 {
 	hdlc_device *hdlc = dev_to_hdlc(dev);
 	pvc_device *pvc, **pvc_p = &hdlc->state.fr.first_pvc;
+	struct fr_pvc *fpvc;
+	struct fr_pvc __rcu **fpvc_p;
+	unsigned long flags;
 
 	while (*pvc_p) {
 		if ((*pvc_p)->dlci == dlci)
@@ -159,15 +231,22 @@ static inline pvc_device* add_pvc(struct net_device *dev, u16 dlci)
 		pvc_p = &(*pvc_p)->next;
 	}
 
-	pvc = kmalloc(sizeof(pvc_device), GFP_ATOMIC);
-	if (!pvc)
+	fpvc = kmalloc(sizeof(struct fr_pvc), GFP_ATOMIC);
+	if (!fpvc)
 		return NULL;
 
-	memset(pvc, 0, sizeof(pvc_device));
+	memset(fpvc, 0, sizeof(struct fr_pvc));
+	pvc = &fpvc->pvc;
 	pvc->dlci = dlci;
 	pvc->master = dev;
 	pvc->next = *pvc_p;	/* Put it in the chain */
 	*pvc_p = pvc;
+
+	fpvc_p = fr_pvc_bucket(dev, dlci);
+	spin_lock_irqsave(&fr_pvc_hash_lock, flags);
+	RCU_INIT_POINTER(fpvc->hash_next, fr_pvc_deref(*fpvc_p));
+	rcu_assign_pointer(*fpvc_p, fpvc);
+	spin_unlock_irqrestore(&fr_pvc_hash_lock, flags);
 	return pvc;
 }
 
@@ -206,7 +285,7 @@ static inline void delete_unused_pvcs(hdlc_device *hdlc)
 		if (!pvc_is_used(*pvc_p)) {
 			pvc_device *pvc = *pvc_p;
 			*pvc_p = pvc->next;
-			kfree(pvc);
+			free_pvc(pvc);
 			continue;
 		}
 		pvc_p = &(*pvc_p)->next;
@@ -335,6 +414,13 @@ static int pvc_ioctl(struct net_device *dev, struct ifreq *ifr, int cmd)
 	pvc_device *pvc = dev_to_pvc(dev);
 	fr_proto_pvc_info info;
 
+	if (cmd == SIOCDEVPRIVATE) {
+		if (copy_to_user(ifr->ifr_data, &to_fr_pvc(pvc)->counters,
+				 sizeof(struct fr_pvc_counters)))
+			return -EFAULT;
+		return 0;
+	}
+
 	if (ifr->ifr_settings.type == IF_GET_PROTO) {
 		if (dev->type == ARPHRD_ETHER)
 			ifr->ifr_settings.type = IF_PROTO_FR_ETH_PVC;
@@ -391,6 +477,8 @@ static int pvc_xmit(struct sk_buff *skb, struct net_device *dev)
 		if (!fr_hard_header(&skb, pvc->dlci)) {
 			stats->tx_bytes += skb->len;
 			stats->tx_packets++;
+			to_fr_pvc(pvc)->counters.tx_bytes += skb->len;
+			to_fr_pvc(pvc)->counters.tx_packets++;
 			if (pvc->state.fecn) /* TX Congestion counter */
 				stats->tx_compressed++;
 			skb->dev = pvc->master;
@@ -864,6 +952,7 @@ static int fr_rx(struct sk_buff *skb)
 	u8 *data = skb->data;
 	u16 dlci;
 	pvc_device *pvc;
+	struct fr_pvc_counters *counters;
 	struct net_device *dev = NULL;
 
 	if (skb->len <= 4 || fh->ea1 || data[2] != FR_UI)
@@ -882,8 +971,10 @@ static int fr_rx(struct sk_buff *skb)
 		return NET_RX_SUCCESS;
 	}
 
-	pvc = find_pvc(hdlc, dlci);
+	rcu_read_lock();
+	pvc = find_pvc(ndev, dlci);
 	if (!pvc) {
+		rcu_read_unlock();
 #ifdef DEBUG_PKT
 		printk(KERN_INFO "%s: No PVC for received frame's DLCI %d\n",
 		       ndev->name, dlci);
@@ -891,6 +982,11 @@ static int fr_rx(struct sk_buff *skb)
 		dev_kfree_skb_any(skb);
 		return NET_RX_DROP;
 	}
+	counters = &to_fr_pvc(pvc)->counters;
+	if (fh->fecn)
+		counters->rx_fecn++;
+	if (fh->becn)
+		counters->rx_becn++;
 
 	if (pvc->state.fecn != fh->fecn) {
 #ifdef DEBUG_ECN
@@ -911,6 +1007,8 @@ static int fr_rx(struct sk_buff *skb)
 
 	if ((skb = skb_share_check(skb, GFP_ATOMIC)) == NULL) {
 		hdlc->stats.rx_dropped++;
+		counters->rx_dropped++;
+		rcu_read_unlock();
 		return NET_RX_DROP;
 	}
 
@@ -947,14 +1045,12 @@ static int fr_rx(struct sk_buff *skb)
 		default:
 			printk(KERN_INFO "%s: Unsupported protocol, OUI=%x "
 			       "PID=%x\n", ndev->name, oui, pid);
-			dev_kfree_skb_any(skb);
-			return NET_RX_DROP;
+			goto rx_drop;
 		}
 	} else {
 		printk(KERN_INFO "%s: Unsupported protocol, NLPID=%x "
 		       "length = %i\n", ndev->name, data[3], skb->len);
-		dev_kfree_skb_any(skb);
-		return NET_RX_DROP;
+		goto rx_drop;
 	}
 
 	if (dev) {
@@ -963,14 +1059,20 @@ static int fr_rx(struct sk_buff *skb)
 		stats->rx_bytes += skb->len;
 		if (pvc->state.becn)
 			stats->rx_compressed++;
+		counters->rx_packets++;
+		counters->rx_bytes += skb->len;
+		rcu_read_unlock();
 		skb->dev = dev;
 		netif_rx(skb);
 		return NET_RX_SUCCESS;
-	} else {
-		dev_kfree_skb_any(skb);
-		return NET_RX_DROP;
 	}
 
+ rx_drop:
+	counters->rx_dropped++;
+	rcu_read_unlock();
+	dev_kfree_skb_any(skb);
+	return NET_RX_DROP;
+
  rx_error:
 	hdlc->stats.rx_errors++; /* Mark error */
 	dev_kfree_skb_any(skb);
@@ -1129,12 +1231,13 @@ static int fr_add_pvc(struct net_device *master, unsigned int dlci, int type)
 
 
 
-static int fr_del_pvc(hdlc_device *hdlc, unsigned int dlci, int type)
+static int fr_del_pvc(struct net_device *master, unsigned int dlci, int type)
 {
+	hdlc_device *hdlc = dev_to_hdlc(master);
 	pvc_device *pvc;
 	struct net_device *dev;
 
-	if ((pvc = find_pvc(hdlc, dlci)) == NULL)
+	if ((pvc = find_pvc(master, dlci)) == NULL)
 		return -ENOENT;
 
 	if ((dev = *get_dev_p(pvc, type)) == NULL)
@@ -1174,7 +1277,7 @@ static void fr_destroy(hdlc_device *hdlc)
 		if (pvc->ether)
 			unregister_netdevice(pvc->ether);
 
-		kfree(pvc);
+		free_pvc(pvc);
 		pvc = next;
 	}
 }
@@ -1277,7 +1380,7 @@ int hdlc_fr_ioctl(struct net_device *dev, struct ifreq *ifr)
 		    ifr->ifr_settings.type == IF_PROTO_FR_ADD_ETH_PVC)
 			return fr_add_pvc(dev, pvc.dlci, result);
 		else
-			return fr_del_pvc(hdlc, pvc.dlci, result);
+			return fr_del_pvc(dev, pvc.dlci, result);
 	}
 
 	return -EINVAL;
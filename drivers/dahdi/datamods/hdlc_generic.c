@@ -35,6 +35,7 @@
 #include <linux/inetdevice.h>
 #include <linux/lapb.h>
 #include <linux/rtnetlink.h>
+#include <linux/rcupdate.h>
 #include <linux/hdlc.h>
 
 
@@ -353,6 +354,8 @@ static int __init hdlc_module_init(void)
 static void __exit hdlc_module_exit(void)
 {
 	dev_remove_pack(&hdlc_packet_type);
+	/* Frame Relay PVCs are freed through call_rcu() */
+	rcu_barrier();
 }
 
 
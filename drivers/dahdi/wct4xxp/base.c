@@ -771,11 +771,17 @@ static void t4_check_vpm(struct t4 *wc)
 						unsigned long flags;
 						struct dahdi_chan *chan = wc->tspans[span]->span.chans[channel];
 						int y;
+						struct dahdi_ring *const ring = &chan->rxring;
+						unsigned int used;
 						spin_lock_irqsave(&chan->lock, flags);
 						for (y=0;y<chan->numbufs;y++) {
 							if ((chan->inreadbuf > -1) && (chan->readidx[y]))
 								memset(chan->readbuf[chan->inreadbuf], DAHDI_XLAW(0, chan), chan->readidx[y]);
 						}
+						/* Audio channels queue in the receive ring */
+						used = dahdi_ring_used(ring);
+						for (y = 0; y < used; y++)
+							ring->buf[(ring->tail + y) & ring->mask] = DAHDI_XLAW(0, chan);
 						spin_unlock_irqrestore(&chan->lock, flags);
 					}
 					set_bit(channel, &wc->tspans[span]->dtmfactive);
@@ -2049,6 +2055,7 @@ static void free_wc(struct t4 *wc)
 static int t4_alloc_channels(struct t4 *wc, struct t4_span *ts,
 			     enum linemode linemode)
 {
+	const int nid = dev_to_node(&wc->dev->dev);
 	int i;
 
 	if (test_bit(DAHDI_FLAGBIT_REGISTERED, &ts->span.flags)) {
@@ -2071,14 +2078,14 @@ static int t4_alloc_channels(struct t4 *wc, struct t4_span *ts,
 		struct dahdi_chan *chan;
 		struct dahdi_echocan_state *ec;
 
-		chan = kzalloc(sizeof(*chan), GFP_KERNEL);
+		chan = kzalloc_node(sizeof(*chan), GFP_KERNEL, nid);
 		if (!chan) {
 			free_wc(wc);
 			return -ENOMEM;
 		}
 		ts->chans[i] = chan;
 
-		ec = kzalloc(sizeof(*ec), GFP_KERNEL);
+		ec = kzalloc_node(sizeof(*ec), GFP_KERNEL, nid);
 		if (!ec) {
 			free_wc(wc);
 			return -ENOMEM;
@@ -5154,7 +5161,8 @@ t4_init_one(struct pci_dev *pdev, const struct pci_device_id *ent)
 		struct t4_span *ts;
 		enum linemode linemode;
 
-		ts = kzalloc(sizeof(*ts), GFP_KERNEL);
+		ts = kzalloc_node(sizeof(*ts), GFP_KERNEL,
+				  dev_to_node(&wc->dev->dev));
 		if (!ts) {
 			free_wc(wc);
 			return -ENOMEM;
@@ -5193,6 +5201,8 @@ t4_init_one(struct pci_dev *pdev, const struct pci_device_id *ent)
 		free_wc(wc);
 		return -EIO;
 	}
+	dahdi_set_irq_affinity_hint(wc->ddev, pdev->irq,
+				    dev_to_node(&pdev->dev));
 	
 	init_spans(wc);
 
@@ -5300,6 +5310,7 @@ static void _t4_remove_one(struct t4 *wc)
 	if (!(wc->tspans[0]->spanflags & FLAG_2NDGEN))
 		basesize = basesize * 2;
 
+	dahdi_clear_irq_affinity_hint(wc->ddev);
 	free_irq(wc->dev->irq, wc);
 	
 	if (wc->membase)
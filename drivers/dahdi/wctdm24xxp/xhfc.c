@@ -2316,11 +2316,24 @@ int b400m_chanconfig(struct file *file, struct dahdi_chan *chan, int sigtype)
 	return res;
 }
 
+/* Account for and queue the bytes decoded so far in b400m_dchan() */
+static void b400m_dchan_flush(struct b400m_span *bspan, u8 *frame, int *len)
+{
+	if (!*len)
+		return;
+	bspan->infcs = dahdi_fcs16(bspan->infcs, frame, *len);
+	bspan->f_sz += *len;
+	dahdi_hdlc_putbuf(bspan->sigchan, frame, *len);
+	*len = 0;
+}
+
 int b400m_dchan(struct dahdi_span *span)
 {
 	struct b400m_span *bspan;
 	struct b400m *b4;
 	unsigned char *rxb;
+	u8 frame[DAHDI_CHUNKSIZE];
+	int len = 0;
 	int res;
 	int i;
 
@@ -2348,6 +2361,7 @@ int b400m_dchan(struct dahdi_span *span)
 		if (res & RETURN_EMPTY_FLAG)
 			continue;
 		else if (res & RETURN_COMPLETE_FLAG) {
+			b400m_dchan_flush(bspan, frame, &len);
 
 			if (!bspan->f_sz)
 				continue;
@@ -2363,6 +2377,7 @@ int b400m_dchan(struct dahdi_span *span)
 			bspan->f_sz = 0;
 			continue;
 		} else if (res & RETURN_DISCARD_FLAG) {
+			b400m_dchan_flush(bspan, frame, &len);
 
 			if (!bspan->f_sz)
 				continue;
@@ -2372,12 +2387,10 @@ int b400m_dchan(struct dahdi_span *span)
 			bspan->f_sz = 0;
 			break;
 		} else {
-			unsigned char rxc = res;
-			bspan->infcs = PPP_FCS(bspan->infcs, rxc);
-			bspan->f_sz++;
-			dahdi_hdlc_putbuf(bspan->sigchan, &rxc, 1);
+			frame[len++] = res;
 		}
 	}
+	b400m_dchan_flush(bspan, frame, &len);
 
 	return 0;
 }
@@ -1743,6 +1743,7 @@ t13x_spanconfig(struct file *file, struct dahdi_span *span,
  */
 static int t13x_software_init(struct t13x *wc, enum linemode type)
 {
+	const int nid = dev_to_node(&wc->xb.pdev->dev);
 	int x;
 	struct dahdi_chan *chans[32] = {NULL,};
 	struct dahdi_echocan_state *ec[32] = {NULL,};
@@ -1754,8 +1755,8 @@ static int t13x_software_init(struct t13x *wc, enum linemode type)
 		return 0;
 
 	for (x = 0; x < ((E1 == type) ? 31 : 24); x++) {
-		chans[x] = kzalloc(sizeof(*chans[x]), GFP_KERNEL);
-		ec[x] = kzalloc(sizeof(*ec[x]), GFP_KERNEL);
+		chans[x] = kzalloc_node(sizeof(*chans[x]), GFP_KERNEL, nid);
+		ec[x] = kzalloc_node(sizeof(*ec[x]), GFP_KERNEL, nid);
 		if (!chans[x] || !ec[x])
 			goto error_exit;
 	}
@@ -2441,6 +2441,7 @@ t43x_spanconfig(struct file *file, struct dahdi_span *span,
 static int
 t43x_init_one_span(struct t43x *wc, struct t43x_span *ts, enum linemode type)
 {
+	const int nid = dev_to_node(&wc->xb.pdev->dev);
 	int x;
 	struct dahdi_chan *chans[32] = {NULL,};
 	struct dahdi_echocan_state *ec[32] = {NULL,};
@@ -2451,8 +2452,8 @@ t43x_init_one_span(struct t43x *wc, struct t43x_span *ts, enum linemode type)
 		dev_info(&wc->xb.pdev->dev, "%s\n", __func__);
 
 	for (x = 0; x < ((E1 == type) ? 31 : 24); x++) {
-		chans[x] = kzalloc(sizeof(*chans[x]), GFP_KERNEL);
-		ec[x] = kzalloc(sizeof(*ec[x]), GFP_KERNEL);
+		chans[x] = kzalloc_node(sizeof(*chans[x]), GFP_KERNEL, nid);
+		ec[x] = kzalloc_node(sizeof(*ec[x]), GFP_KERNEL, nid);
 		if (!chans[x] || !ec[x])
 			goto error_exit;
 	}
@@ -3503,6 +3504,9 @@ static int __devinit t43x_init_one(struct pci_dev *pdev,
 		goto fail_exit;
 	}
 
+	dahdi_set_irq_affinity_hint(wc->ddev, wc->xb.pdev->irq,
+				    dev_to_node(&wc->xb.pdev->dev));
+
 	if (wc->ddev->hardware_id) {
 		dev_info(&wc->xb.pdev->dev, "Found a %s (SN: %s)\n",
 				wc->devtype->name, wc->ddev->hardware_id);
@@ -3562,6 +3566,7 @@ static void __devexit t43x_remove_one(struct pci_dev *pdev)
 
 	remove_sysfs_files(wc);
 
+	dahdi_clear_irq_affinity_hint(wc->ddev);
 	wcxb_release(&wc->xb);
 	free_wc(wc);
 }
@@ -45,12 +45,17 @@ struct fasthdlc_state {
 	int ones;		/* Number of ones */
 	enum fasthdlc_mode mode;
 	unsigned int minbits;
+	int skip;		/* Bytes to decode one at a time */
 };
 
 #ifdef FAST_HDLC_NEED_TABLES
 #define RETURN_COMPLETE_FLAG	(0x1000)
 #define RETURN_DISCARD_FLAG	(0x2000)
 #define RETURN_EMPTY_FLAG	(0x4000)
+/* The byte count returned by fasthdlc_rx_decode() */
+#define RETURN_LEN_MASK		(0x0fff)
+/* Bytes fasthdlc_rx_decode() takes one at a time after a run of five */
+#define FASTHDLC_RX_SKIP	32
 
 /* Unlike most HDLC implementations, we define only two states,
    when we are in a valid frame, and when we are searching for
@@ -128,6 +133,15 @@ static unsigned int minbits[2] = { 8, 10 };
 
 static unsigned int hdlc_encode[6][256];
 
+/*
+   The block encoder and decoder below move 16 bits at a time whenever
+   they can see that no zero needs to be stuffed or removed, which for
+   ordinary data is most of the time.  The bits are then simply the two
+   bytes LSB first, and this table reverses them.
+  */
+
+static unsigned char hdlc_bitrev[256];
+
 static inline char hdlc_search_precalc(unsigned char c)
 {
 	int x, p=0;
@@ -348,6 +362,14 @@ static inline void fasthdlc_precalc(void)
 #endif
 		}
 	}
+	/* And the trivial one */
+	for (x=0;x<256;x++) {
+		hdlc_bitrev[x] = 0;
+		for (y=0;y<8;y++) {
+			if (x & (1 << y))
+				hdlc_bitrev[x] |= 0x80 >> y;
+		}
+	}
 }
 
 
@@ -359,6 +381,7 @@ static inline void fasthdlc_init(struct fasthdlc_state *h, enum fasthdlc_mode mo
 	h->bits = 0;
 	h->data = 0;
 	h->ones = 0;
+	h->skip = 0;
 
 	switch (mode) {
 	case FASTHDLC_MODE_64:
@@ -529,5 +552,281 @@ static inline int fasthdlc_rx_run(struct fasthdlc_state *h)
 	}
 	return retval;
 }
+
+/*
+   Returns non-zero if 'ones' one bits followed by the top 16 bits of
+   'data' contain a run of five ones, in which case a zero has to be
+   stuffed (or is there to be removed), or there is a flag or an abort.
+   'ones' is at most 4.
+   */
+
+static inline int fasthdlc_run5(unsigned int data, int ones)
+{
+	unsigned int y = (data >> ones) | ~(~0U >> ones);
+
+	y &= (y << 1) & (y << 2) & (y << 3) & (y << 4);
+	return (y & (~0U << (20 - ones))) != 0;
+}
+
+/* The number of ones that bits 16 and up of 'data' end with, at most 4 */
+static inline int fasthdlc_trailing_ones(unsigned int data)
+{
+	/* Anything more would have been a run of five */
+	static const unsigned char trailing[16] = {
+		0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0, 4,
+	};
+
+	return trailing[(data >> 16) & 0xf];
+}
+
+/*
+   Like fasthdlc_run5(), but over the top 18 bits of 'data'.  The byte
+   decoder looks 2 bits past each byte before it takes it, to tell a
+   stuffed zero or a flag that starts there, so the 16 bit step has to
+   look as far.
+   */
+
+static inline int fasthdlc_rx_run5(unsigned int data, int ones)
+{
+	unsigned int y = (data >> ones) | ~(~0U >> ones);
+
+	y &= (y << 1) & (y << 2) & (y << 3) & (y << 4);
+	return (y & (~0U << (18 - ones))) != 0;
+}
+
+/* Two bytes as they go on the line, in the top 16 bits */
+static inline unsigned int fasthdlc_bitrev16(const unsigned char *p)
+{
+	return (hdlc_bitrev[p[0]] << 24) | (hdlc_bitrev[p[1]] << 16);
+}
+
+/*
+   Encodes the '*len' bytes at '*in' into at most 'room' bytes of line
+   data at 'out'.  As with fasthdlc_tx_need_data() and friends, input
+   is only taken once the bits before it have been sent, so this never
+   uses more bytes of input than it writes.  Returns the number of bytes
+   written, which is less than 'room' only if the input ran out, and
+   updates '*in' and '*len' to what is left of the input.
+
+   The state is kept in locals for the 64k case: 'out' may alias
+   anything, so the compiler would otherwise reload 'h' for every byte.
+   */
+
+static inline int fasthdlc_tx_encode(struct fasthdlc_state *h,
+				     const unsigned char **in, int *len,
+				     unsigned char *out, int room)
+{
+	const unsigned char *p = *in;
+	int left = *len;
+	unsigned int data = h->data;
+	int bits = h->bits;
+	int ones = h->ones;
+	unsigned int res;
+	int n = 0;
+
+	if (h->mode != FASTHDLC_MODE_64) {
+		while (n < room) {
+			if (fasthdlc_tx_need_data(h)) {
+				if (!left)
+					break;
+				fasthdlc_tx_load_nocheck(h, *p++);
+				left--;
+			}
+			out[n++] = fasthdlc_tx_run_nocheck(h);
+		}
+		*in = p;
+		*len = left;
+		return n;
+	}
+
+	while (n < room) {
+		if (bits < 8) {
+			if (!left)
+				break;
+			if ((left > 1) &&
+			    !fasthdlc_run5(fasthdlc_bitrev16(p), ones)) {
+				res = fasthdlc_bitrev16(p);
+				data |= res >> bits;
+				bits += 16;
+				ones = fasthdlc_trailing_ones(res);
+				p += 2;
+				left -= 2;
+			} else {
+				res = hdlc_encode[ones][*p++];
+				left--;
+				ones = (res & 0xf00) >> 8;
+				data |= (res & 0xffc00000) >> bits;
+				bits += (res & 0xf);
+			}
+		}
+		out[n++] = data >> 24;
+		data <<= 8;
+		bits -= 8;
+	}
+	h->data = data;
+	h->bits = bits;
+	h->ones = ones;
+	*in = p;
+	*len = left;
+	return n;
+}
+
+/*
+   Decodes the '*len' bytes of line data at '*in' into at most 'room'
+   bytes at 'out', stopping early at the end of a frame or at an abort.
+   Returns the number of bytes decoded, OR'd with RETURN_COMPLETE_FLAG
+   or RETURN_DISCARD_FLAG if it stopped at one of those, and updates
+   '*in' and '*len' to what is left of the input.  Line data that has
+   been taken but not decoded yet stays in 'h' for the next call.
+   At most RETURN_LEN_MASK bytes are decoded per call, whatever 'room'
+   is.  Flags that follow each other may be reported as one.
+
+   The state is worked on in a local copy, see fasthdlc_tx_encode().
+   On 64k channels, 16 bits are taken at a time while there is no run
+   of five ones in them.  Where there is, the line is decoded a byte at
+   a time for the next FASTHDLC_RX_SKIP bytes: on random data runs of
+   five are common enough that trying for 16 bits costs more than it
+   saves.
+   */
+
+static inline int fasthdlc_rx_decode(struct fasthdlc_state *h,
+				     const unsigned char **in, int *len,
+				     unsigned char *out, int room)
+{
+	struct fasthdlc_state s = *h;
+	const unsigned char *p = *in;
+	int left = *len;
+	unsigned short next;
+	int complete = 0;
+	int n = 0;
+	int res;
+
+	if (room > RETURN_LEN_MASK)
+		room = RETURN_LEN_MASK;
+
+	if (s.mode != FASTHDLC_MODE_64) {
+		while (left && (n < room)) {
+			fasthdlc_rx_load_nocheck(&s, *p++);
+			left--;
+			res = fasthdlc_rx_run(&s);
+			if (res & RETURN_EMPTY_FLAG)
+				continue;
+			if (res & (RETURN_COMPLETE_FLAG | RETURN_DISCARD_FLAG)) {
+				n |= res;
+				break;
+			}
+			out[n++] = res;
+		}
+		goto out;
+	}
+
+	while (n < room) {
+		if (s.skip) {
+			if (complete) {
+				n |= RETURN_COMPLETE_FLAG;
+				break;
+			}
+			/* Like fasthdlc_rx_load() and fasthdlc_rx_run() */
+			do {
+				if (s.bits <= 24) {
+					if (!left)
+						goto drain;
+					s.data |= (unsigned int)*p++ << (24 - s.bits);
+					s.bits += 8;
+					left--;
+					s.skip--;
+				}
+				res = fasthdlc_rx_run(&s);
+				if (res & RETURN_EMPTY_FLAG)
+					continue;
+				if (res & (RETURN_COMPLETE_FLAG |
+					   RETURN_DISCARD_FLAG)) {
+					n |= res;
+					goto out;
+				}
+				out[n++] = res;
+			} while (s.skip && (n < room));
+			continue;
+		}
+		if ((left > 1) && (s.bits <= 16)) {
+			s.data |= ((p[0] << 8) | p[1]) << (16 - s.bits);
+			s.bits += 16;
+			p += 2;
+			left -= 2;
+		}
+		while (left && (s.bits <= 24)) {
+			s.data |= (unsigned int)*p++ << (24 - s.bits);
+			s.bits += 8;
+			left--;
+		}
+		if (complete) {
+			/* Flags right behind it are empty frames: that is
+			   just an idle link, and not worth returning for */
+			if ((s.bits >= 8) && ((s.data >> 24) == 0x7e)) {
+				s.data <<= 8;
+				s.bits -= 8;
+				continue;
+			}
+			n |= RETURN_COMPLETE_FLAG;
+			break;
+		}
+		if (s.state == FRAME_SEARCH) {
+			if (s.bits < 8)
+				break;
+			next = hdlc_search[s.data >> 24];
+			s.bits -= next & 0x0f;
+			s.data <<= next & 0x0f;
+			s.state = next >> 4;
+			s.ones = 0;
+			continue;
+		}
+		if ((s.bits >= 18) && (room - n > 1)) {
+			if (!fasthdlc_rx_run5(s.data, s.ones)) {
+				out[n++] = hdlc_bitrev[s.data >> 24];
+				out[n++] = hdlc_bitrev[(s.data >> 16) & 0xff];
+				s.ones = fasthdlc_trailing_ones(s.data);
+				s.data <<= 16;
+				s.bits -= 16;
+				continue;
+			}
+			s.skip = FASTHDLC_RX_SKIP;
+		}
+		if (s.bits < 10)
+			break;
+		next = hdlc_frame[s.ones][s.data >> 22];
+		s.bits -= (next & 0x0f00) >> 8;
+		s.data <<= (next & 0x0f00) >> 8;
+		s.ones = (next & ONES_MASK) >> 12;
+		if ((next & STATUS_MASK) == STATUS_VALID) {
+			out[n++] = next & DATA_MASK;
+		} else if (next & CONTROL_COMPLETE) {
+			/* Stay in this state, the flag may open another */
+			complete = 1;
+		} else {
+			s.state = FRAME_SEARCH;
+			n |= RETURN_DISCARD_FLAG;
+			break;
+		}
+	}
+	goto out;
+
+drain:
+	/* Out of line data, decode what the 16 bit steps loaded ahead */
+	while (n < room) {
+		res = fasthdlc_rx_run(&s);
+		if (res & RETURN_EMPTY_FLAG)
+			break;
+		if (res & (RETURN_COMPLETE_FLAG | RETURN_DISCARD_FLAG)) {
+			n |= res;
+			break;
+		}
+		out[n++] = res;
+	}
+out:
+	*h = s;
+	*in = p;
+	*len = left;
+	return n;
+}
 #endif /* FAST_HDLC_NEED_TABLES */
 #endif
@@ -0,0 +1,26 @@
+/*
+ * Generic HDLC support routines for Linux
+ * Frame Relay per PVC counters
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of version 2 of the GNU General Public License
+ * as published by the Free Software Foundation.
+ */
+
+#ifndef _HDLC_FR_USER_H
+#define _HDLC_FR_USER_H
+
+#include <linux/types.h>
+
+/* Returned by SIOCDEVPRIVATE on a Frame Relay PVC device */
+struct fr_pvc_counters {
+	__u64 rx_packets;
+	__u64 rx_bytes;
+	__u64 rx_dropped;	/* no PVC device for the protocol */
+	__u64 tx_packets;
+	__u64 tx_bytes;
+	__u64 rx_fecn;		/* frames received with FECN set */
+	__u64 rx_becn;		/* frames received with BECN set */
+};
+
+#endif /* _HDLC_FR_USER_H */
@@ -57,6 +57,7 @@
 #include <linux/sysfs.h>
 
 #include <linux/poll.h>
+#include <linux/u64_stats_sync.h>
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 6, 29)
 #define HAVE_NET_DEVICE_OPS
@@ -182,6 +183,13 @@ struct dahdi_echocan_features {
 	u32 NLP_automatic:1;
 };
 
+/*! One channel's chunk of audio handed to echocan_process_batch(). */
+struct dahdi_echocan_chunk {
+	struct dahdi_echocan_state *ec;	/*!< Echo canceller of the channel */
+	short isig[DAHDI_CHUNKSIZE];	/*!< Receive direction (will be modified) */
+	short iref[DAHDI_CHUNKSIZE];	/*!< Transmit direction reference */
+};
+
 /*! Operations (methods) that can be performed on a DAHDI echo canceler instance (state
  * structure) after it has been created, by either a software or hardware echo canceller.
  * The echo canceler must populate the owner field of the dahdi_echocan_state structure
@@ -210,6 +218,20 @@ struct dahdi_echocan_ops {
 	 */
 	void (*echocan_process)(struct dahdi_echocan_state *ec, short *isig, const short *iref, u32 size);
 
+	/*! \brief Process one chunk for each of several channels at once.
+	 * \param[in,out] chunks The channels' audio, as for echocan_process.
+	 * \param[in] count The number of elements in chunks.
+	 *
+	 * Optional.  Used by dahdi_ec_span() instead of echocan_process for
+	 * every channel of the span that is using these ops, so any setup
+	 * (FPU, SIMD, ...) only needs to happen once per call.  Events are
+	 * reported through each state's events field, as with echocan_process.
+	 *
+	 * \return Nothing.
+	 */
+	void (*echocan_process_batch)(struct dahdi_echocan_chunk *chunks,
+				      unsigned int count);
+
 	/*! \brief Retrieve events from the echocan.
 	 * \param[in,out] ec Pointer to the state structure.
 	 *
@@ -288,6 +310,25 @@ int dahdi_register_echocan_factory(const struct dahdi_echocan_factory *ec);
  */
 void dahdi_unregister_echocan_factory(const struct dahdi_echocan_factory *ec);
 
+/*! \brief Get a zeroed block for an echo canceler's state.
+ * \param[in] chan The channel the echo canceler is for, or NULL.
+ * \param[in] size The size of the state.
+ *
+ * For use from echocan_create(). Blocks are recycled through a pool kept
+ * by the DAHDI core (on the NUMA node of the channel's hardware), so
+ * that enabling echo cancellation usually does not need to allocate.
+ *
+ * \return The block, or NULL if out of memory.
+ */
+void *dahdi_echocan_state_alloc(const struct dahdi_chan *chan, size_t size);
+
+/*! \brief Release a block from dahdi_echocan_state_alloc().
+ * \param[in] state The block, may be NULL.
+ *
+ * \return Nothing.
+ */
+void dahdi_echocan_state_free(void *state);
+
 enum dahdi_echocan_mode {
 	__ECHO_MODE_MUTE = 1 << 8,
 	ECHO_MODE_IDLE = 0,
@@ -329,8 +370,24 @@ struct dahdi_echocan_state {
 
 		/*! How many samples to wait before beginning the training operation. */
 		u32 pretrain_timer;
+
+		/*! The tail length the echocan was created with. */
+		u32 tap_length;
+
+		/*! How many samples the reference has been silent for. */
+		u32 silent;
 	} status;
 
+	/*! Set by the DAHDI core while this instance is in an
+	 * echocan_process_batch() call, which runs without the channel's lock.
+	 */
+	bool in_batch;
+
+	/*! Set by the DAHDI core when the NLP was switched while in_batch, so
+	 * echocan_NLP_toggle() is called once the batch is done.
+	 */
+	bool nlp_pending;
+
 	/*! This structure contains event flags, allowing the echocan to report
 	 * events that occurred as it processed the transmit and receive streams
 	 * of samples. Each call to the echocan_process operation for this
@@ -369,6 +426,117 @@ struct dahdi_echocan_state {
 			u32 NLP_auto_enabled:1;
 		} bit;
 	} events;
+
+	/*! Statistics reported through DAHDI_EC_GETSTATS. Software echo
+	 * cancelers count double talk and filter updates; the DAHDI core
+	 * keeps the rest while it calls echocan_process.
+	 */
+	struct {
+		/*! Times near end speech was detected. */
+		u32 dtd;
+		/*! Filter updates done. */
+		u32 adapt;
+		/*! Filter updates skipped for double talk or too little signal. */
+		u32 adapt_skipped;
+
+		/*! Smoothed mean squares of the reference, the receive signal
+		 * and the echo cancelled signal, while the reference is active.
+		 */
+		u32 ref_pow;
+		u32 in_pow;
+		u32 out_pow;
+		/*! Chunks skipped because the reference was silent. */
+		u32 gated;
+		/*! Chunks processed and the time spent on them. */
+		u32 chunks;
+		u32 max_ns;
+		u64 total_ns;
+	} stats;
+};
+
+/**
+ * struct dahdi_ring - Byte ring between the tick and read() / write().
+ * @buf:	Storage, @mask + 1 bytes long.  The size is a power of two.
+ * @mask:	Size of @buf minus one.
+ * @depth:	How many bytes may be queued, at most @mask + 1.
+ * @head:	Free running producer index.
+ * @tail:	Free running consumer index.
+ *
+ * There is only ever one producer and one consumer, and each only writes
+ * its own index, so data moves through the ring without the channel lock.
+ */
+struct dahdi_ring {
+	u_char *buf;
+	unsigned int mask;
+	unsigned int depth;
+	unsigned int head;
+	unsigned int tail;
+	/* DAHDI_RING_BUSY while read() / write() use the ring without
+	 * chan->lock, DAHDI_RING_RESET while it is waiting to be emptied */
+	unsigned long state;
+};
+
+enum {
+	DAHDI_RING_BUSY,
+	DAHDI_RING_RESET,
+};
+
+static inline unsigned int dahdi_ring_used(const struct dahdi_ring *ring)
+{
+	return READ_ONCE(ring->head) - READ_ONCE(ring->tail);
+}
+
+/* Octets in an MTP2 fill-in signal unit and the longest link status signal
+ * unit, counting the FCS */
+#define DAHDI_MTP2_FISU_LEN	5
+#define DAHDI_MTP2_LSSU_MAX	7
+
+/* Indexes into dahdi_hdlc_counters, in the order of struct dahdi_hdlc_stats */
+enum dahdi_hdlc_counter {
+	DAHDI_HDLC_RX_FRAMES,
+	DAHDI_HDLC_RX_BYTES,
+	DAHDI_HDLC_RX_ABORTS,
+	DAHDI_HDLC_RX_BADFCS,
+	DAHDI_HDLC_RX_OVERRUNS,
+	DAHDI_HDLC_RX_DROPPED,
+	DAHDI_HDLC_RX_NOBUF,
+	DAHDI_HDLC_TX_FRAMES,
+	DAHDI_HDLC_TX_BYTES,
+	DAHDI_HDLC_RX_SUPPRESSED,
+	DAHDI_HDLC_TX_REPEATED,
+	DAHDI_HDLC_NR_COUNTERS,
+};
+
+/**
+ * struct dahdi_txrepeat - Frame an HDLC channel sends when it has no other.
+ * @frame:	Two frames, as they would be written, FCS filled in.
+ * @len:	Octets in each of @frame.  0 if there is nothing to repeat.
+ * @cur:	Which of @frame is being sent.
+ * @idx:	Octets of it handed to the transmitter so far, 0 between frames.
+ * @pending:	The other frame replaces it at the next frame boundary.
+ *
+ * DAHDI_HDLC_TXREPEAT only ever fills in the frame that is not being sent,
+ * so a frame half way out is never changed under the transmitter.
+ */
+struct dahdi_txrepeat {
+	u8 frame[2][DAHDI_HDLC_REPEAT_MAX];
+	u8 len[2];
+	u8 cur;
+	u8 idx;
+	bool pending;
+};
+
+/**
+ * struct dahdi_hdlc_counters - One CPU's share of a channel's HDLC counters.
+ *
+ * Updated from whichever CPU happens to run the tick, inside sections that
+ * already hold the channel lock, so there is one writer per CPU at a time.
+ * Readers take no lock at all and use @syncp to get untorn values on 32 bit
+ * machines.
+ */
+struct dahdi_hdlc_counters {
+	u64 cnt[DAHDI_HDLC_NR_COUNTERS];
+	struct u64_stats_sync syncp;
 };
 
 struct dahdi_chan {
@@ -378,10 +546,10 @@ struct dahdi_chan {
 #endif
 #ifdef CONFIG_DAHDI_PPP
 	struct ppp_channel *ppp;
-	struct tasklet_struct ppp_calls;
-	int do_ppp_wakeup;
-	int do_ppp_error;
-	struct sk_buff_head ppp_rq;
+	struct list_head ppp_node;	/*!< On a dahdi_ppp_batch while calls are pending */
+	unsigned long ppp_events;	/*!< DAHDI_PPP_* calls to make */
+	struct sk_buff_head ppp_rq;	/*!< Received frames for ppp_input() */
+	unsigned int ppp_rx_dropped;	/*!< Frames dropped with ppp_rq full */
 #endif
 #ifdef BUFFER_DEBUG
 	int statcount;
@@ -450,12 +618,19 @@ struct dahdi_chan {
 	u_char		*writebuf[DAHDI_MAX_NUM_BUFS]; /*!< write buffers */
 	int		inwritebuf;
 	int		outwritebuf;
+
+	/* Unframed channels stream through these instead, they share the
+	 * memory of readbuf[] and writebuf[] */
+	struct dahdi_ring rxring;
+	struct dahdi_ring txring;
 	
 	int		blocksize;	/*!< Block size */
 
 	int		eventinidx;  /*!< out index in event buf (circular) */
 	int		eventoutidx;  /*!< in index in event buf (circular) */
 	unsigned int	eventbuf[DAHDI_MAX_EVENTSIZE];  /*!< event circ. buffer */
+	u32		eventticks[DAHDI_MAX_EVENTSIZE];  /*!< tick each event was queued on */
+	unsigned int	eventoverflows;  /*!< events dropped because eventbuf was full */
 	
 	int		readn[DAHDI_MAX_NUM_BUFS];  /*!< # of bytes ready in read buf */
 	int		readidx[DAHDI_MAX_NUM_BUFS];  /*!< current read pointer */
@@ -492,7 +667,12 @@ struct dahdi_chan {
 	/* HDLC state machines */
 	struct fasthdlc_state txhdlc;
 	struct fasthdlc_state rxhdlc;
-	int infcs;
+	/*! Allocated the first time the channel is put in an HDLC mode */
+	struct dahdi_hdlc_counters __percpu *hdlc_counters;
+	/*! Last MTP2 FISU or LSSU handed to the reader, FCS included */
+	u8 mtp2_rxlast[DAHDI_MTP2_LSSU_MAX];
+	u8 mtp2_rxlen;
+	struct dahdi_txrepeat txrepeat;
 
 	/* Conferencing stuff */
 	int		confna;	/*! conference number (alias) */
@@ -586,6 +766,16 @@ struct dahdi_chan {
 struct dahdi_hdlc {
 	struct net_device *netdev;
 	struct dahdi_chan *chan;
+	/* Frames from dahdi_xmit(), sent straight from the skb */
+	struct sk_buff_head txq;
+	struct sk_buff *txskb;		/*!< The frame being sent */
+	unsigned int txidx;		/*!< Next byte of it, FCS included */
+	/* The frame being received, decoded straight into the skb */
+	struct sk_buff *rxskb;
+	unsigned int rxheadroom;
+	/* Received frames, handed to the stack from dahdi_net_poll() */
+	struct sk_buff_head rxq;
+	struct napi_struct napi;
 };
 #endif
 
@@ -695,7 +885,10 @@ enum {
 	DAHDI_FLAGBIT_BUFEVENTS	= 21,	/*!< Report buffer events */
 	DAHDI_FLAGBIT_TXUNDERRUN = 22,	/*!< Transmit underrun condition */
 	DAHDI_FLAGBIT_RXOVERRUN = 23,	/*!< Receive overrun condition */
+	DAHDI_FLAGBIT_OOBEVENTS	= 24,	/*!< Pending events do not interrupt read/write */
 	DAHDI_FLAGBIT_DEVFILE	= 25,	/*!< Channel has a sysfs dev file */
+	DAHDI_FLAGBIT_MONITORED	= 26,	/*!< Is the target of a monitor or digitalmon conference */
+	DAHDI_FLAGBIT_MTP2RX	= 27,	/*!< Do not pass on repeated MTP2 FISUs and LSSUs */
 };
 
 #ifdef CONFIG_DAHDI_NET
@@ -763,6 +956,9 @@ struct dahdi_count {
 #define DAHDI_FLAG_BUFEVENTS	DAHDI_FLAG(BUFEVENTS)
 #define DAHDI_FLAG_TXUNDERRUN	DAHDI_FLAG(TXUNDERRUN)
 #define DAHDI_FLAG_RXOVERRUN	DAHDI_FLAG(RXOVERRUN)
+#define DAHDI_FLAG_OOBEVENTS	DAHDI_FLAG(OOBEVENTS)
+#define DAHDI_FLAG_MONITORED	DAHDI_FLAG(MONITORED)
+#define DAHDI_FLAG_MTP2RX	DAHDI_FLAG(MTP2RX)
 
 enum spantypes {
 	SPANTYPE_INVALID	= 0,
@@ -906,7 +1102,33 @@ struct dahdi_device {
 	struct device dev;
 	unsigned int irqmisses;
 	ktime_t registration_time;
+	unsigned int hint_irq;		/*!< IRQ given an affinity hint, or 0 */
+	int hint_node;			/*!< The node hint_irq was pointed at */
+};
+
+/* Largest number of channels on a single span (dahdi_dynamic allows 255) */
+#define DAHDI_MAX_SPAN_CHANS	256
+
+struct dahdi_tsi;
+struct dahdi_ec_defer;
+struct dahdi_hdlc_defer;
+
+#ifdef CONFIG_DAHDI_PPP
+/**
+ * struct dahdi_ppp_batch - PPP channels with calls pending into ppp_generic.
+ * @lock:	Protects @pending.
+ * @pending:	Channels, linked through their ppp_node.
+ * @tasklet:	Makes the calls for every channel on @pending.
+ *
+ * The tick queues a channel here at most once however many frames it
+ * finished or received, and the tasklet runs once for the whole span.
+ */
+struct dahdi_ppp_batch {
+	spinlock_t lock;
+	struct list_head pending;
+	struct tasklet_struct tasklet;
 };
+#endif
 
 struct dahdi_span {
 	spinlock_t lock;
@@ -939,6 +1161,21 @@ struct dahdi_span {
 	int offset;			/*!< Offset within a given card */
 	int lastalarms;			/*!< Previous alarms */
 
+	/* Channels, by chanpos - 1, that may have hook state timers running */
+	DECLARE_BITMAP(rxtimers, DAHDI_MAX_SPAN_CHANS);
+	DECLARE_BITMAP(txtimers, DAHDI_MAX_SPAN_CHANS);
+	/* Channels that need more than silence transmitted each tick */
+	DECLARE_BITMAP(active, DAHDI_MAX_SPAN_CHANS);
+	/* Software DACS cross-connects onto this span (RCU protected) */
+	struct dahdi_tsi *tsi;
+	/* Set while echo cancellation runs on a worker (RCU protected) */
+	struct dahdi_ec_defer *ec_defer;
+	/* Set while HDLC framing runs on a kernel thread (RCU protected) */
+	struct dahdi_hdlc_defer *hdlc_defer;
+#ifdef CONFIG_DAHDI_PPP
+	struct dahdi_ppp_batch ppp;
+#endif
+
 #ifdef CONFIG_DAHDI_WATCHDOG
 	int watchcounter;
 	int watchstate;
@@ -1158,6 +1395,9 @@ void dahdi_hdlc_putbuf(struct dahdi_chan *ss, unsigned char *rxb, int bytes);
  * and 1 if the currently transmitted message is now done */
 int dahdi_hdlc_getbuf(struct dahdi_chan *ss, unsigned char *bufptr, unsigned int *size);
 
+/*! Update an HDLC FCS (as PPP_FCS()) with len bytes of buf */
+u16 dahdi_fcs16(u16 fcs, const u8 *buf, size_t len);
+
 /*! Register a device.  Returns 0 on success, -1 on failure. */
 struct dahdi_device *dahdi_create_device(void);
 int dahdi_register_device(struct dahdi_device *ddev, struct device *parent);
@@ -1165,6 +1405,38 @@ void dahdi_unregister_device(struct dahdi_device *ddev);
 void dahdi_free_device(struct dahdi_device *ddev);
 void dahdi_init_span(struct dahdi_span *span);
 
+/*! Point a device's interrupt at the CPUs of node nid (if enabled) */
+void dahdi_set_irq_affinity_hint(struct dahdi_device *ddev, unsigned int irq,
+				 int nid);
+/*! Drop the hint again. Must be called before free_irq(). */
+void dahdi_clear_irq_affinity_hint(struct dahdi_device *ddev);
+
+#ifndef NUMA_NO_NODE
+#define NUMA_NO_NODE	(-1)
+#endif
+
+/**
+ * dahdi_device_node() - The NUMA node of the hardware behind a device.
+ *
+ * NUMA_NO_NODE if it is not known, as before the device is registered.
+ */
+static inline int dahdi_device_node(const struct dahdi_device *ddev)
+{
+	if (!ddev || !ddev->dev.parent)
+		return NUMA_NO_NODE;
+	return dev_to_node(ddev->dev.parent);
+}
+
+static inline int dahdi_span_node(const struct dahdi_span *span)
+{
+	return (span) ? dahdi_device_node(span->parent) : NUMA_NO_NODE;
+}
+
+static inline int dahdi_chan_node(const struct dahdi_chan *chan)
+{
+	return (chan) ? dahdi_span_node(chan->span) : NUMA_NO_NODE;
+}
+
 /*! Allocate / free memory for a transcoder */
 struct dahdi_transcoder *dahdi_transcoder_alloc(int numchans);
 void dahdi_transcoder_free(struct dahdi_transcoder *ztc);
@@ -1371,6 +1643,26 @@ static inline short dahdi_txtone_nextsample(struct dahdi_chan *ss)
 /*! Maximum audio mask */
 #define DAHDI_FORMAT_AUDIO_MASK	((1 << 16) - 1)
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 18, 0)
+/* struct_size - Added in 4.18.0, this one does not check for overflow */
+#define struct_size(p, member, n) \
+	(sizeof(*(p)) + (n) * sizeof(*(p)->member))
+#else
+#include <linux/overflow.h>
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 16, 0)
+/* wait_var_event - Added in 4.16.0, this one polls every jiffy instead */
+#define wait_var_event(var, condition)				\
+	do {							\
+		while (!(condition))				\
+			schedule_timeout_uninterruptible(1);	\
+	} while (0)
+#define wake_up_var(var) do { } while (0)
+#else
+#include <linux/wait_bit.h>
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
 
 #undef DAHDI_HAVE_PROC_OPS
@@ -1427,6 +1719,11 @@ timer_setup(struct timer_list *timer,
 #endif
 #endif
 
+#ifndef READ_ONCE
+#define READ_ONCE(x) ACCESS_ONCE(x)
+#define WRITE_ONCE(x, val) (ACCESS_ONCE(x) = (val))
+#endif
+
 #ifndef DAHDI_HAVE_KTIME_MS_DELTA
 static inline s64 dahdi_ktime_to_ms(const ktime_t kt)
 {
@@ -1454,6 +1751,10 @@ static inline s64 ktime_ms_delta(const ktime_t later, const ktime_t earlier)
 #define smp_mb__after_atomic smp_mb__after_clear_bit
 #endif
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+#define u64_stats_init(syncp) do { } while (0)
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 10, 0)
 #ifdef RHEL_RELEASE_VERSION
 #if RHEL_RELEASE_CODE < RHEL_RELEASE_VERSION(6, 5)
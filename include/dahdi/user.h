@@ -767,13 +767,19 @@ struct dahdi_tone_def_header {
 /*
  * Get/Set buffer policy 
  */
+/*
+ * Channels that are not framed (audio and clear channels) may use up to
+ * DAHDI_MAX_BUF_SPACE / bufsize buffers, framed (HDLC) channels are limited to
+ * DAHDI_MAX_NUM_BUFS.
+ */
 struct dahdi_bufferinfo {
 	int txbufpolicy;	/* Policy for handling receive buffers */
 	int rxbufpolicy;	/* Policy for handling receive buffers */
 	int numbufs;		/* How many buffers to use */
 	int bufsize;		/* How big each buffer is */
 	int readbufs;		/* How many read buffers are full (read-only) */
-	int writebufs;		/* How many write buffers are full (read-only) */
+	int writebufs;		/* How many write buffers are queued,
+				   including a partial one (read-only) */
 };
 
 #define DAHDI_GET_BUFINFO		_IOR(DAHDI_CODE, 27, struct dahdi_bufferinfo)
@@ -1102,6 +1108,124 @@ struct dahdi_vmwi_info {
  */
 #define DAHDI_BUFFER_EVENTS		_IOW(DAHDI_CODE, 105, int)
 
+/*
+ * Get all pending events on a channel at once.  Each event carries the DAHDI
+ * tick (one per DAHDI_CHUNKSIZE samples) it was queued on.  'overflows' is the
+ * number of events dropped because the event queue was full since the
+ * channel was opened or its events were last flushed.
+ */
+struct dahdi_event {
+	__u32 event;		/* DAHDI_EVENT_* */
+	__u32 tick;		/* Tick the event was queued on */
+};
+
+struct dahdi_event_list {
+	__u32 count;		/* Number of valid entries in events[] */
+	__u32 overflows;	/* Events lost because the queue was full */
+	struct dahdi_event events[DAHDI_MAX_EVENTSIZE];
+};
+
+#define DAHDI_GETEVENTS			_IOR(DAHDI_CODE, 106, struct dahdi_event_list)
+
+/*
+  Deliver events out of band.  When enabled, pending events no longer make
+  read() and write() fail with ELAST.  Applications are expected to wait for
+  POLLPRI (or DAHDI_IOMUX_SIGEVENT) and fetch events with DAHDI_GETEVENT or
+  DAHDI_GETEVENTS instead.  Disabled by default.
+ */
+#define DAHDI_OOB_EVENTS		_IOW(DAHDI_CODE, 107, int)
+
+/*
+ * Cross connect every channel of dstspan to the channel in the same position
+ * on srcspan, as if DAHDI_CHANCONFIG had been issued with DAHDI_SIG_DACS (or
+ * DAHDI_SIG_DACS_RBS when rbs is set) for each of them.  Stops at the end of
+ * the shorter span.  A srcspan of 0 removes all DACS connections on dstspan.
+ */
+struct dahdi_span_dacs {
+	int	dstspan;	/* Span whose channels transmit the data */
+	int	srcspan;	/* Span the data is received on, or 0 */
+	int	rbs;		/* Pass robbed bits along as well */
+};
+
+#define DAHDI_SPAN_DACS			_IOW(DAHDI_CODE, 108, struct dahdi_span_dacs)
+
+/*
+ * Statistics of the echo canceller on a channel, since it was enabled.  ERL
+ * and ERLE are estimated from the signal levels while the far end is
+ * talking, and are 0 until it has.  Filter updates are counted in the
+ * canceller's own units (samples or blocks) and are only reported by
+ * software echo cancellers.  ERL, ERLE, chunks and the times stay 0 unless
+ * the dahdi module's ec_stats parameter is set.
+ */
+struct dahdi_echocan_stats {
+	__s32 erl;		/* Echo return loss, in 0.1 dB */
+	__s32 erle;		/* Echo return loss enhancement, in 0.1 dB */
+	__u32 dtd;		/* Double talk detections */
+	__u32 adapt;		/* Filter updates done */
+	__u32 adapt_skipped;	/* Filter updates skipped (double talk, silence) */
+	__u32 chunks;		/* Chunks processed */
+	__u32 avg_ns;		/* Average time spent on a chunk */
+	__u32 max_ns;		/* Longest time spent on a chunk */
+	__u32 gated;		/* Chunks skipped, the reference was silent */
+};
+
+#define DAHDI_EC_GETSTATS		_IOR(DAHDI_CODE, 109, struct dahdi_echocan_stats)
+
+/*
+ * Frame counters of an HDLC channel, since it was first configured for
+ * HDLC.  Byte counts include the FCS.  rx_dropped counts whole frames that
+ * were received fine but had nowhere to go, while rx_nobuf counts the
+ * octets thrown away because all of the channel's read buffers were full.
+ * If rx_nobuf grows, the reader is too slow for the numbufs / blocksize it
+ * asked for.
+ */
+struct dahdi_hdlc_stats {
+	__u64 rx_frames;	/* Good frames received */
+	__u64 rx_bytes;		/* Octets in the good frames */
+	__u64 rx_aborts;	/* Frames ended by an abort or idle */
+	__u64 rx_badfcs;	/* Frames with a bad FCS */
+	__u64 rx_overruns;	/* Frames longer than the block size */
+	__u64 rx_dropped;	/* Good frames dropped */
+	__u64 rx_nobuf;		/* Octets dropped, no free read buffer */
+	__u64 tx_frames;	/* Frames sent */
+	__u64 tx_bytes;		/* Octets in the frames sent */
+	__u64 rx_suppressed;	/* Repeated MTP2 FISUs / LSSUs not passed on */
+	__u64 tx_repeated;	/* Frames sent from DAHDI_HDLC_TXREPEAT */
+};
+
+#define DAHDI_HDLC_GETSTATS		_IOR(DAHDI_CODE, 110, struct dahdi_hdlc_stats)
+
+/*
+ * MTP2 receive filter.  An idle SS7 link carries an endless stream of
+ * identical fill-in signal units (FISUs) and link status signal units
+ * (LSSUs).  When enabled, an FISU or LSSU that is the same as the last one
+ * read is dropped in the kernel.  MSUs and any FISU or LSSU that differs
+ * from the last one are still delivered.  The dropped frames are counted in
+ * dahdi_hdlc_stats.rx_suppressed.  Channels configured with DAHDI_SIG_MTP2
+ * filter like this already.  Disabled by default, and on close.
+ */
+#define DAHDI_MTP2_RXFILTER		_IOW(DAHDI_CODE, 111, int)
+
+/*
+ * Set the frame an HDLC channel sends over and over again while nothing
+ * else is queued, instead of idle flags.  An SS7 stack sets its current
+ * FISU or LSSU here once, rather than writing it out hundreds of times a
+ * second.  Frames written to the channel still go first, between repeats.
+ * The frame is given as it would be to write(): in FCS mode, the last two
+ * octets are replaced with the FCS.  A len of 0 goes back to idle flags.
+ * A new frame takes over at the next frame boundary.  Cleared on close.
+ * Channels configured with DAHDI_SIG_MTP2 already send the last frame
+ * written again and again, and fail this with EBUSY.
+ */
+#define DAHDI_HDLC_REPEAT_MAX		32
+
+struct dahdi_hdlc_repeat {
+	__u32 len;
+	__u8 frame[DAHDI_HDLC_REPEAT_MAX];
+};
+
+#define DAHDI_HDLC_TXREPEAT		_IOW(DAHDI_CODE, 112, struct dahdi_hdlc_repeat)
+
 /* Get current status IOCTL */
 /* Defines for Radio Status (dahdi_radio_stat.radstat) bits */
 